@@ -0,0 +1,195 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boxpreprocessor.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include <image/framebufferpool.h>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LYLI_BOXPREPROCESSOR_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// radius where frequencies are cut off by the FFTPreprocessor
+constexpr int HIGHPASS_CUTOFF = 10;
+
+// number of columns summed by one task of the vertical pass
+constexpr int COLUMN_STRIP = 256;
+
+/**
+ * Get the radius of the box removing the variations that are slower than the cut-off frequency.
+ *
+ * The first zero of the frequency response of the box is at the cut-off frequency.
+ */
+int getBoxRadius(int size) {
+	return std::max(std::min(size / HIGHPASS_CUTOFF / 2, (size - 1) / 2), 1);
+}
+
+/**
+ * Wrap the index around the image border, the index must be less than size away from it.
+ */
+int wrap(int index, int size) {
+	if (index < 0) {
+		return index + size;
+	}
+	if (index >= size) {
+		return index - size;
+	}
+	return index;
+}
+
+/**
+ * A function moving the window of the column sums one row down.
+ */
+using SlideFunction = void (*)(std::int32_t *sums, const std::uint8_t *add, const std::uint8_t *sub, int count);
+
+void slideScalar(std::int32_t *sums, const std::uint8_t *add, const std::uint8_t *sub, int count) {
+	for (int i = 0; i < count; ++i) {
+		sums[i] += add[i] - sub[i];
+	}
+}
+
+#ifdef LYLI_BOXPREPROCESSOR_X86
+
+__attribute__((target("avx2")))
+void slideAvx2(std::int32_t *sums, const std::uint8_t *add, const std::uint8_t *sub, int count) {
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		const __m256i a = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(add + i)));
+		const __m256i s = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(sub + i)));
+		__m256i *out = reinterpret_cast<__m256i*>(sums + i);
+		_mm256_storeu_si256(out, _mm256_add_epi32(_mm256_loadu_si256(out), _mm256_sub_epi32(a, s)));
+	}
+	slideScalar(sums + i, add + i, sub + i, count - i);
+}
+
+#endif
+
+SlideFunction selectSlide() {
+#ifdef LYLI_BOXPREPROCESSOR_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return slideAvx2;
+	}
+#endif
+	return slideScalar;
+}
+
+/**
+ * Sum the pixels in the vertical windows of the given radius.
+ *
+ * The columns are split into strips processed in parallel.
+ */
+void sumColumns(const cv::Mat &gray, int radius, cv::Mat &sums) {
+	static const SlideFunction slide = selectSlide();
+
+	tbb::parallel_for(tbb::blocked_range<int>(0, gray.cols, COLUMN_STRIP), [&](const tbb::blocked_range<int> &range) {
+		const int first = range.begin();
+		const int count = range.end() - range.begin();
+		const std::vector<std::uint8_t> zeros(count, 0);
+		std::vector<std::int32_t> window(count, 0);
+		for (int y = -radius; y <= radius; ++y) {
+			slide(window.data(), gray.ptr<std::uint8_t>(wrap(y, gray.rows)) + first, zeros.data(), count);
+		}
+		for (int y = 0; y < gray.rows; ++y) {
+			std::copy(window.begin(), window.end(), sums.ptr<std::int32_t>(y) + first);
+			slide(window.data(),
+			      gray.ptr<std::uint8_t>(wrap(y + radius + 1, gray.rows)) + first,
+			      gray.ptr<std::uint8_t>(wrap(y - radius, gray.rows)) + first,
+			      count);
+		}
+	});
+}
+
+/**
+ * Subtract the box average from the image.
+ *
+ * The column sums are summed in the horizontal windows of the given radius, rows are processed in parallel.
+ */
+void subtractAverage(const cv::Mat &gray, const cv::Mat &sums, int radiusY, int radiusX, cv::Mat &highpass) {
+	const float scale = 1.0f / ((2 * radiusY + 1) * (2 * radiusX + 1));
+	const int cols = gray.cols;
+
+	tbb::parallel_for(tbb::blocked_range<int>(0, gray.rows), [&](const tbb::blocked_range<int> &range) {
+		for (int y = range.begin(); y < range.end(); ++y) {
+			const std::uint8_t *pixels = gray.ptr<std::uint8_t>(y);
+			const std::int32_t *columns = sums.ptr<std::int32_t>(y);
+			float *out = highpass.ptr<float>(y);
+
+			std::int64_t window = 0;
+			for (int x = -radiusX; x <= radiusX; ++x) {
+				window += columns[wrap(x, cols)];
+			}
+			for (int x = 0; x < cols; ++x) {
+				out[x] = pixels[x] - window * scale;
+				window += columns[wrap(x + radiusX + 1, cols)] - columns[wrap(x - radiusX, cols)];
+			}
+		}
+	});
+}
+
+}
+
+namespace Lyli {
+namespace Calibration {
+
+cv::Mat BoxPreprocessor::preprocess(const cv::Mat &gray) {
+	Lyli::Image::FrameBufferPool &pool = Lyli::Image::FrameBufferPool::getDefault();
+	cv::Mat outMask;
+	outMask.allocator = pool.getAllocator();
+
+	// remove all low frequency variations
+	const int radiusY = getBoxRadius(gray.rows);
+	const int radiusX = getBoxRadius(gray.cols);
+	cv::Mat sums;
+	pool.create(sums, gray.rows, gray.cols, CV_32SC1);
+	sumColumns(gray, radiusY, sums);
+	cv::Mat highpass;
+	pool.create(highpass, gray.rows, gray.cols, CV_32FC1);
+	subtractAverage(gray, sums, radiusY, radiusX, highpass);
+
+	// the rest is the same as in the FFTPreprocessor
+	// normalize the values and convert to uint8 to ensure the values are in 0-255 scale
+	cv::normalize(highpass, highpass, 0, 1, cv::NORM_MINMAX);
+	highpass.convertTo(outMask, CV_8U, 255);
+
+	// apply threshold
+	std::uint8_t threshold = cv::mean(outMask)[0] + 20;
+	cv::threshold(outMask, outMask, threshold, 255, cv::THRESH_BINARY);
+
+	// remove short spurs
+	cv::Point anchor(1, 1);
+	cv::Mat kernel = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(3, 3), anchor);
+	cv::morphologyEx(outMask, outMask, cv::MORPH_OPEN, kernel, anchor, 1, cv::BORDER_CONSTANT);
+
+	return outMask;
+}
+
+}
+}
@@ -0,0 +1,43 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LYLI_CALIBRATION_BOX_PREPROCESSOR_H_
+#define LYLI_CALIBRATION_BOX_PREPROCESSOR_H_
+
+#include <calibration/lensdetector.h>
+
+namespace Lyli {
+namespace Calibration {
+
+/**
+ * Preprocessor removing the low frequencies in the spatial domain.
+ *
+ * The image is high-pass filtered by subtracting a large box blur computed
+ * using running sums, so the cost per pixel does not depend on the box size.
+ * The box is sized to remove the same variations as the FFTPreprocessor
+ * and the image borders wrap around the same way as in the DFT.
+ */
+class BoxPreprocessor : public PreprocessorInterface {
+public:
+	// PreprocessorInterface
+	cv::Mat preprocess(const cv::Mat &gray) override;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "defectdetector.h"
+#include "calibrator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+#include <tbb/spin_mutex.h>
+
+#include <image/metadata.h>
+
+namespace {
+
+/**
+ * The minimal absolute difference of an outlier from its neighbours, so that the noise
+ * in the dark parts of the image is not mistaken for defects. The value corresponds
+ * to 64 levels of the 12-bit sensor data scaled to 16 bits.
+ */
+constexpr int MIN_DIFFERENCE = 64 << 4;
+
+/**
+ * Find the pixels of a row that are much brighter or darker than all eight nearest pixels of the same color.
+ *
+ * The rows above and below are the rows of the same color, two rows apart.
+ */
+void findOutliers(const std::uint16_t *above, const std::uint16_t *row, const std::uint16_t *below,
+                  int width, float threshold, std::uint32_t offset, std::vector<std::uint32_t> &outliers) {
+	for (int x = 2; x < width - 2; ++x) {
+		const int low = std::min({above[x - 2], above[x], above[x + 2], row[x - 2], row[x + 2], below[x - 2], below[x], below[x + 2]});
+		const int high = std::max({above[x - 2], above[x], above[x + 2], row[x - 2], row[x + 2], below[x - 2], below[x], below[x + 2]});
+		const int pixel = row[x];
+		if (pixel > high + std::max(static_cast<int>(high * threshold), MIN_DIFFERENCE)
+		    || pixel + std::max(static_cast<int>(low * threshold), MIN_DIFFERENCE) < low) {
+			outliers.push_back(offset + x);
+		}
+	}
+}
+
+}
+
+namespace Lyli {
+namespace Calibration {
+
+class DefectDetector::Impl {
+public:
+	explicit Impl(float threshold_) : threshold(threshold_), width(0), height(0), imageCount(0) {
+
+	}
+
+	float threshold;
+	std::string serial;
+	int width;
+	int height;
+	int imageCount;
+	/// number of images in which each pixel was an outlier, only the outliers are stored
+	std::unordered_map<std::uint32_t, int> outlierCounts;
+	/// Mutex to protect access to the statistics
+	tbb::spin_mutex dataAccessMutex;
+};
+
+DefectDetector::DefectDetector(float threshold) : pimpl(new Impl(threshold)) {
+
+}
+
+DefectDetector::~DefectDetector() {
+
+}
+
+void DefectDetector::addImage(const cv::Mat &mosaic, const Lyli::Image::Metadata &metadata) {
+	std::string serial = metadata.getPrivatemetadata().getCamera().getSerialnumber();
+	{
+		tbb::spin_mutex::scoped_lock lock(pimpl->dataAccessMutex);
+		if (pimpl->serial.empty()) {
+			pimpl->serial = serial;
+			pimpl->width = mosaic.cols;
+			pimpl->height = mosaic.rows;
+		}
+		if (pimpl->serial != serial || pimpl->width != mosaic.cols || pimpl->height != mosaic.rows) {
+			std::stringstream ss;
+			ss << "Camera differs, expected: " << pimpl->serial << " (" << pimpl->width << "x" << pimpl->height << ")"
+			   << ", got: " << serial << " (" << mosaic.cols << "x" << mosaic.rows << ")" << std::endl;
+			throw CameraDiffersException(ss.str());
+		}
+	}
+
+	// the outliers are collected in parallel, they are rare, so they are merged only at the end
+	tbb::enumerable_thread_specific<std::vector<std::uint32_t>> outliers;
+	tbb::parallel_for(tbb::blocked_range<int>(2, mosaic.rows - 2), [&](const tbb::blocked_range<int> &rows) {
+		std::vector<std::uint32_t> &local = outliers.local();
+		for (int y = rows.begin(); y < rows.end(); ++y) {
+			findOutliers(mosaic.ptr<std::uint16_t>(y - 2), mosaic.ptr<std::uint16_t>(y), mosaic.ptr<std::uint16_t>(y + 2),
+			             mosaic.cols, pimpl->threshold, y * mosaic.cols, local);
+		}
+	});
+
+	tbb::spin_mutex::scoped_lock lock(pimpl->dataAccessMutex);
+	++pimpl->imageCount;
+	for (const auto &local : outliers) {
+		for (std::uint32_t pixel : local) {
+			++pimpl->outlierCounts[pixel];
+		}
+	}
+}
+
+Lyli::Image::DefectMap DefectDetector::createDefectMap(float fraction) const {
+	const int minCount = std::max(static_cast<int>(std::ceil(fraction * pimpl->imageCount)), 1);
+	std::vector<std::uint32_t> pixels;
+	for (const auto &entry : pimpl->outlierCounts) {
+		if (entry.second >= minCount) {
+			pixels.push_back(entry.first);
+		}
+	}
+	return Lyli::Image::DefectMap(pimpl->serial, pimpl->width, pimpl->height, std::move(pixels));
+}
+
+void DefectDetector::reset() {
+	pimpl.reset(new Impl(pimpl->threshold));
+}
+
+}
+}
@@ -0,0 +1,90 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LYLI_CALIBRATION_DEFECTDETECTOR_H_
+#define LYLI_CALIBRATION_DEFECTDETECTOR_H_
+
+#include <memory>
+
+#include <image/defectmap.h>
+
+namespace cv {
+class Mat;
+}
+
+namespace Lyli {
+namespace Image {
+class Metadata;
+}
+}
+
+namespace Lyli {
+namespace Calibration {
+
+/**
+ * A class detecting the defective pixels of a sensor from a set of images.
+ *
+ * Each pixel is compared with the nearest pixels of the same color in every image.
+ * The pixels that are much brighter or much darker than all of them in most images
+ * are considered defective, as the image contents change between the images,
+ * but the defects stay in place.
+ */
+class DefectDetector {
+public:
+	/**
+	 * A constructor.
+	 *
+	 * @param threshold the relative difference from the neighbouring pixels above which
+	 *                  a pixel is considered an outlier in an image
+	 */
+	explicit DefectDetector(float threshold = 0.5f);
+	~DefectDetector();
+
+	/**
+	 * Add the statistics of an image.
+	 *
+	 * The images may be added concurrently from multiple threads. The metada must
+	 * correspond to the same camera as all previously added metada.
+	 *
+	 * @param mosaic the uint16_t bayer mosaic without the normalization and the defect correction
+	 * @param metadata of the image corresponding to the mosaic
+	 * @throw CameraDiffersException in case the image is from a different camera
+	 */
+	void addImage(const cv::Mat &mosaic, const Lyli::Image::Metadata &metadata);
+
+	/**
+	 * Create the defect map from the statistics of all previously added images.
+	 *
+	 * @param fraction the minimal fraction of the images in which a pixel has to be an outlier
+	 * @return the defect map
+	 */
+	Lyli::Image::DefectMap createDefectMap(float fraction = 0.5f) const;
+
+	/**
+	 * Reset the detector state, so that it can be reused for a new set of images.
+	 */
+	void reset();
+
+private:
+	class Impl;
+	std::unique_ptr<Impl> pimpl;
+};
+
+}
+}
+
+#endif
@@ -18,12 +18,23 @@
 
 #include "fftpreprocessor.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <utility>
+
+#include <image/framebufferpool.h>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
 namespace {
 
 // radius where frequencies are cut off
@@ -31,47 +42,237 @@ constexpr int HIGHPASS_CUTOFF = 10;
 // HIGHPASS_CUTOFF^2
 constexpr int HIGHPASS_CUTOFF_2 = 100;
 
+// sigma of the gaussian used by the tiles relative to the image size / HIGHPASS_CUTOFF,
+// sqrt(ln(2) / 2) / pi puts the half of the response at the cut-off frequency
+constexpr double TILE_SIGMA_SCALE = 0.18739;
+// the margin of the tiles in the multiples of sigma
+constexpr double TILE_MARGIN_SIGMAS = 3.0;
+
+/**
+ * Get the frequency stored at an index of a CCS-packed 1D spectrum.
+ */
+int getPackedFrequency(int index) {
+	return (index + 1) / 2;
+}
+
+/**
+ * Get the distance of the frequency from zero when the frequencies wrap around.
+ */
+int getUnwrappedFrequency(int frequency, int size) {
+	return std::abs(frequency <= size / 2 ? frequency : frequency - size);
+}
+
+/**
+ * Check whether the frequency is in the low-frequency disk that is removed.
+ *
+ * The frequencies are unwrapped, the same as when the disk is centered at the origin
+ * of an unpacked spectrum.
+ */
+bool isCutOff(int y, int x) {
+	return y <= HIGHPASS_CUTOFF && x <= std::round(std::sqrt(HIGHPASS_CUTOFF_2 - y*y));
+}
+
+/**
+ * Create a mask filtering a CCS-packed spectrum.
+ *
+ * The first column, and the last column for even number of columns, store the real
+ * and imaginary parts of the 1D spectra of the corresponding column vertically,
+ * all other columns store them in the pairs of consecutive columns.
+ *
+ * @param transfer function returning the value of the mask for the unwrapped frequencies y and x
+ */
+template<typename Transfer>
+cv::Mat createSpectralMask(int rows, int cols, Transfer transfer) {
+	cv::Mat mask(rows, cols, CV_32FC1);
+	for (int y = 0; y < rows; ++y) {
+		float *row = mask.ptr<float>(y);
+		for (int x = 0; x < cols; ++x) {
+			int fy = y;
+			if (x == 0 || (cols % 2 == 0 && x == cols - 1)) {
+				fy = getPackedFrequency(y);
+			}
+			const int fx = getPackedFrequency(x);
+			row[x] = transfer(getUnwrappedFrequency(fy, rows), getUnwrappedFrequency(fx, cols));
+		}
+	}
+	return mask;
+}
+
+/**
+ * Get sigma of the gaussian low-pass used by the tiles for the given image size.
+ */
+double getTileSigma(int size) {
+	return TILE_SIGMA_SCALE * size / HIGHPASS_CUTOFF;
+}
+
+/**
+ * Get the margin of the tiles that is discarded after the filtering.
+ */
+int getTileMargin(int size) {
+	return std::ceil(TILE_MARGIN_SIGMAS * getTileSigma(size));
+}
+
+/**
+ * Get size of the tile along an axis.
+ *
+ * The tiles are at least twice as large as the discarded margins, but not larger than
+ * needed to cover the whole image.
+ */
+int getTileSize(int tileSize, int size) {
+	const int margin = getTileMargin(size);
+	return std::min(std::max(tileSize, 4 * margin), size + 2 * margin);
+}
+
+/**
+ * Copy the tile starting at the given position, the image wraps around at the borders.
+ */
+void extractTile(const cv::Mat &gray, int firstRow, int firstCol, cv::Mat &tile) {
+	auto wrap = [](int index, int size) {
+		return ((index % size) + size) % size;
+	};
+	for (int y = 0; y < tile.rows; ++y) {
+		const std::uint8_t *in = gray.ptr<std::uint8_t>(wrap(firstRow + y, gray.rows));
+		float *out = tile.ptr<float>(y);
+		int x = wrap(firstCol, gray.cols);
+		for (int i = 0; i < tile.cols; ++i) {
+			out[i] = in[x];
+			if (++x == gray.cols) {
+				x = 0;
+			}
+		}
+	}
+}
+
 }
 
 namespace Lyli {
 namespace Calibration {
 
-cv::Mat FFTPreprocessor::preprocess(const cv::Mat &gray) {
-	cv::Mat outMask;
+class FFTPreprocessor::Impl {
+public:
+	explicit Impl(int tileSize_) : tileSize(tileSize_) {
+
+	}
+
+	const int tileSize;
+
+	const cv::Mat &getSpectralMask(int rows, int cols) {
+		std::lock_guard<std::mutex> lock(mutex);
+		cv::Mat &mask = spectralMasks[std::make_pair(rows, cols)];
+		if (mask.empty()) {
+			mask = createSpectralMask(rows, cols, [](int y, int x) {
+				return isCutOff(y, x) ? 0.0f : 1.0f;
+			});
+		}
+		return mask;
+	}
 
-	// create an matrix that that has two channels - one for real part and one imaginary part of DFT
+	const cv::Mat &getTileMask(int tileRows, int tileCols, int rows, int cols) {
+		std::lock_guard<std::mutex> lock(mutex);
+		cv::Mat &mask = tileMasks[std::make_tuple(tileRows, tileCols, rows, cols)];
+		if (mask.empty()) {
+			// the complement of the gaussian low-pass with the sigma given by the whole image
+			const double scaleY = 2.0 * M_PI * getTileSigma(rows) / tileRows;
+			const double scaleX = 2.0 * M_PI * getTileSigma(cols) / tileCols;
+			mask = createSpectralMask(tileRows, tileCols, [scaleY, scaleX](int y, int x) {
+				const double wy = scaleY * y;
+				const double wx = scaleX * x;
+				return static_cast<float>(1.0 - std::exp(-0.5 * (wy*wy + wx*wx)));
+			});
+		}
+		return mask;
+	}
+
+	/**
+	 * Filter the whole image at once.
+	 */
+	void filterImage(const cv::Mat &gray, cv::Mat &filtered);
+
+	/**
+	 * Filter the image in overlapping tiles.
+	 */
+	void filterTiles(const cv::Mat &gray, cv::Mat &filtered);
+
+private:
+	std::mutex mutex;
+	// the spectral masks for each image size, the entries are never removed
+	std::map<std::pair<int, int>, cv::Mat> spectralMasks;
+	// the masks of the tiles for each tile and image size
+	std::map<std::tuple<int, int, int, int>, cv::Mat> tileMasks;
+};
+
+void FFTPreprocessor::Impl::filterImage(const cv::Mat &gray, cv::Mat &filtered) {
+	// the real input is transformed to CCS-packed spectrum of the same size in place
 	// note that I don't use the optimal size for DFT, as I was not able to make the lagorithm
 	// work well when that was used
-	cv::Mat planes[] = {cv::Mat_<float>(gray), cv::Mat::zeros(gray.size(), CV_32F)};
-	cv::Mat complexI;
-	cv::merge(planes, 2, complexI);
-
-	// do the transform
-	cv::dft(complexI, complexI);
+	gray.convertTo(filtered, CV_32F);
+	cv::dft(filtered, filtered);
 
 	// the main part of the preprocess - remove all low frequency variations
-	cv::split(complexI, planes);
-	for (int i = 0; i < 2; ++i) {
-		// remove all low frequencies
-		for (int y = HIGHPASS_CUTOFF; y >= -HIGHPASS_CUTOFF; --y) {
-			int realy = cv::borderInterpolate(y, planes[i].rows, cv::BORDER_WRAP);
-			int x0 = std::round(std::sqrt(HIGHPASS_CUTOFF_2 - y*y));
-			for (int x = -x0; x <= x0; ++x) {
-				int realx = cv::borderInterpolate(x, planes[i].cols, cv::BORDER_WRAP);
-
-				planes[i].at<float>(realy, realx) = 0.0;
-			}
+	cv::multiply(filtered, getSpectralMask(gray.rows, gray.cols), filtered);
+
+	// inverse transform, in place as well
+	cv::idft(filtered, filtered, cv::DFT_SCALE | cv::DFT_REAL_OUTPUT);
+}
+
+void FFTPreprocessor::Impl::filterTiles(const cv::Mat &gray, cv::Mat &filtered) {
+	// overlap-save: the tiles overlap by the margins where the circular convolution
+	// of the DFT differs from the linear one, only the cores of the tiles are stored
+	const int tileRows = getTileSize(tileSize, gray.rows);
+	const int tileCols = getTileSize(tileSize, gray.cols);
+	const int marginY = getTileMargin(gray.rows);
+	const int marginX = getTileMargin(gray.cols);
+	const int coreRows = tileRows - 2 * marginY;
+	const int coreCols = tileCols - 2 * marginX;
+	const int tilesY = (gray.rows + coreRows - 1) / coreRows;
+	const int tilesX = (gray.cols + coreCols - 1) / coreCols;
+	const cv::Mat &mask = getTileMask(tileRows, tileCols, gray.rows, gray.cols);
+
+	tbb::parallel_for(tbb::blocked_range<int>(0, tilesY * tilesX, 1), [&](const tbb::blocked_range<int> &range) {
+		cv::Mat tile;
+		Lyli::Image::FrameBufferPool::getDefault().create(tile, tileRows, tileCols, CV_32F);
+		for (int i = range.begin(); i < range.end(); ++i) {
+			const int coreY = (i / tilesX) * coreRows;
+			const int coreX = (i % tilesX) * coreCols;
+			extractTile(gray, coreY - marginY, coreX - marginX, tile);
+			cv::dft(tile, tile);
+			cv::multiply(tile, mask, tile);
+			cv::idft(tile, tile, cv::DFT_SCALE | cv::DFT_REAL_OUTPUT);
+
+			const cv::Rect core(coreX, coreY, std::min(coreCols, gray.cols - coreX), std::min(coreRows, gray.rows - coreY));
+			cv::Mat out(filtered(core));
+			tile(cv::Rect(marginX, marginY, core.width, core.height)).copyTo(out);
 		}
-	}
-	cv::merge(planes, 2, complexI);
+	});
+}
+
+FFTPreprocessor::FFTPreprocessor(int tileSize) : pimpl(new Impl(tileSize)) {
+
+}
 
-	// inverse transform
-	cv::Mat invDFT;
-	cv::idft(complexI, invDFT, cv::DFT_SCALE | cv::DFT_REAL_OUTPUT );
+FFTPreprocessor::~FFTPreprocessor() {
+
+}
+
+cv::Mat FFTPreprocessor::preprocess(const cv::Mat &gray) {
+	// all temporaries are allocated from the pool, OpenCV uses the allocator
+	// of the output matrix when it needs to (re)allocate it
+	Lyli::Image::FrameBufferPool &pool = Lyli::Image::FrameBufferPool::getDefault();
+	cv::Mat outMask;
+	outMask.allocator = pool.getAllocator();
+
+	cv::Mat filtered;
+	pool.create(filtered, gray.rows, gray.cols, CV_32F);
+	if (pimpl->tileSize > 0) {
+		pimpl->filterTiles(gray, filtered);
+	}
+	else {
+		pimpl->filterImage(gray, filtered);
+	}
 
 	// normalize the values and convert to uint8 to ensure the values are in 0-255 scale
-	cv::normalize(invDFT, invDFT, 0, 1, cv::NORM_MINMAX);
-	invDFT.convertTo(outMask, CV_8U, 255);
+	cv::normalize(filtered, filtered, 0, 1, cv::NORM_MINMAX);
+	filtered.convertTo(outMask, CV_8U, 255);
 
 	// apply threshold
 	std::uint8_t threshold = cv::mean(outMask)[0] + 20;
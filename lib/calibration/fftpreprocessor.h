@@ -18,6 +18,8 @@
 #ifndef LYLI_CALIBRATION_FFT_PREPROCESSOR_H_
 #define LYLI_CALIBRATION_FFT_PREPROCESSOR_H_
 
+#include <memory>
+
 #include <calibration/lensdetector.h>
 
 namespace Lyli {
@@ -25,11 +27,35 @@ namespace Calibration {
 
 /**
  * Preprocessor using discrete Fourier transform.
+ *
+ * The spectral masks removing the low frequencies are cached for each image size,
+ * so that the repeated preprocessing of the calibration images does not recompute them.
+ *
+ * The image is either transformed at once, or it is split into overlapping tiles
+ * that are filtered independently in parallel (overlap-save). The tiles use a gaussian
+ * high-pass with the response halved at the cut-off frequency of the whole image,
+ * whose spatial extent fits in the overlap, so the tiles are stitched without seams.
  */
 class FFTPreprocessor : public PreprocessorInterface {
 public:
+	/// Tile size that keeps the working set of a tile in the cache.
+	static constexpr int DEFAULT_TILE_SIZE = 1024;
+
+	/**
+	 * A constructor.
+	 *
+	 * @param tileSize size of the tiles transformed independently, 0 transforms the whole image at once.
+	 *                 The tiles are enlarged when they are not at least twice as large as the overlap.
+	 */
+	explicit FFTPreprocessor(int tileSize = 0);
+	~FFTPreprocessor();
+
 	// PreprocessorInterface
 	cv::Mat preprocess(const cv::Mat &gray) override;
+
+private:
+	class Impl;
+	std::unique_ptr<Impl> pimpl;
 };
 
 }
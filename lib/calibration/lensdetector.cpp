@@ -17,29 +17,107 @@
 
 #include "lensdetector.h"
 
+#include "calibrationdata.h"
+#include "linegrid.h"
 #include "pointgrid.h"
 
+#include <image/banddecoder.h>
+#include <image/framebufferpool.h>
+#include <image/metadata.h>
+#include <image/rawimage.h>
+
 #include <algorithm>
+#include <cassert>
 #include <cmath>
+#include <cstddef>
 #include <cstdint>
+#include <utility>
+#include <vector>
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
+#include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LYLI_LENSDETECTOR_X86
+#include <immintrin.h>
+#endif
+
 namespace {
 
+/*
+ * The lenses are detected in the original image, but the positions use the swapped
+ * coordinates documented in lensfilter.cpp, ie. x is the row and y is the column
+ * of the image. The swap is done when accessing the pixels, so the image does not
+ * need to be transposed.
+ */
+
 /**
  * A constant that limits the find centroid search to search MAX_LENS_SIZE pixels
  * from the start point at most.
  */
 constexpr int MAX_LENS_SIZE = 15;
 
+/**
+ * Size of the window in the center of the image that is checked for the flat images.
+ */
+constexpr int FLAT_WINDOW_SIZE = 40;
+
+/**
+ * Get the window in the center of an image that is checked for the flat images.
+ *
+ * The window is reduced for the images smaller than the window.
+ */
+cv::Rect getFlatWindow(int width, int height) {
+	const int windowWidth = std::min(FLAT_WINDOW_SIZE, width);
+	const int windowHeight = std::min(FLAT_WINDOW_SIZE, height);
+	return cv::Rect((width - windowWidth) / 2, (height - windowHeight) / 2, windowWidth, windowHeight);
+}
+
+/**
+ * Check whether the luminance of the window is too dark or too bright.
+ */
+bool isFlatWindow(const cv::Mat &window) {
+	std::uint8_t mean = cv::mean(window)[0];
+	return mean < 16 || mean > 240;
+}
+
+/**
+ * The minimal number of the lenses found by the guided detection that form a grid.
+ */
+constexpr std::size_t MIN_GUIDED_LENSES = 100;
+
+/**
+ * Radius of the neighbourhood of the image center whose lenses align the predicted grid.
+ */
+constexpr float ALIGNMENT_RADIUS = 160.0f;
+
+/**
+ * The largest shift of the predicted grid searched by the alignment, more than a half of the lens pitch.
+ */
+constexpr float ALIGNMENT_RANGE = 8.0f;
+
+/**
+ * Step of the shifts searched by the alignment.
+ */
+constexpr float ALIGNMENT_STEP = 0.5f;
+
+/**
+ * Number of rows of the mask that are labelled by a single task.
+ */
+constexpr int LABEL_STRIP_ROWS = 64;
+
 /**
  * Finds the centroid of an object in image starting at the position start
- * while filling the mask
+ * while filling the mask.
+ *
+ * The mask may cover only a part of the image starting at the position origin,
+ * the pixels outside of the mask are treated as empty. All positions use
+ * the swapped coordinates.
  */
-cv::Point2f findCentroid(const cv::Mat &image, cv::Mat &mask, cv::Point2i start) {
-	std::uint8_t *data = reinterpret_cast<std::uint8_t*>(image.data);
-	std::uint8_t *maskData = reinterpret_cast<std::uint8_t*>(mask.data);
+cv::Point2f findCentroid(const cv::Mat &image, cv::Mat &mask, cv::Point2i origin, cv::Point2i start) {
 	// we discover points based on a modified non-recursive flood fill algorithm that works
 	// on monotone polygons only
 	/*
@@ -59,7 +137,7 @@ cv::Point2f findCentroid(const cv::Mat &image, cv::Mat &mask, cv::Point2i start)
 	 */
 
 	// skip the objects one pixel from the edge
-	if (start.x == image.cols - 1) {
+	if (start.x == image.rows - 1) {
 		return cv::Point2f(0.0, 0.0);
 	}
 
@@ -71,71 +149,60 @@ cv::Point2f findCentroid(const cv::Mat &image, cv::Mat &mask, cv::Point2i start)
 	double sum = 0.0;
 
 	// limits for search
-	const int maxy = std::min(y + MAX_LENS_SIZE, image.rows);
-	const int maxx = std::min(startx + MAX_LENS_SIZE, image.cols);
+	const int maxy = std::min(y + MAX_LENS_SIZE, image.cols);
+	const int maxx = std::min(startx + MAX_LENS_SIZE, image.rows);
 	const int minx = std::max(startx - MAX_LENS_SIZE, 0);
 
+	auto isObject = [&mask, origin](int x, int y) {
+		const int maskRow = x - origin.x;
+		const int maskCol = y - origin.y;
+		return maskRow >= 0 && maskRow < mask.rows && maskCol >= 0 && maskCol < mask.cols &&
+		       mask.at<std::uint8_t>(maskRow, maskCol) == Lyli::Calibration::Mask::OBJECT;
+	};
+	auto fill = [&](int x, int y) {
+		const std::uint8_t value = image.at<std::uint8_t>(x, y);
+		m10 += y * value;
+		m01 += x * value;
+		sum += value;
+		mask.at<std::uint8_t>(x - origin.x, y - origin.y) = Lyli::Calibration::Mask::PROCESSED;
+	};
+
 	// the search algorithm
 	while (y < maxy) {
-		int pos = image.cols * y + startx;
-		int endpos = image.cols * y + endx;
-
-		if (maskData[pos] == Lyli::Calibration::Mask::OBJECT) {
+		if (isObject(startx, y)) {
 			// fill to the left
 			int oldstartx = startx;
-			int tmppos = pos - 1;
 			int x = startx - 1;
-			while (x >= minx && maskData[tmppos] == Lyli::Calibration::Mask::OBJECT) {
-				// compute
-				m10 += y * data[tmppos];
-				m01 += x * data[tmppos];
-				sum += data[tmppos];
-				maskData[tmppos] = Lyli::Calibration::Mask::PROCESSED;
-				// move to next
-				--tmppos;
+			while (x >= minx && isObject(x, y)) {
+				fill(x, y);
 				--startx;
 				--x;
 			}
 			// fill to the right
-			tmppos = pos;
 			x = oldstartx;
-			while (x < maxx && maskData[tmppos] == Lyli::Calibration::Mask::OBJECT) {
-				// compute
-				m10 += y * data[tmppos];
-				m01 += x * data[tmppos];
-				sum += data[tmppos];
-				maskData[tmppos] = Lyli::Calibration::Mask::PROCESSED;
-				// move to next
-				++tmppos;
+			while (x < maxx && isObject(x, y)) {
+				fill(x, y);
 				++x;
 			}
 			endx = x - 1;
 		}
 		else {
 			// find the start position
-			int tmppos = pos;
 			// compare against OBJECT rather than EMPTY, as we may hit PROCESSED pixels too
 			// in case there is a little "spur" that sticks out on top of already processed pixels
 			// which may happen if there are lenses that are fused together in the image
-			while (maskData[tmppos] != Lyli::Calibration::Mask::OBJECT) {
-				if (tmppos == endpos) {
+			while (!isObject(startx, y)) {
+				if (startx == endx) {
 					// stop fill
 					goto findCentroid_stop;
 				}
 				// skip to next
-				++tmppos;
 				++startx;
 			}
 			// fill to the right
 			int x = startx;
-			while (x < maxx && maskData[tmppos] == Lyli::Calibration::Mask::OBJECT) {
-				// compute
-				m10 += y * data[tmppos];
-				m01 += x * data[tmppos];
-				sum += data[tmppos];
-				maskData[tmppos] = Lyli::Calibration::Mask::PROCESSED;
-				// move to next
-				++tmppos;
+			while (x < maxx && isObject(x, y)) {
+				fill(x, y);
 				++x;
 			}
 			endx = x - 1;
@@ -149,7 +216,7 @@ findCentroid_stop:
 }
 
 /**
- * Get interpolated color at a non-integer position.
+ * Get interpolated color at a non-integer position given in the swapped coordinates.
  *
  * Uses just bilinear interpolation.
  */
@@ -157,9 +224,13 @@ float getInterpolatedColor(const cv::Mat &image, cv::Point2f position) {
 	assert(image.channels() == 1);
 
 	// return 0 if the position is out of bounds
-	if (position.x < 0 || position.x > image.cols - 1 || position.y < 0 || position.y > image.rows - 1) {
+	if (position.x < 0 || position.x > image.rows - 1 || position.y < 0 || position.y > image.cols - 1) {
 		return 0.0f;
 	}
+	// the neighbours of the pixels on the last row or column are outside of the image
+	auto pixel = [&image](int x, int y) {
+		return x < image.rows && y < image.cols ? image.at<uchar>(x, y) : 0;
+	};
 
 	const unsigned int xx = std::floor(position.x);
 	const unsigned int yy = std::floor(position.y);
@@ -168,10 +239,10 @@ float getInterpolatedColor(const cv::Mat &image, cv::Point2f position) {
 	int y0 = yy;
 	int y1 = yy + 1;
 
-	const float f00 = image.at<uchar>(y0, x0);
-	const float f01 = image.at<uchar>(y0, x1);
-	const float f10 = image.at<uchar>(y1, x0);
-	const float f11 = image.at<uchar>(y1, x1);
+	const float f00 = pixel(x0, y0);
+	const float f01 = pixel(x1, y0);
+	const float f10 = pixel(x0, y1);
+	const float f11 = pixel(x1, y1);
 
 	const float x0dif = position.x - x0;
 	const float x1dif = 1.0 - x0dif;
@@ -197,6 +268,163 @@ std::vector<cv::Point2f> computeMask(int radius) {
 	return mask;
 }
 
+/**
+ * Radius of the largest mask used for refining the centroids.
+ */
+constexpr int MAX_REFINE_RADIUS = 6;
+
+/**
+ * Number of pixels processed for each span of a refinement mask, the spans must be shorter.
+ */
+constexpr int SPAN_SIZE = 16;
+
+/**
+ * A circular mask used for refining the centroids split into spans of consecutive columns.
+ *
+ * All samples of the mask share the fractional part of their position, so the bilinear
+ * interpolation reduces to sums of the four neighbouring pixels over the spans weighted
+ * by the same constants. The arrays are indexed by the span, the weights have SPAN_SIZE
+ * entries per span that are zero past the end of the span.
+ */
+struct SpanMask {
+	explicit SpanMask(int radius);
+
+	/** the points of the mask */
+	std::vector<cv::Point2f> points;
+	/** offset of the span in the x-direction, ie. the row */
+	std::vector<int> x;
+	/** offset of the first pixel of the span in the y-direction, ie. the column */
+	std::vector<int> y;
+	/** number of the pixels of the span */
+	std::vector<int> length;
+	/** weights computing the sum of the pixels */
+	std::vector<std::int16_t> weightSum;
+	/** weights computing the sum of the pixels multiplied by their x offset */
+	std::vector<std::int16_t> weightX;
+	/** weights computing the sum of the pixels multiplied by their y offset */
+	std::vector<std::int16_t> weightY;
+};
+
+SpanMask::SpanMask(int radius) : points(computeMask(radius)) {
+	for (int spanX = -radius; spanX <= radius; ++spanX) {
+		int first = radius + 1;
+		int last = -radius - 1;
+		int count = 0;
+		for (const cv::Point2f &point : points) {
+			if (point.x == spanX) {
+				first = std::min(first, static_cast<int>(point.y));
+				last = std::max(last, static_cast<int>(point.y));
+				++count;
+			}
+		}
+		// the masks are convex
+		assert(count == 0 || count == last - first + 1);
+		assert(count < SPAN_SIZE);
+		if (count == 0) {
+			continue;
+		}
+		x.push_back(spanX);
+		y.push_back(first);
+		length.push_back(count);
+		for (int i = 0; i < SPAN_SIZE; ++i) {
+			const bool inside = i < count;
+			weightSum.push_back(inside ? 1 : 0);
+			weightX.push_back(inside ? spanX : 0);
+			weightY.push_back(inside ? first + i : 0);
+		}
+	}
+}
+
+/**
+ * Sums of the pixels over the spans of a mask for each of the four neighbours of the samples.
+ *
+ * The first index selects the sum of the pixels, the sum multiplied by the x offset and the sum
+ * multiplied by the y offset, the second index the neighbour at (x, y), (x, y + 1), (x + 1, y)
+ * and (x + 1, y + 1).
+ */
+using SpanSums = std::int32_t[3][4];
+
+/**
+ * A function computing the sums of the spans of the mask centered at the pixel origin.
+ */
+using SpanSumFunction = void (*)(const std::uint8_t *origin, std::ptrdiff_t step, const SpanMask &mask, SpanSums &sums);
+
+void sumSpansScalar(const std::uint8_t *origin, std::ptrdiff_t step, const SpanMask &mask, SpanSums &sums) {
+	std::fill(&sums[0][0], &sums[0][0] + 12, 0);
+	for (std::size_t span = 0; span < mask.x.size(); ++span) {
+		const std::uint8_t *pixels = origin + mask.x[span] * step + mask.y[span];
+		const std::uint8_t *neighbours[4] = {pixels, pixels + 1, pixels + step, pixels + step + 1};
+		for (int i = 0; i < mask.length[span]; ++i) {
+			for (int neighbour = 0; neighbour < 4; ++neighbour) {
+				const int pixel = neighbours[neighbour][i];
+				sums[0][neighbour] += pixel;
+				sums[1][neighbour] += mask.x[span] * pixel;
+				sums[2][neighbour] += (mask.y[span] + i) * pixel;
+			}
+		}
+	}
+}
+
+#ifdef LYLI_LENSDETECTOR_X86
+
+/*
+ * Each span is loaded as 16 pixels, which are widened to 16 bits and multiplied
+ * by the weights of the span. The weights past the end of the span are zero.
+ */
+
+__attribute__((target("sse2")))
+void sumSpansSse2(const std::uint8_t *origin, std::ptrdiff_t step, const SpanMask &mask, SpanSums &sums) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i accumulators[3][4];
+	for (int moment = 0; moment < 3; ++moment) {
+		for (int neighbour = 0; neighbour < 4; ++neighbour) {
+			accumulators[moment][neighbour] = zero;
+		}
+	}
+
+	const std::int16_t *weights[3] = {mask.weightSum.data(), mask.weightX.data(), mask.weightY.data()};
+	for (std::size_t span = 0; span < mask.x.size(); ++span) {
+		__m128i spanWeights[3][2];
+		for (int moment = 0; moment < 3; ++moment) {
+			const std::int16_t *w = weights[moment] + span * SPAN_SIZE;
+			spanWeights[moment][0] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(w));
+			spanWeights[moment][1] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(w + 8));
+		}
+		const std::uint8_t *pixels = origin + mask.x[span] * step + mask.y[span];
+		const std::uint8_t *neighbours[4] = {pixels, pixels + 1, pixels + step, pixels + step + 1};
+		for (int neighbour = 0; neighbour < 4; ++neighbour) {
+			const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(neighbours[neighbour]));
+			const __m128i low = _mm_unpacklo_epi8(v, zero);
+			const __m128i high = _mm_unpackhi_epi8(v, zero);
+			for (int moment = 0; moment < 3; ++moment) {
+				const __m128i products = _mm_add_epi32(_mm_madd_epi16(low, spanWeights[moment][0]),
+				                                       _mm_madd_epi16(high, spanWeights[moment][1]));
+				accumulators[moment][neighbour] = _mm_add_epi32(accumulators[moment][neighbour], products);
+			}
+		}
+	}
+
+	for (int moment = 0; moment < 3; ++moment) {
+		for (int neighbour = 0; neighbour < 4; ++neighbour) {
+			alignas(16) std::int32_t lanes[4];
+			_mm_store_si128(reinterpret_cast<__m128i*>(lanes), accumulators[moment][neighbour]);
+			sums[moment][neighbour] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		}
+	}
+}
+
+#endif
+
+SpanSumFunction selectSumSpans() {
+#ifdef LYLI_LENSDETECTOR_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		return sumSpansSse2;
+	}
+#endif
+	return sumSpansScalar;
+}
+
 /**
  * Refine centroid.
  *
@@ -204,26 +432,48 @@ std::vector<cv::Point2f> computeMask(int radius) {
  * to better estimate of centroid.
  */
 cv::Point2f refineCentroid(const cv::Mat &image, cv::Point2f start) {
-	// begin refining with radius 3px, stop at 5px radius
-	// use precomputed masks with relative offset to the start
-	static const std::vector<cv::Point2f> offsets3px = computeMask(3);
-	static const std::vector<cv::Point2f> offsets4px = computeMask(4);
-	static const std::vector<cv::Point2f> offsets5px = computeMask(5);
-	static const std::vector<cv::Point2f> offsets6px = computeMask(6);
-	static const auto offsetlist = { offsets3px, offsets4px, offsets5px, offsets6px };
+	// begin refining with radius 3px, stop at 6px radius
+	static const SpanMask masks[] = {SpanMask(3), SpanMask(4), SpanMask(5), SpanMask(MAX_REFINE_RADIUS)};
+	static const SpanSumFunction sumSpans = selectSumSpans();
 
 	double m01, m10, sum;
 	cv::Point2f estimate(start.x, start.y);
-	for (const auto &mask : offsetlist) {
+	for (const SpanMask &mask : masks) {
 		m01 = 0.0;
 		m10 = 0.0;
 		sum = 0.0;
-		for (const auto &point : mask) {
-			auto pos = point + estimate;
-			float pixel = getInterpolatedColor(image, pos);
-			m10 += pos.y * pixel;
-			m01 += pos.x * pixel;
-			sum += pixel;
+		const float x0 = std::floor(estimate.x);
+		const float y0 = std::floor(estimate.y);
+		// the spans and their neighbours must be inside of the image, which also rejects NaN
+		if (x0 >= MAX_REFINE_RADIUS && x0 + MAX_REFINE_RADIUS + 1 < image.rows &&
+		    y0 >= MAX_REFINE_RADIUS && y0 + SPAN_SIZE < image.cols) {
+			SpanSums sums;
+			sumSpans(image.ptr<std::uint8_t>(x0) + static_cast<int>(y0), image.step, mask, sums);
+			// the same weights as in getInterpolatedColor()
+			const float x0dif = estimate.x - x0;
+			const float x1dif = 1.0 - x0dif;
+			const float y0dif = estimate.y - y0;
+			const float y1dif = 1.0 - y0dif;
+			const float weights[4] = {y1dif*x1dif, x0dif*y1dif, x1dif*y0dif, x0dif*y0dif};
+			double sumX = 0.0;
+			double sumY = 0.0;
+			for (int neighbour = 0; neighbour < 4; ++neighbour) {
+				sum += weights[neighbour] * sums[0][neighbour];
+				sumX += weights[neighbour] * sums[1][neighbour];
+				sumY += weights[neighbour] * sums[2][neighbour];
+			}
+			m01 = estimate.x * sum + sumX;
+			m10 = estimate.y * sum + sumY;
+		}
+		else {
+			// sample the points one by one near the borders
+			for (const auto &point : mask.points) {
+				auto pos = point + estimate;
+				float pixel = getInterpolatedColor(image, pos);
+				m10 += pos.y * pixel;
+				m01 += pos.x * pixel;
+				sum += pixel;
+			}
 		}
 		estimate = cv::Point2f(m01/sum, m10/sum);
 	}
@@ -231,6 +481,399 @@ cv::Point2f refineCentroid(const cv::Mat &image, cv::Point2f start) {
 	return estimate;
 }
 
+/**
+ * Refine the centroids in parallel.
+ */
+void refineCentroids(const cv::Mat &image, std::vector<cv::Point2f> &centroids) {
+	tbb::parallel_for(tbb::blocked_range<std::size_t>(0, centroids.size()), [&](const tbb::blocked_range<std::size_t> &range) {
+		for (std::size_t i = range.begin(); i < range.end(); ++i) {
+			centroids[i] = refineCentroid(image, centroids[i]);
+		}
+	});
+}
+
+/**
+ * Get the median of the values, the order of the values is changed.
+ */
+float median(std::vector<float> &values) {
+	auto middle = values.begin() + values.size() / 2;
+	std::nth_element(values.begin(), middle, values.end());
+	return *middle;
+}
+
+/**
+ * Find the shift aligning the predicted lenses with the image.
+ *
+ * The phase and the offset of a grid predicted from the metadata may be wrong by up
+ * to a half of the lens pitch, which is more than the refinement can correct. The lenses
+ * near the image center are first moved together to the shift with the brightest lens
+ * centers, then they are refined and the median of their displacements is the shift
+ * of the whole grid.
+ */
+cv::Point2f alignPredictions(const cv::Mat &gray, const std::vector<cv::Point2f> &predicted) {
+	const cv::Point2f center(0.5f * gray.rows, 0.5f * gray.cols);
+	std::vector<cv::Point2f> central;
+	for (const cv::Point2f &position : predicted) {
+		const cv::Point2f difference = position - center;
+		if (difference.x * difference.x + difference.y * difference.y <= ALIGNMENT_RADIUS * ALIGNMENT_RADIUS) {
+			central.push_back(position);
+		}
+	}
+	if (central.empty()) {
+		return cv::Point2f(0.0f, 0.0f);
+	}
+
+	// coarse search over the shifts
+	const int steps = std::round(ALIGNMENT_RANGE / ALIGNMENT_STEP);
+	cv::Point2f shift(0.0f, 0.0f);
+	float best = -1.0f;
+	for (int i = -steps; i <= steps; ++i) {
+		for (int j = -steps; j <= steps; ++j) {
+			const cv::Point2f candidate(i * ALIGNMENT_STEP, j * ALIGNMENT_STEP);
+			float sum = 0.0f;
+			for (const cv::Point2f &position : central) {
+				sum += getInterpolatedColor(gray, position + candidate);
+			}
+			if (sum > best) {
+				best = sum;
+				shift = candidate;
+			}
+		}
+	}
+
+	// refine the shifted lenses, the lenses that move farther than the search step are skipped
+	const float maxDistance = 2.0f * ALIGNMENT_STEP;
+	std::vector<cv::Point2f> refined;
+	refined.reserve(central.size());
+	for (const cv::Point2f &position : central) {
+		refined.push_back(position + shift);
+	}
+	refineCentroids(gray, refined);
+	std::vector<float> shiftX;
+	std::vector<float> shiftY;
+	for (std::size_t i = 0; i < central.size(); ++i) {
+		const cv::Point2f difference = refined[i] - central[i] - shift;
+		if (difference.x * difference.x + difference.y * difference.y <= maxDistance * maxDistance) {
+			shiftX.push_back(refined[i].x - central[i].x);
+			shiftY.push_back(refined[i].y - central[i].y);
+		}
+	}
+	if (shiftX.empty()) {
+		return shift;
+	}
+	return cv::Point2f(median(shiftX), median(shiftY));
+}
+
+/**
+ * A horizontal run of object pixels in the mask.
+ */
+struct Run {
+	int row;
+	int begin;
+	int end;
+};
+
+/**
+ * Runs of a strip of the mask joined to components inside of the strip.
+ */
+struct Strip {
+	std::vector<Run> runs;
+	// union-find parents of the runs
+	std::vector<int> parent;
+	// the runs of the first row are [0, firstRowEnd)
+	int firstRowEnd = 0;
+	// the runs of the last row are [lastRowBegin, runs.size())
+	int lastRowBegin = 0;
+};
+
+/**
+ * A centroid found by filling the object from the seed at the given position of the scan.
+ */
+struct Centroid {
+	std::int64_t seed;
+	cv::Point2f position;
+};
+
+int findRoot(std::vector<int> &parent, int run) {
+	while (parent[run] != run) {
+		parent[run] = parent[parent[run]];
+		run = parent[run];
+	}
+	return run;
+}
+
+/**
+ * Join the components of two runs.
+ *
+ * The root with the lower index is kept, so the root of each component
+ * is its first run in the raster order.
+ */
+void unite(std::vector<int> &parent, int a, int b) {
+	a = findRoot(parent, a);
+	b = findRoot(parent, b);
+	if (a < b) {
+		parent[b] = a;
+	}
+	else if (b < a) {
+		parent[a] = b;
+	}
+}
+
+/**
+ * Join the runs of two consecutive rows that touch each other vertically.
+ *
+ * The runs of the upper row are [upper, lower), the runs of the lower row [lower, end).
+ */
+void uniteRows(const std::vector<Run> &runs, std::vector<int> &parent, int upper, int lower, int end) {
+	int first = upper;
+	for (int run = lower; run < end; ++run) {
+		// skip the runs that end before the current one
+		while (first < lower && runs[first].end <= runs[run].begin) {
+			++first;
+		}
+		for (int other = first; other < lower && runs[other].begin < runs[run].end; ++other) {
+			unite(parent, other, run);
+		}
+	}
+}
+
+/**
+ * Find the runs of object pixels in rows [first, last) and join them to components.
+ */
+void labelStrip(const cv::Mat &mask, int first, int last, Strip &strip) {
+	int upper = 0;
+	int lower = 0;
+	for (int y = first; y < last; ++y) {
+		const std::uint8_t *row = mask.ptr<std::uint8_t>(y);
+		lower = strip.runs.size();
+		int x = 0;
+		while (x < mask.cols) {
+			if (row[x] != Lyli::Calibration::Mask::OBJECT) {
+				++x;
+				continue;
+			}
+			const int begin = x;
+			while (x < mask.cols && row[x] == Lyli::Calibration::Mask::OBJECT) {
+				++x;
+			}
+			strip.parent.push_back(strip.runs.size());
+			strip.runs.push_back(Run{y, begin, x});
+		}
+		if (y == first) {
+			strip.firstRowEnd = strip.runs.size();
+		}
+		else {
+			uniteRows(strip.runs, strip.parent, upper, lower, strip.runs.size());
+		}
+		upper = lower;
+	}
+	strip.lastRowBegin = lower;
+}
+
+/**
+ * Find the centroids of all objects in the mask.
+ *
+ * The result is identical to filling the objects from the pixels found by a raster scan
+ * of the mask in the swapped coordinates, ie. column by column. The mask is split into
+ * strips of rows that are labelled in parallel, the components crossing the strips are
+ * joined afterwards. As the fill never leaves the 4-connected component of its seed,
+ * each component is then filled in a private copy in parallel.
+ *
+ * @return the refined centroids in the swapped coordinates in the order of their seeds
+ */
+std::vector<cv::Point2f> findCentroids(const cv::Mat &image, const cv::Mat &mask) {
+	// label the strips
+	std::vector<Strip> strips((mask.rows + LABEL_STRIP_ROWS - 1) / LABEL_STRIP_ROWS);
+	tbb::parallel_for(std::size_t(0), strips.size(), [&](std::size_t i) {
+		const int first = i * LABEL_STRIP_ROWS;
+		labelStrip(mask, first, std::min(first + LABEL_STRIP_ROWS, mask.rows), strips[i]);
+	});
+
+	// join the strips, the runs stay in the raster order
+	std::vector<int> offsets(1, 0);
+	for (const Strip &strip : strips) {
+		offsets.push_back(offsets.back() + strip.runs.size());
+	}
+	std::vector<Run> runs;
+	std::vector<int> parent;
+	runs.reserve(offsets.back());
+	parent.reserve(offsets.back());
+	for (std::size_t i = 0; i < strips.size(); ++i) {
+		runs.insert(runs.end(), strips[i].runs.begin(), strips[i].runs.end());
+		for (int run : strips[i].parent) {
+			parent.push_back(offsets[i] + run);
+		}
+		if (i > 0) {
+			uniteRows(runs, parent, offsets[i - 1] + strips[i - 1].lastRowBegin, offsets[i], offsets[i] + strips[i].firstRowEnd);
+		}
+	}
+	strips = std::vector<Strip>();
+
+	// group the runs by the components, the components are ordered by their first run
+	std::vector<int> component(runs.size());
+	std::vector<int> componentBegin(1, 0);
+	for (std::size_t run = 0; run < runs.size(); ++run) {
+		const int root = findRoot(parent, run);
+		if (root == static_cast<int>(run)) {
+			component[run] = componentBegin.size() - 1;
+			componentBegin.push_back(0);
+		}
+		else {
+			component[run] = component[root];
+		}
+		++componentBegin[component[run] + 1];
+	}
+	for (std::size_t i = 1; i < componentBegin.size(); ++i) {
+		componentBegin[i] += componentBegin[i - 1];
+	}
+	std::vector<int> members(runs.size());
+	std::vector<int> next(componentBegin.begin(), componentBegin.end() - 1);
+	for (std::size_t run = 0; run < runs.size(); ++run) {
+		members[next[component[run]]++] = run;
+	}
+
+	// fill the components
+	tbb::enumerable_thread_specific<std::vector<Centroid>> localCentroids;
+	tbb::enumerable_thread_specific<std::vector<std::uint8_t>> localWindows;
+	tbb::parallel_for(tbb::blocked_range<std::size_t>(0, componentBegin.size() - 1), [&](const tbb::blocked_range<std::size_t> &range) {
+		std::vector<Centroid> &centroids = localCentroids.local();
+		std::vector<std::uint8_t> &buffer = localWindows.local();
+		for (std::size_t i = range.begin(); i < range.end(); ++i) {
+			const int *first = members.data() + componentBegin[i];
+			const int *last = members.data() + componentBegin[i + 1];
+			// copy the component to a window covering its bounding box
+			int minx = mask.cols;
+			int maxx = 0;
+			for (const int *run = first; run != last; ++run) {
+				minx = std::min(minx, runs[*run].begin);
+				maxx = std::max(maxx, runs[*run].end);
+			}
+			const cv::Point2i origin(minx, runs[*first].row);
+			const int height = runs[*(last - 1)].row - origin.y + 1;
+			buffer.assign(static_cast<std::size_t>(height) * (maxx - minx), std::uint8_t(Lyli::Calibration::Mask::EMPTY));
+			cv::Mat window(height, maxx - minx, CV_8UC1, buffer.data());
+			for (const int *run = first; run != last; ++run) {
+				std::uint8_t *row = window.ptr<std::uint8_t>(runs[*run].row - origin.y);
+				std::fill(row + runs[*run].begin - origin.x, row + runs[*run].end - origin.x, std::uint8_t(Lyli::Calibration::Mask::OBJECT));
+			}
+			// fill the objects column by column
+			const cv::Point2i swappedOrigin(origin.y, origin.x);
+			for (int x = 0; x < window.cols; ++x) {
+				for (int y = 0; y < window.rows; ++y) {
+					if (window.at<std::uint8_t>(y, x) == Lyli::Calibration::Mask::OBJECT) {
+						const cv::Point2i seed(origin.y + y, origin.x + x);
+						centroids.push_back(Centroid{static_cast<std::int64_t>(seed.y) * mask.rows + seed.x,
+						                             findCentroid(image, window, swappedOrigin, seed)});
+					}
+				}
+			}
+		}
+	});
+
+	// restore the order of the seeds
+	std::vector<Centroid> centroids;
+	for (const auto &local : localCentroids) {
+		centroids.insert(centroids.end(), local.begin(), local.end());
+	}
+	std::sort(centroids.begin(), centroids.end(), [](const Centroid &a, const Centroid &b) {
+		return a.seed < b.seed;
+	});
+	std::vector<cv::Point2f> result;
+	result.reserve(centroids.size());
+	for (const Centroid &centroid : centroids) {
+		result.push_back(centroid.position);
+	}
+	refineCentroids(image, result);
+	return result;
+}
+
+/**
+ * Convert a 16-bit RGB image to 8-bit grayscale.
+ */
+cv::Mat convertToGray(const cv::Mat &image) {
+	cv::Mat gray;
+	gray.allocator = Lyli::Image::FrameBufferPool::getDefault().getAllocator();
+	cv::cvtColor(image, gray, cv::COLOR_RGB2GRAY);
+	gray.convertTo(gray, CV_8U, 1.0/256.0);
+	return gray;
+}
+
+/**
+ * Predict the lens positions from the calibrated grid.
+ *
+ * The intersections of the lines of the same subgrid are transformed back to the image
+ * the same way as when the lightfield image is sampled.
+ */
+std::vector<cv::Point2f> predictLenses(const Lyli::Calibration::CalibrationData &calibration) {
+	const Lyli::Calibration::ArrayParameters &array = calibration.getArray();
+	const double angle = array.getRotation()*180.0/M_PI;
+	cv::Mat r = cv::getRotationMatrix2D(cv::Point2f(0, 0), angle, 1.0);
+	cv::Mat t = cv::Mat::eye(3 , 3, CV_64F);
+	t.at<double>(0, 2) = array.getTranslation()[0];
+	t.at<double>(1, 2) = array.getTranslation()[1];
+	cv::Mat T = r*t;
+	cv::Mat inverse;
+	cv::invertAffineTransform(T, inverse);
+
+	const Lyli::Calibration::LineGrid::LineList &horizontal(array.getGrid().getHorizontalLines());
+	const Lyli::Calibration::LineGrid::LineList &vertical(array.getGrid().getVerticalLines());
+	std::vector<cv::Point2f> result;
+	for (const auto &verticalLine : vertical) {
+		for (const auto &horizontalLine : horizontal) {
+			if (horizontalLine.subgrid == verticalLine.subgrid) {
+				const double px = verticalLine.position;
+				const double py = horizontalLine.position;
+				const double sx = inverse.at<double>(0, 0) * px + inverse.at<double>(0, 1) * py + inverse.at<double>(0, 2);
+				const double sy = inverse.at<double>(1, 0) * px + inverse.at<double>(1, 1) * py + inverse.at<double>(1, 2);
+				// swap the coordinates
+				result.push_back(cv::Point2f(sy, sx));
+			}
+		}
+	}
+	return result;
+}
+
+/**
+ * Predict the lens positions from the description of the microlens array.
+ *
+ * The lenses form a hexagonal grid with rows along the image rows, every other row
+ * is shifted by a half of the lens pitch. The grid is centered at the image center
+ * shifted by the sensor offset and rotated around it.
+ */
+std::vector<cv::Point2f> predictLenses(const Lyli::Image::Metadata &metadata) {
+	const Lyli::Image::Metadata::Devices devices = metadata.getDevices();
+	const Lyli::Image::Metadata::Devices::Mla mla = devices.getMla();
+	const double pixelPitch = devices.getSensor().getPixelpitch();
+	const double pitch = mla.getLenspitch() / pixelPitch;
+	const double stepX = pitch * mla.getScalefactor().getX();
+	const double stepY = pitch * std::sqrt(3.0) / 2.0 * mla.getScalefactor().getY();
+	const int width = metadata.getImage().getWidth();
+	const int height = metadata.getImage().getHeight();
+	const double centerX = 0.5 * (width - 1) + mla.getSensoroffset().getX() / pixelPitch;
+	const double centerY = 0.5 * (height - 1) + mla.getSensoroffset().getY() / pixelPitch;
+	const double cosRotation = std::cos(mla.getRotation());
+	const double sinRotation = std::sin(mla.getRotation());
+
+	// the grid is slightly larger than the image, so that the rotation does not leave gaps
+	const int halfRows = std::ceil(0.6 * height / stepY);
+	const int halfCols = std::ceil(0.6 * width / stepX);
+	std::vector<cv::Point2f> result;
+	for (int row = -halfRows; row <= halfRows; ++row) {
+		const double shift = (row & 1) != 0 ? 0.5 * stepX : 0.0;
+		for (int col = -halfCols; col <= halfCols; ++col) {
+			const double gx = col * stepX + shift;
+			const double gy = row * stepY;
+			const double x = centerX + cosRotation * gx - sinRotation * gy;
+			const double y = centerY + sinRotation * gx + cosRotation * gy;
+			if (x >= 0 && x <= width - 1 && y >= 0 && y <= height - 1) {
+				// swap the coordinates
+				result.push_back(cv::Point2f(y, x));
+			}
+		}
+	}
+	return result;
+}
+
 }
 
 namespace Lyli {
@@ -241,14 +884,26 @@ LensDetector::LensDetector(std::unique_ptr<PreprocessorInterface> preprocessor_)
 }
 
 PointGrid LensDetector::detect(const cv::Mat& image) {
-	// convert to gray
-	cv::Mat gray;
-	cv::cvtColor(image, gray, cv::COLOR_RGB2GRAY);
-	gray.convertTo(gray, CV_8U, 1.0/256.0);
+	return detectGray(convertToGray(image));
+}
+
+PointGrid LensDetector::detect(const Lyli::Image::RawImage& image) {
+	// the luminance is computed directly from the mosaic
+	return detectGray(image.getLuminance());
+}
+
+PointGrid LensDetector::detect(const Lyli::Image::BandDecoder& decoder) {
+	// only the luminance is assembled from the bands
+	return detectGray(decoder.decodeLuminance());
+}
+
+bool LensDetector::isFlat(const Lyli::Image::BandDecoder& decoder) {
+	return isFlatWindow(decoder.decodeRegionLuminance(getFlatWindow(decoder.getWidth(), decoder.getHeight())));
+}
 
+PointGrid LensDetector::detectGray(const cv::Mat& gray) {
 	// check whether the image is usefull at all
-	std::uint8_t mean = cv::mean(gray(cv::Rect(1620, 1620, 40, 40)))[0];
-	if (mean < 16 || mean > 240) {
+	if (isFlatWindow(gray(getFlatWindow(gray.cols, gray.rows)))) {
 		// skip flat image
 		return PointGrid();
 	}
@@ -256,33 +911,131 @@ PointGrid LensDetector::detect(const cv::Mat& image) {
 	// compute the mask using the preprocessor
 	cv::Mat mask = preprocessor->preprocess(gray);
 
-	// transpose the greyMat image, as its easier to scan row by row rather than by column
-	// while row scanning on original is not problem for finding centroids, line detection
-	// needs to sweep orthogonaly to lines
-	cv::Mat greyMatTranspose(gray.t());
-	cv::Mat maskTranspose(mask.t());
-
-	PointGrid pointGrid;
 	// find centroids and create map of lines
-	for (int row = 0; row < maskTranspose.rows; ++row) {
-		std::uint8_t* pixel = maskTranspose.ptr<std::uint8_t>(row);
-		for (int col = 0; col < maskTranspose.cols; ++col) {
-			// if the pixel is not black and it is not marked, process
-			if (pixel[col] == Mask::OBJECT) {
-				cv::Point2f centroid = findCentroid(greyMatTranspose, maskTranspose, cv::Point2i(col, row));
-				centroid = refineCentroid(greyMatTranspose, centroid);
-				// construct line map
-				pointGrid.addPoint(centroid);
-
-				// DEBUG: store centroid in image
-				maskTranspose.at<uchar>(centroid) = 192;
-			}
+	PointGrid pointGrid;
+	for (const cv::Point2f &centroid : findCentroids(gray, mask)) {
+		pointGrid.addPoint(centroid);
+	}
+
+	pointGrid.finalize();
+	return pointGrid;
+}
+
+class GuidedLensDetector::Impl {
+public:
+	explicit Impl(std::vector<cv::Point2f> &&predicted_) : predicted(std::move(predicted_)) {
+
+	}
+
+	PointGrid detectGray(const cv::Mat& gray, LensDrift &drift) const;
+
+private:
+	// the predicted lens positions in the swapped coordinates
+	const std::vector<cv::Point2f> predicted;
+};
+
+PointGrid GuidedLensDetector::Impl::detectGray(const cv::Mat& gray, LensDrift &drift) const {
+	drift = LensDrift();
+	if (isFlatWindow(gray(getFlatWindow(gray.cols, gray.rows)))) {
+		// skip flat image
+		return PointGrid();
+	}
+
+	// the drift is measured from the aligned predictions
+	const cv::Point2f shift = alignPredictions(gray, predicted);
+	drift.shiftX = shift.x;
+	drift.shiftY = shift.y;
+	std::vector<cv::Point2f> expected;
+	expected.reserve(predicted.size());
+	for (const cv::Point2f &prediction : predicted) {
+		const cv::Point2f position = prediction + shift;
+		if (position.x >= 0 && position.x <= gray.rows - 1 && position.y >= 0 && position.y <= gray.cols - 1) {
+			expected.push_back(position);
 		}
 	}
+	std::vector<cv::Point2f> centroids(expected);
+	refineCentroids(gray, centroids);
+
+	// keep only the lenses that stayed near their predictions, the comparison rejects NaN as well
+	std::vector<cv::Point2f> detected;
+	detected.reserve(centroids.size());
+	double sumX = 0.0;
+	double sumY = 0.0;
+	double sumDistance = 0.0;
+	for (std::size_t i = 0; i < centroids.size(); ++i) {
+		const cv::Point2f difference = centroids[i] - expected[i];
+		const float distance = std::sqrt(difference.x * difference.x + difference.y * difference.y);
+		if (distance <= MAX_DRIFT) {
+			detected.push_back(centroids[i]);
+			sumX += difference.x;
+			sumY += difference.y;
+			sumDistance += distance;
+			drift.maxDistance = std::max(drift.maxDistance, distance);
+		}
+	}
+	drift.predicted = expected.size();
+	drift.detected = detected.size();
+	if (!detected.empty()) {
+		drift.meanX = sumX / detected.size();
+		drift.meanY = sumY / detected.size();
+		drift.meanDistance = sumDistance / detected.size();
+	}
+	if (detected.size() < MIN_GUIDED_LENSES) {
+		// the prior does not match the image
+		return PointGrid();
+	}
+
+	// the points have to be added in the increasing y-order
+	std::sort(detected.begin(), detected.end(), [](const cv::Point2f &a, const cv::Point2f &b) {
+		return a.y < b.y;
+	});
+	PointGrid pointGrid;
+	for (const cv::Point2f &centroid : detected) {
+		pointGrid.addPoint(centroid);
+	}
 
 	pointGrid.finalize();
 	return pointGrid;
 }
 
+GuidedLensDetector::GuidedLensDetector(const CalibrationData &calibration) : pimpl(new Impl(predictLenses(calibration))) {
+
+}
+
+GuidedLensDetector::GuidedLensDetector(const Lyli::Image::Metadata &metadata) : pimpl(new Impl(predictLenses(metadata))) {
+
+}
+
+GuidedLensDetector::~GuidedLensDetector() {
+
+}
+
+PointGrid GuidedLensDetector::detect(const cv::Mat& image) {
+	LensDrift drift;
+	return detect(image, drift);
+}
+
+PointGrid GuidedLensDetector::detect(const Lyli::Image::RawImage& image) {
+	LensDrift drift;
+	return detect(image, drift);
+}
+
+PointGrid GuidedLensDetector::detect(const Lyli::Image::BandDecoder& decoder) {
+	LensDrift drift;
+	return detect(decoder, drift);
+}
+
+PointGrid GuidedLensDetector::detect(const cv::Mat& image, LensDrift &drift) {
+	return pimpl->detectGray(convertToGray(image), drift);
+}
+
+PointGrid GuidedLensDetector::detect(const Lyli::Image::RawImage& image, LensDrift &drift) {
+	return pimpl->detectGray(image.getLuminance(), drift);
+}
+
+PointGrid GuidedLensDetector::detect(const Lyli::Image::BandDecoder& decoder, LensDrift &drift) {
+	return pimpl->detectGray(decoder.decodeLuminance(), drift);
+}
+
 }
 }
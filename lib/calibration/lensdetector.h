@@ -18,6 +18,7 @@
 #ifndef LYLI_CALIBRATION_LENSDETECTOR_H_
 #define LYLI_CALIBRATION_LENSDETECTOR_H_
 
+#include <cstddef>
 #include <cstdint>
 #include <memory>
 
@@ -27,9 +28,16 @@ namespace cv {
 class Mat;
 }
 
+namespace Lyli {
+namespace Image {
+class Metadata;
+}
+}
+
 namespace Lyli {
 namespace Calibration {
 
+class CalibrationData;
 class PointGrid;
 
 /**
@@ -75,9 +83,124 @@ class LensDetector : public LensDetectorInterface {
 public:
 	LensDetector(std::unique_ptr<PreprocessorInterface> preprocessor);
 	PointGrid detect(const cv::Mat& image) override;
+	PointGrid detect(const Lyli::Image::RawImage& image) override;
+	PointGrid detect(const Lyli::Image::BandDecoder& decoder) override;
+
+	/**
+	 * Check whether an image is too flat to contain any lenses.
+	 *
+	 * Only the small window that detect() uses to reject the flat images is decoded,
+	 * so the check costs a tiny fraction of the whole decode. The detect() returns
+	 * an empty grid for all images rejected by this check.
+	 *
+	 * @param decoder decoder of the image to check
+	 * @return true if the image should be skipped
+	 */
+	static bool isFlat(const Lyli::Image::BandDecoder& decoder);
 
 private:
 	std::unique_ptr<PreprocessorInterface> preprocessor;
+
+	/**
+	 * Detect lenses in an 8-bit grayscale image.
+	 */
+	PointGrid detectGray(const cv::Mat& gray);
+};
+
+/**
+ * Drift of the detected lenses from their predicted positions.
+ *
+ * The positions use the coordinates of the PointGrid. The predicted grid is first
+ * shifted to align with the lenses in the image center, the drift of the lenses
+ * is measured from the shifted predictions.
+ */
+struct LensDrift {
+	/// shift of the predicted grid in the x-direction found by the alignment
+	float shiftX = 0.0f;
+	/// shift of the predicted grid in the y-direction found by the alignment
+	float shiftY = 0.0f;
+	/// number of the predicted lenses inside of the image
+	std::size_t predicted = 0;
+	/// number of the lenses found near their predicted positions
+	std::size_t detected = 0;
+	/// mean drift in the x-direction
+	float meanX = 0.0f;
+	/// mean drift in the y-direction
+	float meanY = 0.0f;
+	/// mean distance of the lenses from their predicted positions
+	float meanDistance = 0.0f;
+	/// maximal distance of the lenses from their predicted positions
+	float maxDistance = 0.0f;
+};
+
+/**
+ * Lens detector refining the lens positions predicted from a prior grid.
+ *
+ * The predicted grid is aligned with the image using the lenses near its center,
+ * which corrects a global offset of up to a half of the lens pitch. Each lens is then
+ * refined only in a small neighbourhood of its aligned position, so neither the
+ * preprocessing nor the scan of the whole mask is needed. This is useful for
+ * the recalibration and the verification of the grid of a camera, whose lens
+ * positions are already known to within a few pixels apart from the global offset.
+ */
+class GuidedLensDetector : public LensDetectorInterface {
+public:
+	/// The maximal distance of a detected lens from its predicted position.
+	static constexpr float MAX_DRIFT = 3.0f;
+
+	/**
+	 * Predict the lens positions from an existing calibration.
+	 *
+	 * @param calibration the calibration of the camera
+	 */
+	explicit GuidedLensDetector(const CalibrationData &calibration);
+
+	/**
+	 * Predict the lens positions from the description of the microlens array.
+	 *
+	 * The lens pitch, rotation, scale factor and sensor offset of the microlens
+	 * array are used, the metadata must correspond to the detected images.
+	 *
+	 * @param metadata metadata of an image taken by the camera
+	 */
+	explicit GuidedLensDetector(const Lyli::Image::Metadata &metadata);
+
+	~GuidedLensDetector();
+
+	PointGrid detect(const cv::Mat& image) override;
+	PointGrid detect(const Lyli::Image::RawImage& image) override;
+	PointGrid detect(const Lyli::Image::BandDecoder& decoder) override;
+
+	/**
+	 * Detect lens centroids and measure their drift from the predicted positions.
+	 *
+	 * @param image image to process
+	 * @param drift output statistics of the drift
+	 * @return pointgrid with lens centroids
+	 */
+	PointGrid detect(const cv::Mat& image, LensDrift &drift);
+
+	/**
+	 * Detect lens centroids directly in a RAW image and measure their drift from the predicted positions.
+	 *
+	 * @param image image to process
+	 * @param drift output statistics of the drift
+	 * @return pointgrid with lens centroids
+	 */
+	PointGrid detect(const Lyli::Image::RawImage& image, LensDrift &drift);
+
+	/**
+	 * Detect lens centroids in an image decoded by bands and measure their drift from the predicted positions.
+	 *
+	 * @param decoder decoder of the image to process
+	 * @param drift output statistics of the drift
+	 * @return pointgrid with lens centroids
+	 */
+	PointGrid detect(const Lyli::Image::BandDecoder& decoder, LensDrift &drift);
+
+private:
+	class Impl;
+	std::unique_ptr<Impl> pimpl;
 };
 
 }
@@ -25,6 +25,13 @@ namespace cv {
 class Mat;
 }
 
+namespace Lyli {
+namespace Image {
+class BandDecoder;
+class RawImage;
+}
+}
+
 namespace Lyli {
 namespace Calibration {
 
@@ -52,6 +59,22 @@ public:
 	 */
 	virtual PointGrid detect(const cv::Mat& image) = 0;
 
+	/**
+	 * Detect lens centroids directly in a RAW image.
+	 *
+	 * @param image image to process
+	 * @return pointgrid with lens centroids
+	 */
+	virtual PointGrid detect(const Lyli::Image::RawImage& image) = 0;
+
+	/**
+	 * Detect lens centroids in an image decoded by bands.
+	 *
+	 * @param decoder decoder of the image to process
+	 * @return pointgrid with lens centroids
+	 */
+	virtual PointGrid detect(const Lyli::Image::BandDecoder& decoder) = 0;
+
 	// avoid copying
 	LensDetectorInterface(const LensDetectorInterface&) = delete;
 	LensDetectorInterface& operator=(const LensDetectorInterface&) = delete;
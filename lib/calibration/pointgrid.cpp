@@ -120,6 +120,11 @@ void PointGrid::addPoint(const cv::Point2f& point) {
 }
 
 void PointGrid::finalize() {
+	// there are no lines without points
+	if (accumulator.empty()) {
+		return;
+	}
+
 	// temporary line map for horizontal lines
 	TmpLineMap tmpLineMap;
 
@@ -131,7 +136,8 @@ void PointGrid::finalize() {
 	std::size_t constructStart = accumulator.size() / 3;
 	float construcStartPos = accumulator[constructStart]->getPosition().y;
 	std::intmax_t i = constructStart;
-	for (; accumulator[i]->getPosition().y < construcStartPos + CONSTRUCT_LIM; ++i) {
+	for (; i < static_cast<std::intmax_t>(accumulator.size())
+	       && accumulator[i]->getPosition().y < construcStartPos + CONSTRUCT_LIM; ++i) {
 		auto *point = accumulator[i];
 		mapAddConstruct(tmpLineMap, point->getPosition().x, point);
 	}
@@ -180,12 +186,14 @@ void PointGrid::finalize() {
 	// as these should be the most high-quality lines
 	TmpLineMap tmpLineMapOdd;
 	TmpLineMap tmpLineMapEven;
+	// fewer lines are used when the grid is small
 	constructStart = linesHorizontal.size() / 3;
-	verticalLineConstructor(constructStart, constructStart+6,
+	const std::size_t constructEnd = std::min(constructStart + 6, linesHorizontal.size());
+	verticalLineConstructor(constructStart, constructEnd,
 	                        [&](Point *point) {this->mapAddConstruct(tmpLineMapOdd, point->getPosition().y, point);},
 	                        [&](Point *point) {this->mapAddConstruct(tmpLineMapEven, point->getPosition().y, point);});
 	// add the following points to the lines
-	verticalLineConstructor(constructStart + 6, linesHorizontal.size(),
+	verticalLineConstructor(constructEnd, linesHorizontal.size(),
 	                        [&](Point *point) {this->mapAdd(tmpLineMapOdd, point->getPosition().y, point);},
 	                        [&](Point *point) {this->mapAdd(tmpLineMapEven, point->getPosition().y, point);});
 	// process the first few lines
@@ -352,6 +360,11 @@ void PointGrid::mapAddConstruct(TmpLineMap &lineMap, float position, Point *poin
 }
 
 void PointGrid::mapAdd(TmpLineMap &lineMap, float position, Point *point) {
+	// there is no line the point could be added to
+	if (lineMap.empty()) {
+		return;
+	}
+
 	// find
 	auto ub = lineMap.lower_bound(position);
 	auto lb = ub != lineMap.begin() ? std::prev(ub) : lineMap.end();
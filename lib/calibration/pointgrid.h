@@ -121,7 +121,7 @@ public:
 	 * Vertical lines are constructed in a similar fashion.
 	 *
 	 * The points that doesn't correspond to both horizontal and vertical line
-	 * are removed
+	 * are removed. The grid stays empty if no points were added.
 	 */
 	void finalize();
 
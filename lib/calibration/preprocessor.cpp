@@ -17,46 +17,246 @@
 
 #include "preprocessor.h"
 
+#include <algorithm>
 #include <cstdint>
+#include <vector>
 #include <opencv2/core/core.hpp>
-#include <opencv2/imgproc/imgproc.hpp>
 
-namespace Lyli {
-namespace Calibration {
+#include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+
+#include <image/framebufferpool.h>
+#include <image/parallel.h>
+
+/*
+ * The mask is computed in bands of rows in a single pass, it is the same as
+ * the mask computed by the following sequence of OpenCV operations:
+ *
+ *   cv::Laplacian(gray, edges, CV_8U, 3);
+ *   cv::threshold(edges, tmp, cv::mean(edges)[0], Mask::OBJECT, cv::THRESH_BINARY);
+ *   // filter out small specks, ie. the pixels with less than three of eight neighbours
+ *   cv::filter2D(tmp, mask, CV_8U, ring with all weights 0.125);
+ *   cv::threshold(mask, mask, 95, Mask::OBJECT, cv::THRESH_BINARY);
+ *   mask = Mask::OBJECT - mask.mul(tmp);
+ *   cv::erode(mask, tmp, 3x3 rectangle, 2 iterations);
+ *   cv::dilate(tmp, mask, 3x3 rectangle, 1 iteration);
+ *
+ * Each band computes its thresholded edges with a halo of rows needed by the filters,
+ * the morphology is computed on the rows packed into bits.
+ */
+
+namespace {
+
+/** The pixels of the mask rows are packed to bits of the words. */
+using Word = std::uint64_t;
+constexpr int WORD_BITS = 64;
+
+/** Number of rows the thresholded edges are needed around each band. */
+constexpr int HALO_ROWS = 4;
+
+/**
+ * Reflect the index over the border without duplicating the border pixel (BORDER_REFLECT_101).
+ */
+int reflect(int index, int size) {
+	if (index < 0) {
+		return -index;
+	}
+	if (index >= size) {
+		return 2 * size - 2 - index;
+	}
+	return index;
+}
+
+/**
+ * Compute a row of the 3x3 Laplacian of the image saturated to 0-255.
+ */
+void laplacianRow(const cv::Mat &gray, int y, std::uint8_t *out) {
+	const std::uint8_t *above = gray.ptr<std::uint8_t>(reflect(y - 1, gray.rows));
+	const std::uint8_t *row = gray.ptr<std::uint8_t>(y);
+	const std::uint8_t *below = gray.ptr<std::uint8_t>(reflect(y + 1, gray.rows));
+	const int cols = gray.cols;
+
+	auto laplacian = [&](int x, int left, int right) {
+		const int value = 2 * (above[left] + above[right] + below[left] + below[right]) - 8 * row[x];
+		return static_cast<std::uint8_t>(std::min(std::max(value, 0), 255));
+	};
+	out[0] = laplacian(0, reflect(-1, cols), 1);
+	for (int x = 1; x < cols - 1; ++x) {
+		out[x] = laplacian(x, x - 1, x + 1);
+	}
+	out[cols - 1] = laplacian(cols - 1, cols - 2, reflect(cols, cols));
+}
+
+/**
+ * Compute the threshold of the edges as their mean.
+ *
+ * The Laplacian is computed again in the fused pass, which is cheaper than storing it.
+ */
+std::uint8_t computeEdgeThreshold(const cv::Mat &gray) {
+	tbb::enumerable_thread_specific<std::vector<std::uint8_t>> rows;
+	tbb::enumerable_thread_specific<std::int64_t> sums(0);
+	tbb::parallel_for(tbb::blocked_range<int>(0, gray.rows), [&](const tbb::blocked_range<int> &range) {
+		std::vector<std::uint8_t> &edges = rows.local();
+		edges.resize(gray.cols);
+		std::int64_t sum = 0;
+		for (int y = range.begin(); y < range.end(); ++y) {
+			laplacianRow(gray, y, edges.data());
+			for (std::uint8_t edge : edges) {
+				sum += edge;
+			}
+		}
+		sums.local() += sum;
+	});
+
+	std::int64_t sum = 0;
+	for (std::int64_t local : sums) {
+		sum += local;
+	}
+	return static_cast<double>(sum) / gray.total();
+}
 
 /**
- * Compute optimal threshold for thresholding the edge image
+ * Buffers of a band reused by the tasks of a thread.
+ */
+struct BandBuffers {
+	// thresholded edges, one byte per pixel, 0 or 1
+	std::vector<std::uint8_t> edges;
+	// sums of the edges in three consecutive rows
+	std::vector<std::uint8_t> columnSums;
+	// packed rows before the erosion, after the horizontal and after the vertical erosion
+	std::vector<Word> mask;
+	std::vector<Word> horizontal;
+	std::vector<Word> eroded;
+	// packed rows after the horizontal dilation
+	std::vector<Word> dilated;
+};
+
+/**
+ * Erode or dilate a packed row horizontally by one pixel.
  *
- * @return threshold
+ * The pixels outside of the image are neutral, ie. set for the erosion and cleared for the dilation.
+ */
+template<bool erode>
+void morphRow(const Word *in, Word *out, int words, Word lastMask) {
+	const Word outside = erode ? ~Word(0) : Word(0);
+	auto word = [&](int i) {
+		if (i < 0 || i >= words) {
+			return outside;
+		}
+		// the bits past the last pixel are neutral as well
+		return i == words - 1 ? (erode ? in[i] | ~lastMask : in[i] & lastMask) : in[i];
+	};
+	for (int i = 0; i < words; ++i) {
+		const Word current = word(i);
+		const Word left = (current << 1) | (word(i - 1) >> (WORD_BITS - 1));
+		const Word right = (current >> 1) | (word(i + 1) << (WORD_BITS - 1));
+		out[i] = erode ? (current & left & right) : (current | left | right);
+	}
+}
+
+/**
+ * Compute the mask for the rows [first, last).
  */
-std::uint8_t computeEdgeThreshold(const cv::Mat& edges) {
-	// compute mean and use it as average
-	return cv::mean(edges)[0];
+void processBand(const cv::Mat &gray, std::uint8_t threshold, int first, int last, BandBuffers &buffers, cv::Mat &outMask) {
+	const int rows = gray.rows;
+	const int cols = gray.cols;
+	const int words = (cols + WORD_BITS - 1) / WORD_BITS;
+	const Word lastMask = cols % WORD_BITS == 0 ? ~Word(0) : (Word(1) << (cols % WORD_BITS)) - 1;
+
+	// the thresholded edges
+	const int edgesFirst = std::max(first - HALO_ROWS, 0);
+	const int edgesLast = std::min(last + HALO_ROWS, rows);
+	buffers.edges.resize(static_cast<std::size_t>(edgesLast - edgesFirst) * cols);
+	for (int y = edgesFirst; y < edgesLast; ++y) {
+		std::uint8_t *edges = buffers.edges.data() + static_cast<std::size_t>(y - edgesFirst) * cols;
+		laplacianRow(gray, y, edges);
+		for (int x = 0; x < cols; ++x) {
+			edges[x] = edges[x] > threshold ? 1 : 0;
+		}
+	}
+	auto edgeRow = [&](int y) {
+		return buffers.edges.data() + static_cast<std::size_t>(reflect(y, rows) - edgesFirst) * cols;
+	};
+
+	// the inverted edges without the specks eroded horizontally
+	const int maskFirst = std::max(first - HALO_ROWS + 1, 0);
+	const int maskLast = std::min(last + HALO_ROWS - 1, rows);
+	buffers.columnSums.resize(cols);
+	buffers.mask.resize(words);
+	buffers.horizontal.resize(static_cast<std::size_t>(maskLast - maskFirst) * words);
+	for (int y = maskFirst; y < maskLast; ++y) {
+		const std::uint8_t *above = edgeRow(y - 1);
+		const std::uint8_t *row = edgeRow(y);
+		const std::uint8_t *below = edgeRow(y + 1);
+		std::uint8_t *sums = buffers.columnSums.data();
+		for (int x = 0; x < cols; ++x) {
+			sums[x] = above[x] + row[x] + below[x];
+		}
+		std::fill(buffers.mask.begin(), buffers.mask.end(), 0);
+		for (int x = 0; x < cols; ++x) {
+			const int neighbours = sums[reflect(x - 1, cols)] + sums[x] + sums[reflect(x + 1, cols)] - row[x];
+			if (row[x] == 0 || neighbours < 3) {
+				buffers.mask[x / WORD_BITS] |= Word(1) << (x % WORD_BITS);
+			}
+		}
+		// two iterations of 3x3 erosion are 5x5 erosion
+		Word *horizontal = buffers.horizontal.data() + static_cast<std::size_t>(y - maskFirst) * words;
+		morphRow<true>(buffers.mask.data(), horizontal, words, lastMask);
+		morphRow<true>(horizontal, buffers.mask.data(), words, lastMask);
+		std::copy(buffers.mask.begin(), buffers.mask.end(), horizontal);
+	}
+
+	// vertical erosion followed by the horizontal dilation
+	const int erodedFirst = std::max(first - 1, 0);
+	const int erodedLast = std::min(last + 1, rows);
+	buffers.eroded.resize(words);
+	buffers.dilated.resize(static_cast<std::size_t>(erodedLast - erodedFirst) * words);
+	for (int y = erodedFirst; y < erodedLast; ++y) {
+		std::fill(buffers.eroded.begin(), buffers.eroded.end(), ~Word(0));
+		for (int source = std::max(y - 2, 0); source < std::min(y + 3, rows); ++source) {
+			const Word *horizontal = buffers.horizontal.data() + static_cast<std::size_t>(source - maskFirst) * words;
+			for (int i = 0; i < words; ++i) {
+				buffers.eroded[i] &= horizontal[i];
+			}
+		}
+		morphRow<false>(buffers.eroded.data(), buffers.dilated.data() + static_cast<std::size_t>(y - erodedFirst) * words,
+		                words, lastMask);
+	}
+
+	// vertical dilation
+	for (int y = first; y < last; ++y) {
+		std::fill(buffers.eroded.begin(), buffers.eroded.end(), 0);
+		for (int source = std::max(y - 1, 0); source < std::min(y + 2, rows); ++source) {
+			const Word *dilated = buffers.dilated.data() + static_cast<std::size_t>(source - erodedFirst) * words;
+			for (int i = 0; i < words; ++i) {
+				buffers.eroded[i] |= dilated[i];
+			}
+		}
+		std::uint8_t *out = outMask.ptr<std::uint8_t>(y);
+		for (int x = 0; x < cols; ++x) {
+			const bool set = (buffers.eroded[x / WORD_BITS] >> (x % WORD_BITS)) & 1;
+			out[x] = set ? std::uint8_t(Lyli::Calibration::Mask::OBJECT) : std::uint8_t(Lyli::Calibration::Mask::EMPTY);
+		}
+	}
+}
+
 }
 
+namespace Lyli {
+namespace Calibration {
+
 cv::Mat Preprocessor::preprocess(const cv::Mat& gray) {
 	cv::Mat outMask;
-	cv::Mat tmp;
-
-	// find edges and apply threshold
-	cv::Laplacian(gray, outMask, CV_8U, 3);
-	std::uint8_t threshold = computeEdgeThreshold(outMask);
-	cv::threshold(outMask, tmp, threshold, Mask::OBJECT, cv::THRESH_BINARY);
-
-	// filter out small specks
-	float m[3][3] = { { 0.125, 0.125, 0.125 }, { 0.125, 0, 0.125 }, { 0.125, 0.125, 0.125 } };
-	cv::Mat filterKernel(3, 3, CV_32F, m);
-	cv::filter2D(tmp, outMask, CV_8U , filterKernel, cv::Point(1, 1));
-	cv::threshold(outMask, outMask, 95, Mask::OBJECT, cv::THRESH_BINARY);
-
-	// invert
-	outMask = outMask.mul(tmp);
-	outMask = cv::Scalar::all(Mask::OBJECT) - outMask;
-
-	cv::Point anchor(1, 1);
-	cv::Mat element = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(3, 3), anchor);
-	cv::erode(outMask, tmp, element, anchor, 2);
-	cv::dilate(tmp, outMask, element, anchor, 1);
+	Lyli::Image::FrameBufferPool::getDefault().create(outMask, gray.rows, gray.cols, CV_8UC1);
+
+	const std::uint8_t threshold = computeEdgeThreshold(gray);
+
+	tbb::enumerable_thread_specific<BandBuffers> buffers;
+	const int bandRows = Lyli::Image::getBandRows(gray.cols);
+	tbb::parallel_for(tbb::blocked_range<int>(0, gray.rows, bandRows), [&](const tbb::blocked_range<int> &range) {
+		processBand(gray, threshold, range.begin(), range.end(), buffers.local(), outMask);
+	}, tbb::simple_partitioner());
 
 	return outMask;
 }
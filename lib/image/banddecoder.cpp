@@ -0,0 +1,256 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "banddecoder.h"
+
+#include <algorithm>
+#include <sstream>
+
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+
+#include "demosaic.h"
+#include "framebufferpool.h"
+#include "mappedfile.h"
+#include "parallel.h"
+#include "rawcodec.h"
+#include "rawdecode.h"
+#include "readahead.h"
+
+namespace {
+
+/**
+ * Call the function for all bands of rows in parallel, only the last band may be shorter.
+ */
+template<typename Function>
+void forEachBand(int rows, int bandRows, const Function &function) {
+	const int bands = (rows + bandRows - 1) / bandRows;
+	tbb::parallel_for(0, bands, [&](int band) {
+		function(band * bandRows, std::min((band + 1) * bandRows, rows));
+	});
+}
+
+}
+
+namespace Lyli {
+namespace Image {
+
+BandDecoder::BandDecoder(const std::uint8_t *data, std::size_t size, const RawFormat &format,
+                         const DecodeOptions &options) :
+	m_data(data), m_size(size), m_format(format), m_options(options),
+	m_demosaic(selectDemosaic(options)) {
+	if (CompressedRaw::isCompressed(data, size)) {
+		m_compressed = std::make_shared<CompressedRaw>(data, size);
+		m_format = m_compressed->getFormat();
+	}
+	m_format.validate();
+	checkDefectMap(m_format, options);
+}
+
+BandDecoder BandDecoder::fromFile(const std::string &path, const RawFormat &format, const DecodeOptions &options) {
+	std::shared_ptr<const MappedFile> file(std::make_shared<MappedFile>(path));
+	if (!CompressedRaw::isCompressed(file->getData(), file->getSize()) && file->getSize() < format.getFrameBytes()) {
+		std::stringstream ss;
+		ss << path << " is too short for a " << format.width << "x" << format.height << " image";
+		throw FileAccessException(ss.str());
+	}
+	BandDecoder decoder(file->getData(), file->getSize(), format, options);
+	decoder.m_file = std::move(file);
+	return decoder;
+}
+
+BandDecoder BandDecoder::fromBuffer(const std::shared_ptr<const FileBuffer> &buffer, const RawFormat &format,
+                                    const DecodeOptions &options) {
+	if (!CompressedRaw::isCompressed(buffer->getData(), buffer->getSize())
+	    && buffer->getSize() < format.getFrameBytes()) {
+		std::stringstream ss;
+		ss << buffer->getPath() << " is too short for a " << format.width << "x" << format.height << " image";
+		throw FileAccessException(ss.str());
+	}
+	BandDecoder decoder(buffer->getData(), buffer->getSize(), format, options);
+	decoder.m_file = buffer;
+	return decoder;
+}
+
+std::size_t BandDecoder::getWidth() const {
+	return m_options.halfSize ? m_format.width / 2 : m_format.width;
+}
+
+std::size_t BandDecoder::getHeight() const {
+	return m_options.halfSize ? m_format.height / 2 : m_format.height;
+}
+
+FrameStatistics BandDecoder::decode(const Consumer &consumer) const {
+	return decodeBands(consumer, false);
+}
+
+FrameStatistics BandDecoder::decodeLuminance(const Consumer &consumer) const {
+	return decodeBands(consumer, true);
+}
+
+cv::Mat BandDecoder::decodeLuminance() const {
+	cv::Mat gray;
+	FrameBufferPool::getDefault().create(gray, getHeight(), getWidth(), CV_8UC1);
+	decodeBands([&gray](const cv::Mat &band, int firstRow) {
+		cv::Mat rows(gray.rowRange(firstRow, firstRow + band.rows));
+		band.copyTo(rows);
+	}, true);
+	return gray;
+}
+
+cv::Mat BandDecoder::decodeRegion(const cv::Rect &region) const {
+	return decodeWindow(region, false);
+}
+
+cv::Mat BandDecoder::decodeRegionLuminance(const cv::Rect &region) const {
+	return decodeWindow(region, true);
+}
+
+FrameStatistics BandDecoder::decodeBands(const Consumer &consumer, bool luminance) const {
+	const int height = m_format.height;
+	const int width = m_format.width;
+	const std::size_t rowBytes = m_format.getRowBytes();
+
+	// the statistics are gathered by each thread separately and merged at the end
+	tbb::enumerable_thread_specific<FrameStatistics> statistics;
+	const auto mergeStatistics = [&statistics]() {
+		FrameStatistics result;
+		statistics.combine_each([&result](const FrameStatistics &local) {
+			result.merge(local);
+		});
+		return result;
+	};
+
+	if (m_options.halfSize) {
+		int bandRows = getBandRows(2 * rowBytes + width * 3 * sizeof(std::uint16_t) / 2);
+		if (m_compressed) {
+			// the bands follow the compressed strips
+			const int stripRows = m_compressed->getStripRows() / 2;
+			bandRows = std::max(bandRows / stripRows, 1) * stripRows;
+		}
+		forEachBand(height / 2, bandRows, [&](int firstRow, int lastRow) {
+			cv::Mat rgb(lastRow - firstRow, width / 2, CV_16UC3);
+			FrameStatistics *localStatistics = m_options.statistics ? &statistics.local() : nullptr;
+			if (m_compressed) {
+				binRows(*m_compressed, m_options, firstRow, lastRow, rgb, localStatistics);
+			}
+			else {
+				binRows(m_data, m_size, m_format, m_options, firstRow, lastRow, rgb, localStatistics);
+			}
+			if (luminance) {
+				cv::Mat gray(rgb.rows, rgb.cols, CV_8UC1);
+				for (int y = 0; y < rgb.rows; ++y) {
+					rgbToLuminance(rgb.ptr<std::uint16_t>(y), gray.ptr<std::uint8_t>(y), rgb.cols);
+				}
+				consumer(gray, firstRow);
+			}
+			else {
+				consumer(rgb, firstRow);
+			}
+		});
+		return mergeStatistics();
+	}
+
+	checkDemosaicFormat(m_format);
+
+	// every band needs the neighbouring rows for the interpolation
+	const int apron = m_demosaic->getApron();
+	int bandRows = getBandRows(rowBytes + width * sizeof(std::uint16_t) + width * 3 * sizeof(std::uint16_t));
+	if (m_compressed) {
+		// the bands follow the compressed strips, the rows above a band can be decoded
+		// only by decoding the whole previous strip, so the bands span several strips
+		const int stripRows = m_compressed->getStripRows();
+		bandRows = std::max(bandRows / stripRows, 4) * stripRows;
+	}
+	forEachBand(height, bandRows, [&](int firstRow, int lastRow) {
+		const int first = std::max(firstRow - apron, 0);
+		const int last = std::min(lastRow + apron, height);
+		cv::Mat mosaic(last - first, width, CV_16UC1);
+		if (m_compressed) {
+			unpackRows(*m_compressed, m_options, first, last, mosaic);
+		}
+		else {
+			unpackRows(m_data, m_size, m_format, m_options, first, last, mosaic);
+		}
+		// the rows of the apron belong to the neighbouring bands
+		if (m_options.statistics) {
+			addRowStatistics(m_format, m_options, mosaic, first, firstRow, lastRow, statistics.local());
+		}
+
+		const cv::Rect region(0, firstRow, width, lastRow - firstRow);
+		if (luminance) {
+			consumer(m_demosaic->luminanceBand(mosaic, first, height, region), firstRow);
+		}
+		else {
+			consumer(m_demosaic->demosaicBand(mosaic, first, height, region), firstRow);
+		}
+	});
+	return mergeStatistics();
+}
+
+cv::Mat BandDecoder::decodeWindow(const cv::Rect &region, bool luminance) const {
+	checkRegion(region, getWidth(), getHeight());
+
+	if (m_options.halfSize) {
+		cv::Mat rgb(region.height, region.width, CV_16UC3);
+		if (m_compressed) {
+			binRegion(*m_compressed, m_options, region, rgb);
+		}
+		else {
+			binRegion(m_data, m_size, m_format, m_options, region, rgb);
+		}
+		if (!luminance) {
+			return rgb;
+		}
+		cv::Mat gray(rgb.rows, rgb.cols, CV_8UC1);
+		for (int y = 0; y < rgb.rows; ++y) {
+			rgbToLuminance(rgb.ptr<std::uint16_t>(y), gray.ptr<std::uint8_t>(y), rgb.cols);
+		}
+		return gray;
+	}
+
+	checkDemosaicFormat(m_format);
+
+	// the interpolation needs the neighbouring pixels in all directions plus one more pixel
+	// for the borders that may be copies of their neighbours, the window starts at an even
+	// column, so that the columns of the bayer filter are preserved
+	const int apron = m_demosaic->getApron() + 1;
+	const int height = m_format.height;
+	const cv::Rect image(0, 0, m_format.width, height);
+	cv::Rect window(cv::Rect(region.x - apron, region.y - apron, region.width + 2 * apron, region.height + 2 * apron) & image);
+	window.width += window.x & 1;
+	window.x &= ~1;
+
+	cv::Mat mosaic(window.height, window.width, CV_16UC1);
+	if (m_compressed) {
+		unpackRegion(*m_compressed, m_options, window, mosaic);
+	}
+	else {
+		unpackRegion(m_data, m_size, m_format, m_options, window, mosaic);
+	}
+
+	// the window is treated as a band of rows of a narrower image, its side columns
+	// are either the borders of the image or lie outside of the apron of the region
+	const cv::Rect bandRegion(region.x - window.x, region.y, region.width, region.height);
+	if (luminance) {
+		return m_demosaic->luminanceBand(mosaic, window.y, height, bandRegion);
+	}
+	return m_demosaic->demosaicBand(mosaic, window.y, height, bandRegion);
+}
+
+}
+}
@@ -0,0 +1,180 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LYLI_IMAGE_BANDDECODER_H_
+#define LYLI_IMAGE_BANDDECODER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <opencv2/core/core.hpp>
+
+#include <image/framestatistics.h>
+#include <image/rawimage.h>
+
+namespace Lyli {
+namespace Image {
+
+class CompressedRaw;
+class DemosaicInterface;
+class FileBuffer;
+
+/** A decoder of the Lytro RAW images that never creates the whole image.
+ *
+ * The image is decoded in bands of rows that are passed to a consumer. Only
+ * the rows needed for the currently processed bands are unpacked, so the memory
+ * requirements depend on the band height rather than on the image size.
+ *
+ * The bands are decoded in parallel, the consumer is called concurrently
+ * from multiple threads and the bands are not passed in any particular order.
+ * The band is valid only during the call.
+ *
+ * Both the .RAW files and the files compressed by compressRaw() are accepted.
+ * The format stored in the compressed files is used instead of the given one.
+ */
+class BandDecoder {
+public:
+	/** A consumer of the decoded bands.
+	 *
+	 * The first parameter contains the decoded rows, the second is the index
+	 * of the first row of the band in the image.
+	 */
+	using Consumer = std::function<void(const cv::Mat &band, int firstRow)>;
+
+	/** Construct the decoder for packed data in memory.
+	 *
+	 * The data has to stay valid while the decoder is used.
+	 *
+	 * \param data the contents of a .RAW file or of a compressed file
+	 * \param size size of the data in bytes
+	 * \param format layout of the data
+	 * \param options decoding options
+	 * \throw UnsupportedFormatException when the format cannot be decoded
+	 */
+	BandDecoder(const std::uint8_t *data, std::size_t size, const RawFormat &format,
+	            const DecodeOptions &options = DecodeOptions());
+
+	/** Construct the decoder for a file.
+	 *
+	 * The file is memory mapped for the lifetime of the decoder.
+	 *
+	 * \param path path to the .RAW file
+	 * \param format layout of the data
+	 * \param options decoding options
+	 * \throw FileAccessException when the file cannot be read or is too short
+	 * \throw UnsupportedFormatException when the format cannot be decoded
+	 */
+	static BandDecoder fromFile(const std::string &path, const RawFormat &format,
+	                            const DecodeOptions &options = DecodeOptions());
+
+	/** Construct the decoder for a file that was read into memory.
+	 *
+	 * The buffer is kept for the lifetime of the decoder.
+	 *
+	 * \param buffer contents of the .RAW file
+	 * \param format layout of the data
+	 * \param options decoding options
+	 * \throw FileAccessException when the file is too short
+	 * \throw UnsupportedFormatException when the format cannot be decoded
+	 */
+	static BandDecoder fromBuffer(const std::shared_ptr<const FileBuffer> &buffer, const RawFormat &format,
+	                              const DecodeOptions &options = DecodeOptions());
+
+	/** Get width of the decoded image.
+	 */
+	std::size_t getWidth() const;
+
+	/** Get height of the decoded image.
+	 */
+	std::size_t getHeight() const;
+
+	/** Decode the image.
+	 *
+	 * The bands contain RGB uint16_t pixels, the same as the corresponding rows
+	 * of RawImage::getData().
+	 *
+	 * \param consumer the consumer of the decoded bands
+	 * \return statistics of the mosaic, the same as RawImage::getStatistics(),
+	 *         empty if they were not requested in the decoding options
+	 * \throw UnsupportedFormatException when the mosaic cannot be demosaiced
+	 */
+	FrameStatistics decode(const Consumer &consumer) const;
+
+	/** Decode 8-bit luminance of the image.
+	 *
+	 * The bands contain uint8_t pixels, the same as the corresponding rows
+	 * of RawImage::getLuminance().
+	 *
+	 * \param consumer the consumer of the decoded bands
+	 * \return statistics of the mosaic, empty if they were not requested in the decoding options
+	 * \throw UnsupportedFormatException when the mosaic cannot be demosaiced
+	 */
+	FrameStatistics decodeLuminance(const Consumer &consumer) const;
+
+	/** Decode 8-bit luminance of the whole image.
+	 *
+	 * The bands are assembled into an image allocated from the default FrameBufferPool.
+	 *
+	 * \return uint8_t pixels, the same as RawImage::getLuminance()
+	 * \throw UnsupportedFormatException when the mosaic cannot be demosaiced
+	 */
+	cv::Mat decodeLuminance() const;
+
+	/** Decode a part of the image.
+	 *
+	 * Only the rows and columns of the region and the neighbouring pixels needed
+	 * for the interpolation are unpacked, the rest of the data is not touched.
+	 * The result is identical to the corresponding part of the decoded image.
+	 *
+	 * \param region the region to decode, must lie inside the decoded image
+	 * \return RGB uint16_t pixels of the region
+	 * \throw InvalidRegionException when the region does not lie inside the decoded image
+	 * \throw UnsupportedFormatException when the mosaic cannot be demosaiced
+	 */
+	cv::Mat decodeRegion(const cv::Rect &region) const;
+
+	/** Decode 8-bit luminance of a part of the image.
+	 *
+	 * \param region the region to decode, must lie inside the decoded image
+	 * \return uint8_t pixels of the region
+	 * \throw InvalidRegionException when the region does not lie inside the decoded image
+	 * \throw UnsupportedFormatException when the mosaic cannot be demosaiced
+	 */
+	cv::Mat decodeRegionLuminance(const cv::Rect &region) const;
+
+private:
+	// the owner of the data, if any
+	std::shared_ptr<const void> m_file;
+	const std::uint8_t *m_data;
+	std::size_t m_size;
+	RawFormat m_format;
+	// the parsed header of compressed data
+	std::shared_ptr<const CompressedRaw> m_compressed;
+	DecodeOptions m_options;
+	std::shared_ptr<const DemosaicInterface> m_demosaic;
+
+	FrameStatistics decodeBands(const Consumer &consumer, bool luminance) const;
+	cv::Mat decodeWindow(const cv::Rect &region, bool luminance) const;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "defectmap.h"
+
+#include <algorithm>
+
+#include <json/value.h>
+
+namespace Lyli {
+namespace Image {
+
+DefectMap::DefectMap() : m_width(0), m_height(0) {
+
+}
+
+DefectMap::DefectMap(const std::string &serial, std::size_t width, std::size_t height, std::vector<std::uint32_t> pixels) :
+	m_serial(serial), m_width(width), m_height(height), m_pixels(std::move(pixels)) {
+	std::sort(m_pixels.begin(), m_pixels.end());
+	m_pixels.erase(std::unique(m_pixels.begin(), m_pixels.end()), m_pixels.end());
+}
+
+const std::string &DefectMap::getSerial() const {
+	return m_serial;
+}
+
+std::size_t DefectMap::getWidth() const {
+	return m_width;
+}
+
+std::size_t DefectMap::getHeight() const {
+	return m_height;
+}
+
+const std::vector<std::uint32_t> &DefectMap::getPixels() const {
+	return m_pixels;
+}
+
+bool DefectMap::isDefective(std::size_t x, std::size_t y) const {
+	return std::binary_search(m_pixels.begin(), m_pixels.end(), y * m_width + x);
+}
+
+void DefectMap::correctRow(std::size_t y, std::size_t first, std::size_t count, std::uint16_t *row) const {
+	const std::uint32_t begin = y * m_width + first;
+	const std::uint32_t end = begin + count;
+	auto defect = std::lower_bound(m_pixels.begin(), m_pixels.end(), begin);
+	for (; defect != m_pixels.end() && *defect < end; ++defect) {
+		// the pixels of the same color are two columns apart, walk over them
+		// in both directions until a pixel that is not defective is found
+		const std::uint32_t pixel = *defect;
+		std::uint32_t left = pixel;
+		bool hasLeft = false;
+		while (!hasLeft && left >= begin + 2) {
+			left -= 2;
+			hasLeft = !std::binary_search(m_pixels.begin(), defect, left);
+		}
+		std::uint32_t right = pixel;
+		bool hasRight = false;
+		while (!hasRight && right + 2 < end) {
+			right += 2;
+			hasRight = !std::binary_search(defect + 1, m_pixels.end(), right);
+		}
+		std::uint16_t *out = row + (pixel - begin);
+		if (hasLeft && hasRight) {
+			*out = (row[left - begin] + row[right - begin] + 1) >> 1;
+		}
+		else if (hasLeft) {
+			*out = row[left - begin];
+		}
+		else if (hasRight) {
+			*out = row[right - begin];
+		}
+	}
+}
+
+Json::Value DefectMap::serialize() const {
+	Json::Value root(Json::objectValue);
+	root["serial"] = m_serial;
+	root["width"] = static_cast<Json::UInt>(m_width);
+	root["height"] = static_cast<Json::UInt>(m_height);
+	Json::Value pixels(Json::arrayValue);
+	for (std::uint32_t pixel : m_pixels) {
+		Json::Value position(Json::arrayValue);
+		position.append(static_cast<Json::UInt>(pixel % m_width));
+		position.append(static_cast<Json::UInt>(pixel / m_width));
+		pixels.append(position);
+	}
+	root["pixels"] = pixels;
+	return root;
+}
+
+void DefectMap::deserialize(const Json::Value &value) {
+	std::vector<std::uint32_t> pixels;
+	const std::size_t width = value["width"].asUInt();
+	for (const Json::Value &position : value["pixels"]) {
+		pixels.push_back(position[1].asUInt() * width + position[0].asUInt());
+	}
+	*this = DefectMap(value["serial"].asString(), width, value["height"].asUInt(), std::move(pixels));
+}
+
+}
+}
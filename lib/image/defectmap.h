@@ -0,0 +1,110 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LYLI_IMAGE_DEFECTMAP_H_
+#define LYLI_IMAGE_DEFECTMAP_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Json {
+class Value;
+}
+
+namespace Lyli {
+namespace Image {
+
+/** Defective pixels of a sensor.
+ *
+ * The defects are stored as a sorted list of the pixel indices (y * width + x),
+ * so the pixels of any row can be found quickly and the correction costs only
+ * work proportional to the number of defects.
+ */
+class DefectMap {
+public:
+	/** Construct an empty map.
+	 */
+	DefectMap();
+
+	/** Construct the map.
+	 *
+	 * \param serial serial number of the camera
+	 * \param width width of the sensor
+	 * \param height height of the sensor
+	 * \param pixels indices (y * width + x) of the defective pixels in any order
+	 */
+	DefectMap(const std::string &serial, std::size_t width, std::size_t height, std::vector<std::uint32_t> pixels);
+
+	/** Get serial number of the camera.
+	 */
+	const std::string &getSerial() const;
+
+	/** Get width of the sensor.
+	 */
+	std::size_t getWidth() const;
+
+	/** Get height of the sensor.
+	 */
+	std::size_t getHeight() const;
+
+	/** Get the sorted indices of the defective pixels.
+	 */
+	const std::vector<std::uint32_t> &getPixels() const;
+
+	/** Check whether a pixel is defective.
+	 */
+	bool isDefective(std::size_t x, std::size_t y) const;
+
+	/** Correct the defective pixels of a part of a row of the mosaic.
+	 *
+	 * Each defective pixel is replaced by the mean of the nearest pixel of the same
+	 * color that is not defective on its left and the one on its right, so runs of
+	 * neighbouring defects are corrected as well. Only the pixels in the row part are
+	 * used. When there is a good pixel only on one side, its value is copied, and
+	 * when there is none, the pixel is left unchanged.
+	 *
+	 * \param y index of the row
+	 * \param first index of the first column of the row part
+	 * \param count number of pixels of the row part
+	 * \param row uint16_t pixels of the row part
+	 */
+	void correctRow(std::size_t y, std::size_t first, std::size_t count, std::uint16_t *row) const;
+
+	/**
+	 * Serialize into a JSON object
+	 * \return JSON object representing the class
+	 */
+	Json::Value serialize() const;
+	/**
+	 * Deserialize from a JSON object
+	 * \param value JSON object representing the class
+	 */
+	void deserialize(const Json::Value &value);
+
+private:
+	std::string m_serial;
+	std::size_t m_width;
+	std::size_t m_height;
+	std::vector<std::uint32_t> m_pixels;
+};
+
+}
+}
+
+#endif
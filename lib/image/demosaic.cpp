@@ -0,0 +1,232 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "demosaic.h"
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/partitioner.h>
+
+#include "framebufferpool.h"
+#include "parallel.h"
+
+namespace {
+
+/*
+ * Bilinear interpolation of the individual pixels of the bayer filter.
+ * The filter has blue/green even lines and green/red odd lines.
+ */
+
+inline void demosaicRed(const std::uint16_t *prev, const std::uint16_t *cur, const std::uint16_t *next,
+                        std::size_t x, std::uint16_t *pixel) {
+	pixel[0] = cur[x];
+	pixel[1] = (cur[x - 1] + cur[x + 1] + prev[x] + next[x]) >> 2;
+	pixel[2] = (prev[x - 1] + prev[x + 1] + next[x - 1] + next[x + 1]) >> 2;
+}
+
+inline void demosaicGreenRed(const std::uint16_t *prev, const std::uint16_t *cur, const std::uint16_t *next,
+                             std::size_t x, std::uint16_t *pixel) {
+	pixel[0] = (cur[x - 1] + cur[x + 1]) >> 1;
+	pixel[1] = cur[x];
+	pixel[2] = (prev[x] + next[x]) >> 1;
+}
+
+inline void demosaicGreenBlue(const std::uint16_t *prev, const std::uint16_t *cur, const std::uint16_t *next,
+                              std::size_t x, std::uint16_t *pixel) {
+	pixel[0] = (prev[x] + next[x]) >> 1;
+	pixel[1] = cur[x];
+	pixel[2] = (cur[x - 1] + cur[x + 1]) >> 1;
+}
+
+inline void demosaicBlue(const std::uint16_t *prev, const std::uint16_t *cur, const std::uint16_t *next,
+                         std::size_t x, std::uint16_t *pixel) {
+	pixel[0] = (prev[x - 1] + prev[x + 1] + next[x - 1] + next[x + 1]) >> 2;
+	pixel[1] = (cur[x - 1] + cur[x + 1] + prev[x] + next[x]) >> 2;
+	pixel[2] = cur[x];
+}
+
+inline void demosaicPixel(const std::uint16_t *prev, const std::uint16_t *cur, const std::uint16_t *next,
+                          std::size_t x, bool oddRow, std::uint16_t *pixel) {
+	if (oddRow) {
+		if ((x & 1) != 0) {
+			demosaicRed(prev, cur, next, x, pixel);
+		}
+		else {
+			demosaicGreenRed(prev, cur, next, x, pixel);
+		}
+	}
+	else {
+		if ((x & 1) != 0) {
+			demosaicGreenBlue(prev, cur, next, x, pixel);
+		}
+		else {
+			demosaicBlue(prev, cur, next, x, pixel);
+		}
+	}
+}
+
+/**
+ * Demosaic a part of a row.
+ *
+ * The first and the last pixel of the row are copies of their neighbours.
+ *
+ * \param prev the previous row of the mosaic
+ * \param cur the row to demosaic
+ * \param next the following row of the mosaic
+ * \param out output RGB pixels, starting at the begin
+ * \param width width of the whole row
+ * \param oddRow whether the row has an odd index
+ * \param begin the first pixel to demosaic
+ * \param end one past the last pixel to demosaic
+ */
+void demosaicRow(const std::uint16_t *prev, const std::uint16_t *cur, const std::uint16_t *next,
+                 std::uint16_t *out, std::size_t width, bool oddRow, std::size_t begin, std::size_t end) {
+	auto source = [width](std::size_t x) {
+		return std::min(std::max<std::size_t>(x, 1), width - 2);
+	};
+
+	// process pixels one by one until the pairs are aligned to odd x
+	std::size_t x = begin;
+	for (; x < end && (x == 0 || (x & 1) == 0); ++x) {
+		demosaicPixel(prev, cur, next, source(x), oddRow, out + 3 * (x - begin));
+	}
+
+	// the interior is processed in pairs (odd x, even x) without branches
+	const std::size_t pairEnd = std::min(end, width - 1);
+	if (oddRow) {
+		for (; x + 1 < pairEnd; x += 2) {
+			std::uint16_t *pixel = out + 3 * (x - begin);
+			demosaicRed(prev, cur, next, x, pixel);
+			demosaicGreenRed(prev, cur, next, x + 1, pixel + 3);
+		}
+	}
+	else {
+		for (; x + 1 < pairEnd; x += 2) {
+			std::uint16_t *pixel = out + 3 * (x - begin);
+			demosaicGreenBlue(prev, cur, next, x, pixel);
+			demosaicBlue(prev, cur, next, x + 1, pixel + 3);
+		}
+	}
+
+	// the remaining pixels including the border
+	for (; x < end; ++x) {
+		demosaicPixel(prev, cur, next, source(x), oddRow, out + 3 * (x - begin));
+	}
+}
+
+}
+
+namespace Lyli {
+namespace Image {
+
+void rgbToLuminance(const std::uint16_t *rgb, std::uint8_t *out, std::size_t count) {
+	// Y = 0.299 R + 0.587 G + 0.114 B with 14 fractional bits
+	constexpr std::uint32_t R2Y = 4899;
+	constexpr std::uint32_t G2Y = 9617;
+	constexpr std::uint32_t B2Y = 1868;
+	constexpr std::uint32_t SHIFT = 14;
+	for (std::size_t i = 0; i < count; ++i) {
+		const std::uint32_t y = (rgb[3 * i] * R2Y + rgb[3 * i + 1] * G2Y + rgb[3 * i + 2] * B2Y + (1 << (SHIFT - 1))) >> SHIFT;
+		// divide by 256 and round half to even
+		const std::uint32_t quotient = y >> 8;
+		const std::uint32_t remainder = y & 0xFF;
+		const std::uint32_t rounded = quotient + (remainder > 128 || (remainder == 128 && (quotient & 1) != 0));
+		out[i] = std::min<std::uint32_t>(rounded, 255);
+	}
+}
+
+cv::Mat DemosaicInterface::demosaic(const cv::Mat &mosaic, const cv::Rect &region) const {
+	return demosaicBand(mosaic, 0, mosaic.rows, region);
+}
+
+cv::Mat DemosaicInterface::luminance(const cv::Mat &mosaic, const cv::Rect &region) const {
+	return luminanceBand(mosaic, 0, mosaic.rows, region);
+}
+
+cv::Mat DemosaicInterface::luminanceBand(const cv::Mat &band, int firstRow, int height, const cv::Rect &region) const {
+	const cv::Mat rgb(demosaicBand(band, firstRow, height, region));
+	cv::Mat result;
+	FrameBufferPool::getDefault().create(result, region.height, region.width, CV_8UC1);
+	tbb::parallel_for(0, region.height, [&](int y) {
+		rgbToLuminance(rgb.ptr<std::uint16_t>(y), result.ptr<std::uint8_t>(y), region.width);
+	});
+	return result;
+}
+
+int BilinearDemosaic::getApron() const {
+	return 1;
+}
+
+cv::Mat BilinearDemosaic::demosaicBand(const cv::Mat &band, int firstRow, int height, const cv::Rect &region) const {
+	assert(region.x >= 0 && region.y >= 0 && region.x + region.width <= band.cols && region.y + region.height <= height);
+
+	const std::size_t width = band.cols;
+	cv::Mat result;
+	FrameBufferPool::getDefault().create(result, region.height, region.width, CV_16UC3);
+
+	// the border rows are copies of their neighbours, so the source rows are clamped
+	auto sourceRow = [height](int y) {
+		return std::min(std::max(y, 1), height - 2);
+	};
+
+	const std::size_t bandRows = getBandRows(region.width * 3 * sizeof(std::uint16_t));
+	tbb::parallel_for(tbb::blocked_range<int>(0, region.height, bandRows), [&](const tbb::blocked_range<int> &rows) {
+		for (int y = rows.begin(); y < rows.end(); ++y) {
+			const int source = sourceRow(region.y + y);
+			demosaicRow(band.ptr<std::uint16_t>(source - 1 - firstRow), band.ptr<std::uint16_t>(source - firstRow),
+			            band.ptr<std::uint16_t>(source + 1 - firstRow), result.ptr<std::uint16_t>(y), width, (source & 1) != 0,
+			            region.x, region.x + region.width);
+		}
+	}, tbb::simple_partitioner());
+
+	return result;
+}
+
+cv::Mat BilinearDemosaic::luminanceBand(const cv::Mat &band, int firstRow, int height, const cv::Rect &region) const {
+	assert(region.x >= 0 && region.y >= 0 && region.x + region.width <= band.cols && region.y + region.height <= height);
+
+	const std::size_t width = band.cols;
+	cv::Mat result;
+	FrameBufferPool::getDefault().create(result, region.height, region.width, CV_8UC1);
+
+	auto sourceRow = [height](int y) {
+		return std::min(std::max(y, 1), height - 2);
+	};
+
+	// each row is demosaiced into a small buffer that stays in L1 cache
+	// and converted to luminance immediately
+	const std::size_t bandRows = getBandRows(region.width * (3 * sizeof(std::uint16_t) + 1));
+	tbb::parallel_for(tbb::blocked_range<int>(0, region.height, bandRows), [&](const tbb::blocked_range<int> &rows) {
+		std::vector<std::uint16_t> rgb(3 * region.width);
+		for (int y = rows.begin(); y < rows.end(); ++y) {
+			const int source = sourceRow(region.y + y);
+			demosaicRow(band.ptr<std::uint16_t>(source - 1 - firstRow), band.ptr<std::uint16_t>(source - firstRow),
+			            band.ptr<std::uint16_t>(source + 1 - firstRow), rgb.data(), width, (source & 1) != 0,
+			            region.x, region.x + region.width);
+			rgbToLuminance(rgb.data(), result.ptr<std::uint8_t>(y), region.width);
+		}
+	}, tbb::simple_partitioner());
+
+	return result;
+}
+
+}
+}
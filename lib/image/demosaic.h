@@ -0,0 +1,131 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LYLI_IMAGE_DEMOSAIC_H_
+#define LYLI_IMAGE_DEMOSAIC_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <opencv2/core/core.hpp>
+
+namespace Lyli {
+namespace Image {
+
+/**
+ * Interface for the conversion of the bayer mosaic to RGB.
+ *
+ * The mosaic has blue/green even lines and green/red odd lines.
+ */
+class DemosaicInterface {
+public:
+	/**
+	 * A default constructor.
+	 */
+	DemosaicInterface() = default;
+	/**
+	 * A destructor.
+	 */
+	virtual ~DemosaicInterface() = default;
+
+	/**
+	 * Demosaic a part of the mosaic.
+	 *
+	 * The pixels outside of the region are used for the interpolation, so
+	 * the result does not depend on the region selection.
+	 *
+	 * \param mosaic the whole single channel uint16_t mosaic
+	 * \param region the region to demosaic, must lie inside the mosaic
+	 * \return RGB uint16_t pixels of the region
+	 */
+	cv::Mat demosaic(const cv::Mat &mosaic, const cv::Rect &region) const;
+
+	/**
+	 * Get 8-bit luminance of a part of the mosaic.
+	 *
+	 * \param mosaic the whole single channel uint16_t mosaic
+	 * \param region the region to convert, must lie inside the mosaic
+	 * \return uint8_t pixels of the region
+	 */
+	cv::Mat luminance(const cv::Mat &mosaic, const cv::Rect &region) const;
+
+	/**
+	 * Get the number of rows needed above and below the demosaiced rows.
+	 */
+	virtual int getApron() const = 0;
+
+	/**
+	 * Demosaic a part of a band of the mosaic rows.
+	 *
+	 * The result is the same as if the whole mosaic was available.
+	 *
+	 * \param band rows of the mosaic starting at the row firstRow, it has to contain getApron()
+	 *             rows above and below the region, unless they are outside of the mosaic
+	 * \param firstRow index of the first row of the band in the mosaic
+	 * \param height height of the whole mosaic
+	 * \param region the region to demosaic in the mosaic coordinates
+	 * \return RGB uint16_t pixels of the region
+	 */
+	virtual cv::Mat demosaicBand(const cv::Mat &band, int firstRow, int height, const cv::Rect &region) const = 0;
+
+	/**
+	 * Get 8-bit luminance of a part of a band of the mosaic rows.
+	 *
+	 * The default implementation demosaics the region and converts it using rgbToLuminance().
+	 *
+	 * \param band rows of the mosaic, see demosaicBand()
+	 * \param firstRow index of the first row of the band in the mosaic
+	 * \param height height of the whole mosaic
+	 * \param region the region to convert in the mosaic coordinates
+	 * \return uint8_t pixels of the region
+	 */
+	virtual cv::Mat luminanceBand(const cv::Mat &band, int firstRow, int height, const cv::Rect &region) const;
+
+	// avoid copying
+	DemosaicInterface(const DemosaicInterface&) = delete;
+	DemosaicInterface& operator=(const DemosaicInterface&) = delete;
+};
+
+/**
+ * Bilinear interpolation of the mosaic.
+ *
+ * The border rows and columns are copies of their neighbours.
+ */
+class BilinearDemosaic : public DemosaicInterface {
+public:
+	// DemosaicInterface
+	int getApron() const override;
+	cv::Mat demosaicBand(const cv::Mat &band, int firstRow, int height, const cv::Rect &region) const override;
+	cv::Mat luminanceBand(const cv::Mat &band, int firstRow, int height, const cv::Rect &region) const override;
+};
+
+/**
+ * Convert RGB pixels to 8-bit luminance.
+ *
+ * Uses the same fixed point coefficients and rounding as OpenCV uses for
+ * conversion of 16-bit RGB to gray followed by scaling to 8 bits.
+ *
+ * \param rgb input uint16_t RGB pixels
+ * \param out output pixels
+ * \param count number of pixels
+ */
+void rgbToLuminance(const std::uint16_t *rgb, std::uint8_t *out, std::size_t count);
+
+}
+}
+
+#endif
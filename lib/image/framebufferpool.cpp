@@ -0,0 +1,341 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "framebufferpool.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <deque>
+#include <iterator>
+#include <mutex>
+#include <new>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <opencv2/core/core.hpp>
+
+#include <tbb/enumerable_thread_specific.h>
+
+namespace {
+
+/** Granularity of the buffers backed by huge pages. */
+constexpr std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+/** A free buffer at most this many times larger than the request is used for it. */
+constexpr std::size_t MAX_SLACK = 2;
+
+/**
+ * A free buffer.
+ */
+struct Block {
+	void *data;
+	std::size_t size;
+};
+
+/**
+ * A list of free buffers.
+ */
+struct FreeList {
+	// the most recently released buffers are at the back
+	std::deque<Block> blocks;
+	// total size of the buffers
+	std::size_t bytes = 0;
+};
+
+std::size_t roundUp(std::size_t size, std::size_t granularity) {
+	return (size + granularity - 1) / granularity * granularity;
+}
+
+#if OPENCV_VERSION >= 3
+
+/**
+ * Allocator of cv::Mat data that uses the pool, it works the same way as the
+ * standard OpenCV allocator.
+ */
+class PoolAllocator : public cv::MatAllocator {
+public:
+#if OPENCV_VERSION >= 4
+	using AccessFlag = cv::AccessFlag;
+#else
+	using AccessFlag = int;
+#endif
+
+	explicit PoolAllocator(Lyli::Image::FrameBufferPool &pool) : m_pool(pool) {
+
+	}
+
+	cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step,
+	                       AccessFlag /*flags*/, cv::UMatUsageFlags /*usageFlags*/) const override {
+		std::size_t total = CV_ELEM_SIZE(type);
+		for (int i = dims - 1; i >= 0; --i) {
+			if (step != nullptr) {
+				if (data != nullptr && step[i] != CV_AUTOSTEP) {
+					total = step[i];
+				}
+				else {
+					step[i] = total;
+				}
+			}
+			total *= sizes[i];
+		}
+
+		cv::UMatData* u = new cv::UMatData(this);
+		u->data = u->origdata = static_cast<uchar*>(data != nullptr ? data : m_pool.acquire(total));
+		u->size = total;
+		if (data != nullptr) {
+			u->flags |= cv::UMatData::USER_ALLOCATED;
+		}
+		return u;
+	}
+
+	bool allocate(cv::UMatData* u, AccessFlag /*accessFlags*/, cv::UMatUsageFlags /*usageFlags*/) const override {
+		return u != nullptr;
+	}
+
+	void deallocate(cv::UMatData* u) const override {
+		if (u == nullptr) {
+			return;
+		}
+		CV_Assert(u->urefcount == 0);
+		CV_Assert(u->refcount == 0);
+		if ((u->flags & cv::UMatData::USER_ALLOCATED) == 0) {
+			m_pool.release(u->origdata, u->size);
+			u->origdata = nullptr;
+		}
+		delete u;
+	}
+
+private:
+	Lyli::Image::FrameBufferPool &m_pool;
+};
+
+#else
+
+/**
+ * Allocator of cv::Mat data that uses the pool, it works the same way as the
+ * standard OpenCV allocator.
+ */
+class PoolAllocator : public cv::MatAllocator {
+public:
+	explicit PoolAllocator(Lyli::Image::FrameBufferPool &pool) : m_pool(pool) {
+
+	}
+
+	void allocate(int dims, const int* sizes, int type, int*& refcount,
+	              uchar*& datastart, uchar*& data, size_t* step) override {
+		std::size_t total = CV_ELEM_SIZE(type);
+		for (int i = dims - 1; i >= 0; --i) {
+			step[i] = total;
+			total *= sizes[i];
+		}
+
+		// the reference counter is stored after the data
+		const std::size_t counterOffset = cv::alignSize(total, sizeof(int));
+		uchar *buffer = static_cast<uchar*>(m_pool.acquire(counterOffset + sizeof(int)));
+		refcount = reinterpret_cast<int*>(buffer + counterOffset);
+		*refcount = 1;
+		datastart = data = buffer;
+	}
+
+	void deallocate(int* refcount, uchar* datastart, uchar* /*data*/) override {
+		m_pool.release(datastart, reinterpret_cast<uchar*>(refcount) - datastart + sizeof(int));
+	}
+
+private:
+	Lyli::Image::FrameBufferPool &m_pool;
+};
+
+#endif
+
+}
+
+namespace Lyli {
+namespace Image {
+
+class FrameBufferPool::Impl {
+public:
+	Impl(FrameBufferPool &pool, std::size_t bytesPerThread_, bool hugePages_) :
+		bytesPerThread(bytesPerThread_), hugePages(hugePages_), hits(0), misses(0), allocator(pool) {
+
+	}
+
+	std::size_t bytesPerThread;
+	bool hugePages;
+	tbb::enumerable_thread_specific<FreeList> freeBlocks;
+	// the buffers that do not fit into the lists of the threads
+	std::mutex sharedMutex;
+	FreeList sharedBlocks;
+	std::atomic<std::uint64_t> hits;
+	std::atomic<std::uint64_t> misses;
+	PoolAllocator allocator;
+
+	std::size_t getBlockSize(std::size_t size) const {
+		static const std::size_t pageSize = sysconf(_SC_PAGESIZE);
+		return roundUp(size, hugePages ? HUGE_PAGE_SIZE : pageSize);
+	}
+
+	void *mapBlock(std::size_t size) {
+		void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (data == MAP_FAILED) {
+			throw std::bad_alloc();
+		}
+#ifdef MADV_HUGEPAGE
+		// the advice is just a hint, so the errors are ignored
+		if (hugePages) {
+			madvise(data, size, MADV_HUGEPAGE);
+		}
+#endif
+		return data;
+	}
+
+	void unmapBlock(const Block &block) {
+		munmap(block.data, block.size);
+	}
+
+	/** Take the smallest block from the list that can hold the given size, returns nullptr if there is none.
+	 *
+	 * The part of the block beyond the requested size is unmapped.
+	 */
+	void *takeBlock(FreeList &list, std::size_t blockSize) {
+		auto found = list.blocks.rend();
+		for (auto it = list.blocks.rbegin(); it != list.blocks.rend(); ++it) {
+			if (it->size >= blockSize && it->size <= MAX_SLACK * blockSize
+			    && (found == list.blocks.rend() || it->size < found->size)) {
+				found = it;
+				if (found->size == blockSize) {
+					break;
+				}
+			}
+		}
+		if (found == list.blocks.rend()) {
+			return nullptr;
+		}
+		const Block block = *found;
+		list.blocks.erase(std::next(found).base());
+		list.bytes -= block.size;
+		if (block.size > blockSize) {
+			unmapBlock(Block{static_cast<char*>(block.data) + blockSize, block.size - blockSize});
+		}
+		return block.data;
+	}
+};
+
+FrameBufferPool::FrameBufferPool(std::size_t bytesPerThread, bool hugePages) :
+	pimpl(new Impl(*this, bytesPerThread, hugePages)) {
+
+}
+
+FrameBufferPool::~FrameBufferPool() {
+	clear();
+}
+
+FrameBufferPool &FrameBufferPool::getDefault() {
+	static FrameBufferPool *pool = new FrameBufferPool();
+	return *pool;
+}
+
+void FrameBufferPool::create(cv::Mat &mat, int rows, int cols, int type) {
+	mat.allocator = getAllocator();
+	mat.create(rows, cols, type);
+}
+
+cv::MatAllocator *FrameBufferPool::getAllocator() {
+	return &pimpl->allocator;
+}
+
+void *FrameBufferPool::acquire(std::size_t size) {
+	if (size < MIN_POOLED_SIZE) {
+		void *data = std::malloc(size);
+		if (data == nullptr) {
+			throw std::bad_alloc();
+		}
+		return data;
+	}
+
+	const std::size_t blockSize = pimpl->getBlockSize(size);
+	void *data = pimpl->takeBlock(pimpl->freeBlocks.local(), blockSize);
+	if (data == nullptr) {
+		std::lock_guard<std::mutex> lock(pimpl->sharedMutex);
+		data = pimpl->takeBlock(pimpl->sharedBlocks, blockSize);
+	}
+	if (data != nullptr) {
+		++pimpl->hits;
+		return data;
+	}
+
+	++pimpl->misses;
+	return pimpl->mapBlock(blockSize);
+}
+
+void FrameBufferPool::release(void *data, std::size_t size) {
+	if (size < MIN_POOLED_SIZE) {
+		std::free(data);
+		return;
+	}
+
+	FreeList &list = pimpl->freeBlocks.local();
+	const Block block{data, pimpl->getBlockSize(size)};
+	list.blocks.push_back(block);
+	list.bytes += block.size;
+	if (list.bytes <= pimpl->bytesPerThread) {
+		return;
+	}
+
+	// move the least recently used buffers to the shared list, drop them if that is full too
+	std::lock_guard<std::mutex> lock(pimpl->sharedMutex);
+	FreeList &shared = pimpl->sharedBlocks;
+	while (list.bytes > pimpl->bytesPerThread) {
+		const Block oldest = list.blocks.front();
+		list.blocks.pop_front();
+		list.bytes -= oldest.size;
+		shared.blocks.push_back(oldest);
+		shared.bytes += oldest.size;
+	}
+	while (shared.bytes > pimpl->bytesPerThread) {
+		const Block oldest = shared.blocks.front();
+		shared.blocks.pop_front();
+		shared.bytes -= oldest.size;
+		pimpl->unmapBlock(oldest);
+	}
+}
+
+void FrameBufferPool::clear() {
+	for (FreeList &list : pimpl->freeBlocks) {
+		for (const Block &block : list.blocks) {
+			pimpl->unmapBlock(block);
+		}
+		list.blocks.clear();
+		list.bytes = 0;
+	}
+	for (const Block &block : pimpl->sharedBlocks.blocks) {
+		pimpl->unmapBlock(block);
+	}
+	pimpl->sharedBlocks.blocks.clear();
+	pimpl->sharedBlocks.bytes = 0;
+}
+
+std::uint64_t FrameBufferPool::getHits() const {
+	return pimpl->hits;
+}
+
+std::uint64_t FrameBufferPool::getMisses() const {
+	return pimpl->misses;
+}
+
+}
+}
@@ -0,0 +1,126 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LYLI_IMAGE_FRAMEBUFFERPOOL_H_
+#define LYLI_IMAGE_FRAMEBUFFERPOOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace cv {
+class Mat;
+class MatAllocator;
+}
+
+namespace Lyli {
+namespace Image {
+
+/** A pool of large buffers for the image data.
+ *
+ * Processing of every image needs several large images and temporaries. When they
+ * are allocated by the system allocator, the memory is mapped and unmapped for
+ * every image, causing a lot of page faults. The pool keeps the released buffers
+ * for reuse instead.
+ *
+ * The pool is used through a cv::MatAllocator, so the buffers are returned to the pool
+ * once the last cv::Mat referring to them is released. Every thread keeps its own list
+ * of free buffers, a buffer is returned to the list of the thread that releases it.
+ * When the buffers in the list exceed the size limit, the oldest ones are moved to a list
+ * shared by all threads, so that the buffers allocated by one thread and released
+ * by another are reused too. A request may be satisfied by a free buffer up to twice
+ * as large, the unused end of the buffer is returned to the system.
+ * Small buffers are not pooled.
+ */
+class FrameBufferPool {
+public:
+	/** Buffers smaller than this size in bytes are not pooled. */
+	static constexpr std::size_t MIN_POOLED_SIZE = 1024 * 1024;
+
+	/** Default limit of the free buffers kept by a thread in bytes. */
+	static constexpr std::size_t DEFAULT_BYTES_PER_THREAD = 512 * 1024 * 1024;
+
+	/** Construct the pool.
+	 *
+	 * \param bytesPerThread maximal size of the free buffers kept by a thread and in the shared list
+	 * \param hugePages back the buffers by transparent huge pages when the system supports it
+	 */
+	explicit FrameBufferPool(std::size_t bytesPerThread = DEFAULT_BYTES_PER_THREAD, bool hugePages = true);
+	~FrameBufferPool();
+
+	/** Get the pool used by the library.
+	 *
+	 * The pool is never destroyed, so that the images released during the program
+	 * termination can still return their buffers.
+	 */
+	static FrameBufferPool &getDefault();
+
+	/** Allocate an image from the pool.
+	 *
+	 * The allocator of the image is set to the pool allocator, so the image keeps
+	 * using the pool when it is reallocated by OpenCV functions.
+	 *
+	 * \param mat the image to allocate
+	 */
+	void create(cv::Mat &mat, int rows, int cols, int type);
+
+	/** Get the allocator that can be used to allocate cv::Mat from the pool.
+	 */
+	cv::MatAllocator *getAllocator();
+
+	/** Get a buffer.
+	 *
+	 * \param size size of the buffer in bytes
+	 * \return the buffer, it has to be released by release() with the same size
+	 * \throw std::bad_alloc when the memory cannot be allocated
+	 */
+	void *acquire(std::size_t size);
+
+	/** Return a buffer to the pool.
+	 *
+	 * \param data the buffer obtained by acquire()
+	 * \param size the size used in acquire()
+	 */
+	void release(void *data, std::size_t size);
+
+	/** Free all buffers kept in the pool.
+	 *
+	 * Must not be called while the pool is used by other threads.
+	 */
+	void clear();
+
+	/** Get number of requests satisfied by a pooled buffer.
+	 */
+	std::uint64_t getHits() const;
+
+	/** Get number of requests that needed a new buffer.
+	 */
+	std::uint64_t getMisses() const;
+
+	// avoid copying
+	FrameBufferPool(const FrameBufferPool&) = delete;
+	FrameBufferPool& operator=(const FrameBufferPool&) = delete;
+
+private:
+	class Impl;
+	std::unique_ptr<Impl> pimpl;
+};
+
+}
+}
+
+#endif
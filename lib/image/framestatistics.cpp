@@ -0,0 +1,109 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "framestatistics.h"
+
+#include <algorithm>
+#include <numeric>
+
+namespace Lyli {
+namespace Image {
+
+FrameStatistics::FrameStatistics() {
+	std::fill(&m_histogram[0][0], &m_histogram[0][0] + CHANNELS * BINS, 0);
+	std::fill(m_sum, m_sum + CHANNELS, 0);
+	std::fill(m_clippedBlack, m_clippedBlack + CHANNELS, 0);
+	std::fill(m_clippedWhite, m_clippedWhite + CHANNELS, 0);
+}
+
+void FrameStatistics::addRow(const std::uint16_t *row, std::size_t count, const int channel[2],
+                             const std::uint16_t black[2], const std::uint16_t white[2]) {
+	// the pixels of the even and the odd columns belong to different channels,
+	// so the histogram updates of a pair are independent
+	std::uint64_t *histogram[2] = {m_histogram[channel[0]], m_histogram[channel[1]]};
+	std::uint32_t clippedBlack[2] = {0, 0};
+	std::uint32_t clippedWhite[2] = {0, 0};
+	std::uint64_t sum[2] = {0, 0};
+	std::size_t x = 0;
+	for (; x + 1 < count; x += 2) {
+		const std::uint16_t even = row[x];
+		const std::uint16_t odd = row[x + 1];
+		++histogram[0][even >> 8];
+		++histogram[1][odd >> 8];
+		sum[0] += even;
+		sum[1] += odd;
+		clippedBlack[0] += even <= black[0];
+		clippedBlack[1] += odd <= black[1];
+		clippedWhite[0] += even >= white[0];
+		clippedWhite[1] += odd >= white[1];
+	}
+	if (x < count) {
+		++histogram[0][row[x] >> 8];
+		sum[0] += row[x];
+		clippedBlack[0] += row[x] <= black[0];
+		clippedWhite[0] += row[x] >= white[0];
+	}
+	for (int column = 0; column < 2; ++column) {
+		m_sum[channel[column]] += sum[column];
+		m_clippedBlack[channel[column]] += clippedBlack[column];
+		m_clippedWhite[channel[column]] += clippedWhite[column];
+	}
+}
+
+void FrameStatistics::merge(const FrameStatistics &other) {
+	for (int channel = 0; channel < CHANNELS; ++channel) {
+		for (int bin = 0; bin < BINS; ++bin) {
+			m_histogram[channel][bin] += other.m_histogram[channel][bin];
+		}
+		m_sum[channel] += other.m_sum[channel];
+		m_clippedBlack[channel] += other.m_clippedBlack[channel];
+		m_clippedWhite[channel] += other.m_clippedWhite[channel];
+	}
+}
+
+bool FrameStatistics::empty() const {
+	for (int channel = 0; channel < CHANNELS; ++channel) {
+		if (getCount(channel) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+std::uint64_t FrameStatistics::getCount(int channel) const {
+	return std::accumulate(m_histogram[channel], m_histogram[channel] + BINS, std::uint64_t(0));
+}
+
+double FrameStatistics::getMean(int channel) const {
+	const std::uint64_t count = getCount(channel);
+	return count == 0 ? 0.0 : static_cast<double>(m_sum[channel]) / count;
+}
+
+std::uint64_t FrameStatistics::getClippedBlack(int channel) const {
+	return m_clippedBlack[channel];
+}
+
+std::uint64_t FrameStatistics::getClippedWhite(int channel) const {
+	return m_clippedWhite[channel];
+}
+
+const std::uint64_t *FrameStatistics::getHistogram(int channel) const {
+	return m_histogram[channel];
+}
+
+}
+}
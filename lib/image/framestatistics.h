@@ -0,0 +1,101 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LYLI_IMAGE_FRAMESTATISTICS_H_
+#define LYLI_IMAGE_FRAMESTATISTICS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Lyli {
+namespace Image {
+
+/** Statistics of the pixels of a bayer mosaic.
+ *
+ * The statistics are gathered for each channel of the bayer filter separately,
+ * the channels are ordered as R, Gr, Gb, B, the same as in the Normalization.
+ * The decoder gathers them while unpacking the pixels, so they are available
+ * without another pass over the image.
+ */
+class FrameStatistics {
+public:
+	/** Number of the channels of the bayer filter. */
+	static constexpr int CHANNELS = 4;
+	/** Number of the histogram bins, the bins are indexed by the 8 most significant bits of the pixels. */
+	static constexpr int BINS = 256;
+
+	/** Construct empty statistics.
+	 */
+	FrameStatistics();
+
+	/** Add a part of a row of the mosaic starting at an even column.
+	 *
+	 * The first entries of the arrays belong to the pixels in the even columns,
+	 * the second ones to the pixels in the odd columns.
+	 *
+	 * \param row uint16_t pixels of the row part
+	 * \param count number of the pixels
+	 * \param channel the channels of the pixels
+	 * \param black the pixels at or below the level are counted as clipped to black
+	 * \param white the pixels at or above the level are counted as clipped to white
+	 */
+	void addRow(const std::uint16_t *row, std::size_t count, const int channel[2],
+	            const std::uint16_t black[2], const std::uint16_t white[2]);
+
+	/** Add statistics gathered from another part of the image.
+	 */
+	void merge(const FrameStatistics &other);
+
+	/** Check whether any pixels were added.
+	 */
+	bool empty() const;
+
+	/** Get number of the pixels of a channel.
+	 */
+	std::uint64_t getCount(int channel) const;
+
+	/** Get the mean value of the pixels of a channel.
+	 *
+	 * \return the mean in the range of the uint16_t pixels, 0 if there are no pixels
+	 */
+	double getMean(int channel) const;
+
+	/** Get number of the pixels of a channel clipped to black.
+	 */
+	std::uint64_t getClippedBlack(int channel) const;
+
+	/** Get number of the pixels of a channel clipped to white.
+	 */
+	std::uint64_t getClippedWhite(int channel) const;
+
+	/** Get the histogram of a channel.
+	 *
+	 * \return BINS counts of the pixels
+	 */
+	const std::uint64_t *getHistogram(int channel) const;
+
+private:
+	std::uint64_t m_histogram[CHANNELS][BINS];
+	std::uint64_t m_sum[CHANNELS];
+	std::uint64_t m_clippedBlack[CHANNELS];
+	std::uint64_t m_clippedWhite[CHANNELS];
+};
+
+}
+}
+
+#endif
@@ -18,7 +18,9 @@
 
 #include "lightfieldimage.h"
 
+#include <algorithm>
 #include <cmath>
+#include <vector>
 
 #include <opencv2/core/core.hpp>
 #if OPENCV_VERSION < 3
@@ -30,7 +32,9 @@
 #include <calibration/calibrationdata.h>
 #include <calibration/linegrid.h>
 #include <calibration/subgrid.h>
+#include "banddecoder.h"
 #include "metadata.h"
+#include "parallel.h"
 #include "rawimage.h"
 
 namespace Lyli {
@@ -39,24 +43,71 @@ namespace Image {
 class LightfieldImage::Impl {
 public:
 	cv::Mat image;
+
+	/**
+	 * Compute the positions of the lens centers in the RAW image.
+	 *
+	 * The lenses are sampled from the image transformed according to the calibration data.
+	 * Instead of transforming the whole image, the sampled positions are transformed back
+	 * to the RAW image, where they are interpolated bilinearly.
+	 */
+	Impl(const Calibration::CalibrationData& calibrationData, int width, int height);
+
+	/**
+	 * Sample the lenses that use rows of the band.
+	 *
+	 * Can be called concurrently for distinct bands.
+	 */
+	void sampleBand(const cv::Mat& band, int firstRow);
+
+	/**
+	 * Store the sampled lenses in the image.
+	 *
+	 * The image is converted to the storage at once, as it is small
+	 * compared to the RAW image.
+	 */
+	void finish(PixelStorage storage);
+
+private:
+	/**
+	 * A lens sampled at a non-integer position in the RAW image.
+	 */
+	struct Sample {
+		cv::Point output;
+		int x0;
+		float dx;
+	};
+
+	/**
+	 * Contribution of a RAW image row to a sample.
+	 *
+	 * Each sample gets a contribution from two rows, that are stored in two slots.
+	 */
+	struct RowContribution {
+		int slot;
+		float weight;
+	};
+
+	int width;
+	std::vector<Sample> samples;
+	std::vector<std::vector<RowContribution>> rows;
+	std::vector<cv::Vec3f> contributions;
 };
 
-LightfieldImage::LightfieldImage(const Lyli::Image::RawImage& rawImage, const Lyli::Image::Metadata& metadata, const Calibration::CalibrationData& calibrationData) :
-	pimpl(new Impl) {
+LightfieldImage::Impl::Impl(const Calibration::CalibrationData& calibrationData, int width_, int height) :
+	width(width_), rows(height) {
 
-	// transform input according to the calibration data
-	cv::Mat tmp;
-	rawImage.getData().copyTo(tmp);
 	double angle = calibrationData.getArray().getRotation()*180.0/M_PI;
 	cv::Mat r = cv::getRotationMatrix2D(cv::Point2f(0, 0), angle, 1.0);
 	cv::Mat t = cv::Mat::eye(3 , 3, CV_64F);
 	t.at<double>(0, 2) = calibrationData.getArray().getTranslation()[0];
 	t.at<double>(1, 2) = calibrationData.getArray().getTranslation()[1];
 	cv::Mat T = r*t;
-	cv::warpAffine(tmp, tmp, T, tmp.size());
+	cv::Mat inverse;
+	cv::invertAffineTransform(T, inverse);
 
 	// reserve space
-	pimpl->image.create(calibrationData.getArray().getGrid().getHorizontalLines().size(), calibrationData.getArray().getGrid().getVerticalLines().size() / 2, CV_16UC3);
+	image = cv::Mat::zeros(calibrationData.getArray().getGrid().getHorizontalLines().size(), calibrationData.getArray().getGrid().getVerticalLines().size() / 2, CV_16UC3);
 
 	// store color from each intersection in subgrid A
 	const Calibration::LineGrid::LineList& horizontal(calibrationData.getArray().getGrid().getHorizontalLines());
@@ -64,10 +115,91 @@ LightfieldImage::LightfieldImage(const Lyli::Image::RawImage& rawImage, const Ly
 	for (std::size_t y = 0; y < vertical.size(); y++) {
 		for (std::size_t x = 0; x < horizontal.size(); x++) {
 			if (horizontal[x].subgrid == vertical[y].subgrid) {
-				pimpl->image.at<cv::Vec3w>(cv::Point(y/2, x)) = tmp.at<cv::Vec3w>(cv::Point(vertical[y].position, horizontal[x].position));
+				// position in the transformed image
+				const int px = vertical[y].position;
+				const int py = horizontal[x].position;
+				// position in the RAW image
+				const double sx = inverse.at<double>(0, 0) * px + inverse.at<double>(0, 1) * py + inverse.at<double>(0, 2);
+				const double sy = inverse.at<double>(1, 0) * px + inverse.at<double>(1, 1) * py + inverse.at<double>(1, 2);
+				const int x0 = std::floor(sx);
+				const int y0 = std::floor(sy);
+				const float dy = sy - y0;
+
+				const int sample = samples.size();
+				samples.push_back(Sample{cv::Point(y/2, x), x0, static_cast<float>(sx - x0)});
+				// the pixels outside of the image are black
+				if (y0 >= 0 && y0 < height) {
+					rows[y0].push_back(RowContribution{2 * sample, 1.0f - dy});
+				}
+				if (y0 + 1 >= 0 && y0 + 1 < height) {
+					rows[y0 + 1].push_back(RowContribution{2 * sample + 1, dy});
+				}
 			}
 		}
 	}
+	contributions.resize(2 * samples.size(), cv::Vec3f(0.0f, 0.0f, 0.0f));
+}
+
+void LightfieldImage::Impl::sampleBand(const cv::Mat& band, int firstRow) {
+	for (int y = 0; y < band.rows; ++y) {
+		const cv::Vec3w *row = band.ptr<cv::Vec3w>(y);
+		auto pixel = [row, this](int x) {
+			return x >= 0 && x < width ? cv::Vec3f(row[x][0], row[x][1], row[x][2]) : cv::Vec3f(0.0f, 0.0f, 0.0f);
+		};
+		// every slot is written by a single row only
+		for (const RowContribution &contribution : rows[firstRow + y]) {
+			const Sample &sample = samples[contribution.slot / 2];
+			const cv::Vec3f color = pixel(sample.x0) * (1.0f - sample.dx) + pixel(sample.x0 + 1) * sample.dx;
+			contributions[contribution.slot] = color * contribution.weight;
+		}
+	}
+}
+
+void LightfieldImage::Impl::finish(PixelStorage storage) {
+	for (std::size_t i = 0; i < samples.size(); ++i) {
+		const cv::Vec3f color = contributions[2 * i] + contributions[2 * i + 1];
+		image.at<cv::Vec3w>(samples[i].output) = cv::Vec3w(cv::saturate_cast<std::uint16_t>(color[0]),
+		                                                   cv::saturate_cast<std::uint16_t>(color[1]),
+		                                                   cv::saturate_cast<std::uint16_t>(color[2]));
+	}
+	if (storage != PixelStorage::UINT16) {
+		cv::Mat stored;
+		createStorage(stored, image.rows, image.cols, storage);
+		storeRows(image, stored, storage);
+		image = stored;
+	}
+	// release the sampling data
+	samples = std::vector<Sample>();
+	rows = std::vector<std::vector<RowContribution>>();
+	contributions = std::vector<cv::Vec3f>();
+}
+
+LightfieldImage::LightfieldImage(const Lyli::Image::RawImage& rawImage, const Lyli::Image::Metadata& metadata,
+                                 const Calibration::CalibrationData& calibrationData, PixelStorage storage) :
+	pimpl(new Impl(calibrationData, rawImage.getWidth(), rawImage.getHeight())) {
+
+	const cv::Mat &data = rawImage.getData();
+	if (rawImage.getStorage() == PixelStorage::UINT16) {
+		pimpl->sampleBand(data, 0);
+	}
+	else {
+		const int bandRows = getBandRows(rawImage.getWidth() * 3 * sizeof(std::uint16_t));
+		for (int first = 0; first < data.rows; first += bandRows) {
+			const cv::Mat stored(data.rowRange(first, std::min(first + bandRows, data.rows)));
+			pimpl->sampleBand(loadRows(stored, rawImage.getWidth(), rawImage.getStorage()), first);
+		}
+	}
+	pimpl->finish(storage);
+}
+
+LightfieldImage::LightfieldImage(const BandDecoder& decoder, const Metadata& metadata,
+                                 const Calibration::CalibrationData& calibrationData, PixelStorage storage) :
+	pimpl(new Impl(calibrationData, decoder.getWidth(), decoder.getHeight())) {
+
+	decoder.decode([this](const cv::Mat &band, int firstRow) {
+		pimpl->sampleBand(band, firstRow);
+	});
+	pimpl->finish(storage);
 }
 
 LightfieldImage::~LightfieldImage() {
@@ -21,6 +21,8 @@
 
 #include <memory>
 
+#include <image/pixelstorage.h>
+
 namespace cv {
 class Mat;
 }
@@ -33,12 +35,32 @@ class CalibrationData;
 
 namespace Image {
 
+class BandDecoder;
 class Metadata;
 class RawImage;
 
 class LightfieldImage {
 public:
-	LightfieldImage(const RawImage& rawImage, const Metadata& metadata, const Calibration::CalibrationData& calibrationData);
+	/**
+	 * Construct the image from a decoded RAW image.
+	 *
+	 * The RAW image may use any storage, its rows are converted back
+	 * to full precision by bands while sampling.
+	 *
+	 * \param storage precision of the pixels returned by getData()
+	 */
+	LightfieldImage(const RawImage& rawImage, const Metadata& metadata, const Calibration::CalibrationData& calibrationData,
+	                PixelStorage storage = PixelStorage::UINT16);
+	/**
+	 * Construct the image from an image decoded by bands.
+	 *
+	 * The lenses are sampled directly from the decoded bands, so the whole
+	 * RAW image is never stored.
+	 *
+	 * \param storage precision of the pixels returned by getData()
+	 */
+	LightfieldImage(const BandDecoder& decoder, const Metadata& metadata, const Calibration::CalibrationData& calibrationData,
+	                PixelStorage storage = PixelStorage::UINT16);
 	~LightfieldImage();
 
 	// DEBUG
@@ -0,0 +1,274 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "malvardemosaic.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/partitioner.h>
+
+#include "framebufferpool.h"
+#include "parallel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LYLI_DEMOSAIC_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+
+/**
+ * The filters need two pixels on each side.
+ */
+constexpr int APRON = 2;
+
+/*
+ * The filters are evaluated with integer coefficients scaled by 16. For a pixel C
+ * with the same color pixels at the distance 2 (h2, v2), the pixels at the distance 1
+ * in the row (h1) and in the column (v1) and the diagonal neighbours (d1), the
+ * missing colors are:
+ *   green at red/blue:            8C + 4(h1 + v1) - 2(h2 + v2)
+ *   color of the row at green:    10C + 8h1 - 2d1 - 2h2 + v2
+ *   color of the column at green: 10C + 8v1 - 2d1 - 2v2 + h2
+ *   red at blue, blue at red:     12C + 4d1 - 3(h2 + v2)
+ */
+
+/**
+ * Demosaic a single row.
+ *
+ * \param rows five rows of the mosaic centered at the demosaiced row, each of them
+ *             has to be accessible two pixels before the start and after the end
+ * \param out output RGB pixels
+ * \param count number of pixels to demosaic
+ * \param oddRow whether the demosaiced row has an odd index in the mosaic
+ * \param oddColumn whether the first pixel has an odd index in the mosaic
+ */
+using RowFunction = void (*)(const std::uint16_t *const *rows, std::uint16_t *out, std::size_t count, bool oddRow, bool oddColumn);
+
+inline std::uint16_t scalePixel(int value) {
+	return std::min(std::max((value + 8) >> 4, 0), 65535);
+}
+
+void demosaicRowScalar(const std::uint16_t *const *rows, std::uint16_t *out, std::size_t count, bool oddRow, bool oddColumn) {
+	const std::uint16_t *p2 = rows[0];
+	const std::uint16_t *p1 = rows[1];
+	const std::uint16_t *c = rows[2];
+	const std::uint16_t *n1 = rows[3];
+	const std::uint16_t *n2 = rows[4];
+
+	for (std::ptrdiff_t x = 0; x < static_cast<std::ptrdiff_t>(count); ++x) {
+		const int center = c[x];
+		const int h1 = c[x - 1] + c[x + 1];
+		const int h2 = c[x - 2] + c[x + 2];
+		const int v1 = p1[x] + n1[x];
+		const int v2 = p2[x] + n2[x];
+		const int d1 = p1[x - 1] + p1[x + 1] + n1[x - 1] + n1[x + 1];
+
+		std::uint16_t *pixel = out + 3 * x;
+		const bool oddX = ((x & 1) != 0) != oddColumn;
+		if (oddX == oddRow) {
+			// red pixels are in the odd rows and columns, blue pixels in the even ones
+			const std::uint16_t diagonal = scalePixel(12 * center + 4 * d1 - 3 * (h2 + v2));
+			pixel[0] = oddRow ? center : diagonal;
+			pixel[1] = scalePixel(8 * center + 4 * (h1 + v1) - 2 * (h2 + v2));
+			pixel[2] = oddRow ? diagonal : center;
+		}
+		else {
+			// green pixel, the rows with red pixels are odd
+			const std::uint16_t horizontal = scalePixel(10 * center + 8 * h1 - 2 * d1 - 2 * h2 + v2);
+			const std::uint16_t vertical = scalePixel(10 * center + 8 * v1 - 2 * d1 - 2 * v2 + h2);
+			pixel[0] = oddRow ? horizontal : vertical;
+			pixel[1] = center;
+			pixel[2] = oddRow ? vertical : horizontal;
+		}
+	}
+}
+
+#ifdef LYLI_DEMOSAIC_X86
+
+/*
+ * All filters are evaluated for eight pixels at once in 32-bit lanes and the
+ * results are selected by the position of the pixel in the bayer pattern.
+ * The final pack saturates the results to 16 bits.
+ */
+
+__attribute__((target("avx2")))
+inline __m256i load(const std::uint16_t *p) {
+	return _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+}
+
+__attribute__((target("avx2")))
+inline __m256i scale(__m256i v) {
+	return _mm256_srai_epi32(_mm256_add_epi32(v, _mm256_set1_epi32(8)), 4);
+}
+
+__attribute__((target("avx2")))
+void demosaicRowAvx2(const std::uint16_t *const *rows, std::uint16_t *out, std::size_t count, bool oddRow, bool oddColumn) {
+	const std::uint16_t *p2 = rows[0];
+	const std::uint16_t *p1 = rows[1];
+	const std::uint16_t *c = rows[2];
+	const std::uint16_t *n1 = rows[3];
+	const std::uint16_t *n2 = rows[4];
+
+	// lanes containing red or blue pixels
+	const bool evenSites = oddRow == oddColumn;
+	const __m256i siteMask = evenSites ? _mm256_setr_epi32(-1, 0, -1, 0, -1, 0, -1, 0)
+	                                   : _mm256_setr_epi32(0, -1, 0, -1, 0, -1, 0, -1);
+
+	std::size_t x = 0;
+	for (; x + 8 <= count; x += 8) {
+		const __m256i center = load(c + x);
+		const __m256i h1 = _mm256_add_epi32(load(c + x - 1), load(c + x + 1));
+		const __m256i h2 = _mm256_add_epi32(load(c + x - 2), load(c + x + 2));
+		const __m256i v1 = _mm256_add_epi32(load(p1 + x), load(n1 + x));
+		const __m256i v2 = _mm256_add_epi32(load(p2 + x), load(n2 + x));
+		const __m256i d1 = _mm256_add_epi32(_mm256_add_epi32(load(p1 + x - 1), load(p1 + x + 1)),
+		                                    _mm256_add_epi32(load(n1 + x - 1), load(n1 + x + 1)));
+		const __m256i center2 = _mm256_slli_epi32(center, 1);
+		const __m256i center8 = _mm256_slli_epi32(center, 3);
+		const __m256i d1x2 = _mm256_slli_epi32(d1, 1);
+		const __m256i axial2 = _mm256_add_epi32(h2, v2);
+
+		// 8C + 4(h1 + v1) - 2(h2 + v2)
+		const __m256i green = scale(_mm256_sub_epi32(_mm256_add_epi32(center8, _mm256_slli_epi32(_mm256_add_epi32(h1, v1), 2)),
+		                                             _mm256_slli_epi32(axial2, 1)));
+		// 10C + 8h1 - 2d1 - 2h2 + v2
+		const __m256i horizontal = scale(_mm256_add_epi32(
+			_mm256_sub_epi32(_mm256_add_epi32(_mm256_add_epi32(center8, center2), _mm256_slli_epi32(h1, 3)), d1x2),
+			_mm256_sub_epi32(v2, _mm256_slli_epi32(h2, 1))));
+		// 10C + 8v1 - 2d1 - 2v2 + h2
+		const __m256i vertical = scale(_mm256_add_epi32(
+			_mm256_sub_epi32(_mm256_add_epi32(_mm256_add_epi32(center8, center2), _mm256_slli_epi32(v1, 3)), d1x2),
+			_mm256_sub_epi32(h2, _mm256_slli_epi32(v2, 1))));
+		// 12C + 4d1 - 3(h2 + v2)
+		const __m256i diagonal = scale(_mm256_sub_epi32(
+			_mm256_add_epi32(_mm256_add_epi32(center8, _mm256_slli_epi32(center, 2)), _mm256_slli_epi32(d1, 2)),
+			_mm256_add_epi32(axial2, _mm256_slli_epi32(axial2, 1))));
+
+		const __m256i red = _mm256_blendv_epi8(oddRow ? horizontal : vertical, oddRow ? center : diagonal, siteMask);
+		const __m256i blue = _mm256_blendv_epi8(oddRow ? vertical : horizontal, oddRow ? diagonal : center, siteMask);
+		const __m256i greenOut = _mm256_blendv_epi8(center, green, siteMask);
+
+		// pack to 16 bits, the pack works within 128-bit lanes
+		alignas(16) std::uint16_t planar[3][8];
+		_mm_store_si128(reinterpret_cast<__m128i*>(planar[0]), _mm256_castsi256_si128(
+			_mm256_permute4x64_epi64(_mm256_packus_epi32(red, red), 0x08)));
+		_mm_store_si128(reinterpret_cast<__m128i*>(planar[1]), _mm256_castsi256_si128(
+			_mm256_permute4x64_epi64(_mm256_packus_epi32(greenOut, greenOut), 0x08)));
+		_mm_store_si128(reinterpret_cast<__m128i*>(planar[2]), _mm256_castsi256_si128(
+			_mm256_permute4x64_epi64(_mm256_packus_epi32(blue, blue), 0x08)));
+
+		std::uint16_t *pixel = out + 3 * x;
+		for (int i = 0; i < 8; ++i) {
+			pixel[3 * i] = planar[0][i];
+			pixel[3 * i + 1] = planar[1][i];
+			pixel[3 * i + 2] = planar[2][i];
+		}
+	}
+
+	// the remaining pixels, x is even, so the parity of the first pixel does not change
+	const std::uint16_t *remaining[5];
+	for (int i = 0; i < 5; ++i) {
+		remaining[i] = rows[i] + x;
+	}
+	demosaicRowScalar(remaining, out + 3 * x, count - x, oddRow, oddColumn);
+}
+
+#endif
+
+RowFunction selectDemosaicRow() {
+#ifdef LYLI_DEMOSAIC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return demosaicRowAvx2;
+	}
+#endif
+	return demosaicRowScalar;
+}
+
+/**
+ * Mirror the index at the borders without repeating the border pixel.
+ *
+ * The mirrored pixels have the same color as the original ones.
+ */
+inline int reflect(int i, int size) {
+	if (i < 0) {
+		return -i;
+	}
+	if (i >= size) {
+		return 2 * size - 2 - i;
+	}
+	return i;
+}
+
+}
+
+namespace Lyli {
+namespace Image {
+
+int MalvarDemosaic::getApron() const {
+	return APRON;
+}
+
+cv::Mat MalvarDemosaic::demosaicBand(const cv::Mat &band, int firstRow, int height, const cv::Rect &region) const {
+	assert(region.x >= 0 && region.y >= 0 && region.x + region.width <= band.cols && region.y + region.height <= height);
+	assert(band.cols >= 3 && height >= 3);
+
+	static const RowFunction demosaicRow = selectDemosaicRow();
+
+	const int paddedWidth = region.width + 2 * APRON;
+	cv::Mat result;
+	FrameBufferPool::getDefault().create(result, region.height, region.width, CV_16UC3);
+
+	const std::size_t bandRows = getBandRows(region.width * (3 + 1) * sizeof(std::uint16_t));
+	tbb::parallel_for(tbb::blocked_range<int>(0, region.height, bandRows), [&](const tbb::blocked_range<int> &rows) {
+		// copy the band including the apron, so that the rows can be processed without any border checks
+		const int paddedRows = rows.size() + 2 * APRON;
+		std::vector<std::uint16_t> padded(paddedRows * paddedWidth);
+		for (int y = 0; y < paddedRows; ++y) {
+			const std::uint16_t *source = band.ptr<std::uint16_t>(reflect(region.y + rows.begin() + y - APRON, height) - firstRow);
+			std::uint16_t *row = padded.data() + y * paddedWidth;
+			const int first = std::max(region.x - APRON, 0);
+			const int last = std::min(region.x + region.width + APRON, band.cols);
+			std::memcpy(row + first - (region.x - APRON), source + first, (last - first) * sizeof(std::uint16_t));
+			for (int x = region.x - APRON; x < first; ++x) {
+				row[x - (region.x - APRON)] = source[reflect(x, band.cols)];
+			}
+			for (int x = last; x < region.x + region.width + APRON; ++x) {
+				row[x - (region.x - APRON)] = source[reflect(x, band.cols)];
+			}
+		}
+
+		for (int y = rows.begin(); y < rows.end(); ++y) {
+			const std::uint16_t *window[5];
+			for (int i = 0; i < 5; ++i) {
+				window[i] = padded.data() + (y - rows.begin() + i) * paddedWidth + APRON;
+			}
+			demosaicRow(window, result.ptr<std::uint16_t>(y), region.width, ((region.y + y) & 1) != 0, (region.x & 1) != 0);
+		}
+	}, tbb::simple_partitioner());
+
+	return result;
+}
+
+}
+}
@@ -0,0 +1,47 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LYLI_IMAGE_MALVARDEMOSAIC_H_
+#define LYLI_IMAGE_MALVARDEMOSAIC_H_
+
+#include <image/demosaic.h>
+
+namespace Lyli {
+namespace Image {
+
+/**
+ * Gradient-corrected bilinear interpolation of the mosaic.
+ *
+ * Implements the 5x5 linear filters described in H. S. Malvar, L. He, R. Cutler:
+ * High-quality linear interpolation for demosaicing of Bayer-patterned color images.
+ * The bilinear estimate is corrected by the laplacian of the channel
+ * sampled at the pixel, which considerably reduces the color artifacts on edges.
+ *
+ * The mosaic is mirrored at the borders, so the border pixels are interpolated
+ * the same way as the rest of the image.
+ */
+class MalvarDemosaic : public DemosaicInterface {
+public:
+	// DemosaicInterface
+	int getApron() const override;
+	cv::Mat demosaicBand(const cv::Mat &band, int firstRow, int height, const cv::Rect &region) const override;
+};
+
+}
+}
+
+#endif
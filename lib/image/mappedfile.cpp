@@ -0,0 +1,117 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mappedfile.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+std::string errorMessage(const std::string &action, const std::string &path) {
+	std::stringstream ss;
+	ss << "cannot " << action << " " << path << ": " << std::strerror(errno);
+	return ss.str();
+}
+
+}
+
+namespace Lyli {
+namespace Image {
+
+FileAccessException::FileAccessException(const std::string& reason) : m_reason(reason) {
+
+}
+
+FileAccessException::~FileAccessException() {
+
+}
+
+const char* FileAccessException::what() const noexcept {
+	return m_reason.c_str();
+}
+
+MappedFile::MappedFile(const std::string &path) : m_data(nullptr), m_size(0) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw FileAccessException(errorMessage("open", path));
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		std::string reason(errorMessage("stat", path));
+		close(fd);
+		throw FileAccessException(reason);
+	}
+	m_size = st.st_size;
+
+	// mapping an empty file is not allowed
+	if (m_size > 0) {
+		void *data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			std::string reason(errorMessage("map", path));
+			close(fd);
+			throw FileAccessException(reason);
+		}
+		m_data = static_cast<std::uint8_t*>(data);
+
+		// the whole file is going to be read from the beginning to the end
+		// the advice is just a hint, so the errors are ignored
+		madvise(m_data, m_size, MADV_SEQUENTIAL);
+		madvise(m_data, m_size, MADV_WILLNEED);
+	}
+
+	// the mapping stays valid after the descriptor is closed
+	close(fd);
+}
+
+MappedFile::~MappedFile() {
+	if (m_data != nullptr) {
+		munmap(m_data, m_size);
+	}
+}
+
+MappedFile::MappedFile(MappedFile &&other) noexcept : m_data(other.m_data), m_size(other.m_size) {
+	other.m_data = nullptr;
+	other.m_size = 0;
+}
+
+MappedFile& MappedFile::operator=(MappedFile &&other) noexcept {
+	if (this != &other) {
+		std::swap(m_data, other.m_data);
+		std::swap(m_size, other.m_size);
+	}
+	return *this;
+}
+
+const std::uint8_t *MappedFile::getData() const {
+	return m_data;
+}
+
+std::size_t MappedFile::getSize() const {
+	return m_size;
+}
+
+}
+}
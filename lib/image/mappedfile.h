@@ -0,0 +1,83 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LYLI_IMAGE_MAPPEDFILE_H_
+#define LYLI_IMAGE_MAPPEDFILE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <image/exception.h>
+
+namespace Lyli {
+namespace Image {
+
+class FileAccessException : public Exception {
+public:
+	explicit FileAccessException(const std::string& reason);
+	virtual ~FileAccessException();
+
+	virtual const char* what() const noexcept;
+
+private:
+	std::string m_reason;
+};
+
+/** A read-only memory mapping of a whole file.
+ *
+ * The kernel is advised that the file is going to be read sequentially
+ * and in its entirety, so that it can start reading ahead immediately.
+ */
+class MappedFile {
+public:
+	/** Map the file.
+	 *
+	 * \param path path to the file
+	 * \throw FileAccessException when the file cannot be opened or mapped
+	 */
+	explicit MappedFile(const std::string &path);
+	~MappedFile();
+
+	MappedFile(MappedFile &&other) noexcept;
+	MappedFile& operator=(MappedFile &&other) noexcept;
+
+	/** Get the mapped data.
+	 *
+	 * \return pointer to the beginning of the file
+	 */
+	const std::uint8_t *getData() const;
+
+	/** Get the file size.
+	 *
+	 * \return size of the mapped data in bytes
+	 */
+	std::size_t getSize() const;
+
+	// avoid copying
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+private:
+	std::uint8_t *m_data;
+	std::size_t m_size;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,44 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LYLI_IMAGE_PARALLEL_H_
+#define LYLI_IMAGE_PARALLEL_H_
+
+#include <algorithm>
+#include <cstddef>
+
+namespace Lyli {
+namespace Image {
+
+/**
+ * Size of the output that is processed at once by a single task.
+ *
+ * The band of the output together with the corresponding input should fit in L2 cache.
+ */
+constexpr std::size_t BAND_SIZE = 256 * 1024;
+
+/**
+ * Get number of rows in a band for rows of the given size in bytes.
+ */
+inline std::size_t getBandRows(std::size_t rowSize) {
+	return std::max<std::size_t>(2, BAND_SIZE / rowSize);
+}
+
+}
+}
+
+#endif
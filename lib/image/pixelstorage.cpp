@@ -0,0 +1,256 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pixelstorage.h"
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "framebufferpool.h"
+#include "rawformat.h"
+#include "unpack.h"
+
+namespace {
+
+constexpr double GAMMA = 1.0 / 2.2;
+
+/**
+ * Convert a float to the bits of the nearest half float.
+ */
+std::uint16_t floatToHalf(float value) {
+	std::uint32_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+	const std::uint16_t sign = (bits >> 16) & 0x8000;
+	bits &= 0x7fffffff;
+	if (bits >= 0x47800000) {
+		// too large, infinity or NaN
+		return sign | (bits > 0x7f800000 ? 0x7e00 : 0x7c00);
+	}
+	if (bits < 0x38800000) {
+		// subnormal, the multiple of the smallest subnormal is rounded to nearest even
+		float magnitude;
+		std::memcpy(&magnitude, &bits, sizeof(magnitude));
+		return sign | static_cast<std::uint16_t>(std::nearbyint(magnitude * 16777216.0f));
+	}
+	// rebias the exponent and round the mantissa to nearest even
+	bits += 0xc8000fff + ((bits >> 13) & 1);
+	return sign | (bits >> 13);
+}
+
+/**
+ * Convert the bits of a half float to a float.
+ */
+float halfToFloat(std::uint16_t half) {
+	const int exponent = (half >> 10) & 0x1f;
+	const int mantissa = half & 0x3ff;
+	float value;
+	if (exponent == 0) {
+		value = std::ldexp(static_cast<float>(mantissa), -24);
+	}
+	else if (exponent == 31) {
+		value = mantissa == 0 ? INFINITY : NAN;
+	}
+	else {
+		value = std::ldexp(static_cast<float>(mantissa | 0x400), exponent - 25);
+	}
+	return (half & 0x8000) ? -value : value;
+}
+
+/**
+ * A table converting the uint16_t channels to the half floats in the range 0-1.
+ */
+const std::vector<std::uint16_t> &getToHalf() {
+	static const std::vector<std::uint16_t> table = [] {
+		std::vector<std::uint16_t> result(65536);
+		for (std::size_t i = 0; i < result.size(); ++i) {
+			result[i] = floatToHalf(i / 65535.0f);
+		}
+		return result;
+	}();
+	return table;
+}
+
+/**
+ * A table converting the half floats back to uint16_t channels.
+ */
+const std::vector<std::uint16_t> &getFromHalf() {
+	static const std::vector<std::uint16_t> table = [] {
+		std::vector<std::uint16_t> result(65536);
+		for (std::size_t i = 0; i < result.size(); ++i) {
+			const float value = halfToFloat(i);
+			// NaN is stored as zero
+			result[i] = value > 0.0f ? cv::saturate_cast<std::uint16_t>(value * 65535.0f) : 0;
+		}
+		return result;
+	}();
+	return table;
+}
+
+/**
+ * A table converting the uint16_t channels to the gamma encoded uint8_t channels.
+ */
+const std::vector<std::uint8_t> &getToGamma() {
+	static const std::vector<std::uint8_t> table = [] {
+		std::vector<std::uint8_t> result(65536);
+		for (std::size_t i = 0; i < result.size(); ++i) {
+			result[i] = cv::saturate_cast<std::uint8_t>(std::pow(i / 65535.0, GAMMA) * 255.0);
+		}
+		return result;
+	}();
+	return table;
+}
+
+/**
+ * A table converting the gamma encoded uint8_t channels back to uint16_t channels.
+ */
+const std::vector<std::uint16_t> &getFromGamma() {
+	static const std::vector<std::uint16_t> table = [] {
+		std::vector<std::uint16_t> result(256);
+		for (std::size_t i = 0; i < result.size(); ++i) {
+			result[i] = cv::saturate_cast<std::uint16_t>(std::pow(i / 255.0, 1.0 / GAMMA) * 65535.0);
+		}
+		return result;
+	}();
+	return table;
+}
+
+int getStorageType(Lyli::Image::PixelStorage storage) {
+	switch (storage) {
+		case Lyli::Image::PixelStorage::PACKED12:
+			return CV_8UC1;
+		case Lyli::Image::PixelStorage::GAMMA8:
+			return CV_8UC3;
+		case Lyli::Image::PixelStorage::HALF:
+#if OPENCV_VERSION >= 4
+			return CV_16FC3;
+#else
+			return CV_16UC3;
+#endif
+		default:
+			return CV_16UC3;
+	}
+}
+
+}
+
+namespace Lyli {
+namespace Image {
+
+std::size_t getStoredRowBytes(PixelStorage storage, std::size_t width) {
+	switch (storage) {
+		case PixelStorage::PACKED12:
+			// the channels are packed in pairs, the odd channel is padded
+			return (3 * width + 1) / 2 * 3;
+		case PixelStorage::GAMMA8:
+			return 3 * width;
+		default:
+			return 3 * width * sizeof(std::uint16_t);
+	}
+}
+
+void createStorage(cv::Mat &image, int rows, int width, PixelStorage storage) {
+	const int cols = storage == PixelStorage::PACKED12 ? getStoredRowBytes(storage, width) : width;
+	FrameBufferPool::getDefault().create(image, rows, cols, getStorageType(storage));
+}
+
+void storeRow(const std::uint16_t *rgb, std::uint8_t *stored, std::size_t width, PixelStorage storage) {
+	const std::size_t count = 3 * width;
+	switch (storage) {
+		case PixelStorage::UINT16:
+			std::memcpy(stored, rgb, count * sizeof(std::uint16_t));
+			break;
+		case PixelStorage::PACKED12: {
+			const PackFunction pack = getPack(12, ByteOrder::BIG);
+			const std::size_t even = count & ~std::size_t(1);
+			pack(rgb, stored, even);
+			if (even != count) {
+				const std::uint16_t last[2] = {rgb[even], 0};
+				pack(last, stored + even / 2 * 3, 2);
+			}
+			break;
+		}
+		case PixelStorage::GAMMA8: {
+			const std::vector<std::uint8_t> &table = getToGamma();
+			for (std::size_t i = 0; i < count; ++i) {
+				stored[i] = table[rgb[i]];
+			}
+			break;
+		}
+		case PixelStorage::HALF: {
+			const std::vector<std::uint16_t> &table = getToHalf();
+			std::uint16_t *out = reinterpret_cast<std::uint16_t*>(stored);
+			for (std::size_t i = 0; i < count; ++i) {
+				out[i] = table[rgb[i]];
+			}
+			break;
+		}
+	}
+}
+
+void loadRow(const std::uint8_t *stored, std::uint16_t *rgb, std::size_t width, PixelStorage storage) {
+	const std::size_t count = 3 * width;
+	switch (storage) {
+		case PixelStorage::UINT16:
+			std::memcpy(rgb, stored, count * sizeof(std::uint16_t));
+			break;
+		case PixelStorage::PACKED12: {
+			const UnpackFunction unpack = getUnpack(12, ByteOrder::BIG);
+			const std::size_t even = count & ~std::size_t(1);
+			unpack(stored, rgb, even);
+			if (even != count) {
+				std::uint16_t last[2];
+				unpack(stored + even / 2 * 3, last, 2);
+				rgb[even] = last[0];
+			}
+			break;
+		}
+		case PixelStorage::GAMMA8: {
+			const std::vector<std::uint16_t> &table = getFromGamma();
+			for (std::size_t i = 0; i < count; ++i) {
+				rgb[i] = table[stored[i]];
+			}
+			break;
+		}
+		case PixelStorage::HALF: {
+			const std::vector<std::uint16_t> &table = getFromHalf();
+			const std::uint16_t *in = reinterpret_cast<const std::uint16_t*>(stored);
+			for (std::size_t i = 0; i < count; ++i) {
+				rgb[i] = table[in[i]];
+			}
+			break;
+		}
+	}
+}
+
+void storeRows(const cv::Mat &rgb, cv::Mat &stored, PixelStorage storage) {
+	for (int y = 0; y < rgb.rows; ++y) {
+		storeRow(rgb.ptr<std::uint16_t>(y), stored.ptr<std::uint8_t>(y), rgb.cols, storage);
+	}
+}
+
+cv::Mat loadRows(const cv::Mat &stored, int width, PixelStorage storage) {
+	cv::Mat rgb;
+	FrameBufferPool::getDefault().create(rgb, stored.rows, width, CV_16UC3);
+	for (int y = 0; y < stored.rows; ++y) {
+		loadRow(stored.ptr<std::uint8_t>(y), rgb.ptr<std::uint16_t>(y), width, storage);
+	}
+	return rgb;
+}
+
+}
+}
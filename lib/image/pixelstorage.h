@@ -0,0 +1,112 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LYLI_IMAGE_PIXELSTORAGE_H_
+#define LYLI_IMAGE_PIXELSTORAGE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <opencv2/core/core.hpp>
+
+/*
+ * Storage of the RGB images in a reduced precision.
+ *
+ * The images are produced as RGB uint16_t pixels and converted to the storage
+ * row by row, so that the full precision image never exists as a whole.
+ */
+
+namespace Lyli {
+namespace Image {
+
+/** Precision of the stored RGB pixels.
+ */
+enum class PixelStorage {
+	/** uint16_t channels, CV_16UC3 */
+	UINT16,
+	/**
+	 * The 12 most significant bits of the channels packed the same way
+	 * as the big endian 12-bit RAW data, CV_8UC1 rows of getStoredRowBytes() bytes.
+	 */
+	PACKED12,
+	/** uint8_t channels encoded with the gamma 1/2.2 meant for display, CV_8UC3 */
+	GAMMA8,
+	/**
+	 * Linear half floats in the range 0-1, CV_16FC3 with OpenCV 4,
+	 * CV_16UC3 holding the bits of the half floats otherwise.
+	 */
+	HALF,
+};
+
+/** Get number of bytes of a stored row.
+ *
+ * \param storage the storage
+ * \param width number of RGB pixels in the row
+ */
+std::size_t getStoredRowBytes(PixelStorage storage, std::size_t width);
+
+/** Allocate an image in the storage.
+ *
+ * \param image the allocated image
+ * \param rows number of rows of the image
+ * \param width number of RGB pixels in a row
+ * \param storage the storage
+ */
+void createStorage(cv::Mat &image, int rows, int width, PixelStorage storage);
+
+/** Convert a row of RGB pixels to the storage.
+ *
+ * \param rgb width RGB uint16_t pixels
+ * \param stored the output row of getStoredRowBytes() bytes
+ * \param width number of the pixels
+ * \param storage the storage
+ */
+void storeRow(const std::uint16_t *rgb, std::uint8_t *stored, std::size_t width, PixelStorage storage);
+
+/** Convert a stored row back to RGB pixels.
+ *
+ * Only the UINT16 storage is lossless, the other storages restore
+ * the nearest value they can represent.
+ *
+ * \param stored the row in the storage
+ * \param rgb width output RGB uint16_t pixels
+ * \param width number of the pixels
+ * \param storage the storage
+ */
+void loadRow(const std::uint8_t *stored, std::uint16_t *rgb, std::size_t width, PixelStorage storage);
+
+/** Convert RGB rows to the storage.
+ *
+ * \param rgb RGB uint16_t rows
+ * \param stored the output rows allocated by createStorage() with the same size as rgb
+ * \param storage the storage
+ */
+void storeRows(const cv::Mat &rgb, cv::Mat &stored, PixelStorage storage);
+
+/** Convert stored rows back to RGB pixels.
+ *
+ * \param stored rows in the storage
+ * \param width number of RGB pixels in a row
+ * \param storage the storage
+ * \return RGB uint16_t rows
+ */
+cv::Mat loadRows(const cv::Mat &stored, int width, PixelStorage storage);
+
+}
+}
+
+#endif
@@ -0,0 +1,606 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rawcodec.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include <tbb/parallel_for.h>
+
+#include "unpack.h"
+
+namespace {
+
+using Lyli::Image::ByteOrder;
+using Lyli::Image::CfaPhase;
+using Lyli::Image::UnsupportedFormatException;
+
+/*
+ * The header of the compressed data, all numbers are little endian:
+ *    0  magic
+ *    8  uint16 version
+ *   10  uint8 bits per pixel
+ *   11  uint8 byte order
+ *   12  uint8 bayer phase
+ *   13  3 reserved bytes
+ *   16  uint32 width
+ *   20  uint32 height
+ *   24  uint32 rows of a strip
+ *   28  uint32 number of strips
+ *   32  uint64 number of trailing bytes
+ *   40  uint64 offsets of the strips and of the trailing bytes
+ *
+ * Each strip starts with its type followed either by the codes or by the packed rows.
+ */
+const std::uint8_t MAGIC[8] = {'L', 'Y', 'L', 'I', 'R', 'A', 'W', 'Z'};
+constexpr std::uint16_t VERSION = 1;
+
+/** Codes with a longer unary part are escaped and the whole value is stored instead. */
+constexpr int ESCAPE_LENGTH = 24;
+/** Number of consecutive pixels of a row sharing the same parameter of the Rice code. */
+constexpr int BLOCK_SIZE = 32;
+/** Number of bits storing the parameter of a block. */
+constexpr int PARAMETER_BITS = 4;
+
+/** The first byte of a strip, the strips that do not compress are stored unchanged. */
+enum StripType : std::uint8_t {
+	RICE_STRIP = 0,
+	PACKED_STRIP = 1
+};
+
+void putLittle(std::vector<std::uint8_t> &out, std::uint64_t value, int bytes) {
+	for (int i = 0; i < bytes; ++i) {
+		out.push_back(value >> (8 * i));
+	}
+}
+
+std::uint64_t getLittle(const std::uint8_t *data, int bytes) {
+	std::uint64_t value = 0;
+	for (int i = bytes - 1; i >= 0; --i) {
+		value = (value << 8) | data[i];
+	}
+	return value;
+}
+
+[[noreturn]] void throwCorrupted() {
+	throw UnsupportedFormatException("the compressed RAW data are corrupted");
+}
+
+/**
+ * The median edge detector predictor.
+ *
+ * \param a the pixel on the left
+ * \param b the pixel above
+ * \param c the pixel above left
+ */
+inline int predict(int a, int b, int c) {
+	// the predictor is the median of a, b and a + b - c, which avoids unpredictable branches
+	return std::max(std::min(a, b), std::min(std::max(a, b), a + b - c));
+}
+
+/**
+ * Call the function for each pixel of a row together with the prediction of the pixel.
+ *
+ * The pixels are predicted from the closest pixels of the same color, ie. two pixels away.
+ * The first two rows of a strip are predicted from the left only, the first two columns
+ * from the pixel above. The function may set the pixel, the following pixels are
+ * predicted using the new value.
+ *
+ * \param row the pixels of the row
+ * \param up the pixels two rows above or nullptr for the first rows of a strip
+ * \param width number of pixels of the row
+ * \param bits number of bits of a pixel
+ * \param function the function called as function(x, prediction)
+ */
+template<typename Function>
+inline void predictRow(const std::uint16_t *row, const std::uint16_t *up, int width, int bits, Function function) {
+	if (up == nullptr) {
+		const int middle = 1 << (bits - 1);
+		function(0, middle);
+		function(1, middle);
+		for (int x = 2; x < width; ++x) {
+			function(x, row[x - 2]);
+		}
+		return;
+	}
+
+	function(0, up[0]);
+	function(1, up[1]);
+	for (int x = 2; x < width; ++x) {
+		function(x, predict(row[x - 2], up[x], up[x - 2]));
+	}
+}
+
+/**
+ * Map the prediction error to a non-negative value.
+ *
+ * The error is wrapped to the range of the pixels, so that the value has the same number of bits.
+ */
+inline std::uint32_t getValue(int pixel, int prediction, int bits) {
+	const int half = 1 << (bits - 1);
+	const int error = ((pixel - prediction + half) & ((1 << bits) - 1)) - half;
+	return error >= 0 ? 2 * error : -2 * error - 1;
+}
+
+/**
+ * Map the value back to the prediction error.
+ */
+inline int getError(std::uint32_t value) {
+	return (value & 1) != 0 ? -static_cast<int>(value >> 1) - 1 : static_cast<int>(value >> 1);
+}
+
+/**
+ * Writer of a stream of bits starting with the most significant bit.
+ */
+class BitWriter {
+public:
+	explicit BitWriter(std::vector<std::uint8_t> &out) : m_out(out), m_bits(0), m_count(0) {
+
+	}
+
+	/**
+	 * Write the lowest count bits of the value, count must be at most 32.
+	 */
+	void put(std::uint32_t value, int count) {
+		m_bits = (m_bits << count) | value;
+		m_count += count;
+		while (m_count >= 8) {
+			m_count -= 8;
+			m_out.push_back(m_bits >> m_count);
+		}
+	}
+
+	void flush() {
+		if (m_count > 0) {
+			m_out.push_back(m_bits << (8 - m_count));
+			m_count = 0;
+		}
+	}
+
+private:
+	std::vector<std::uint8_t> &m_out;
+	std::uint64_t m_bits;
+	int m_count;
+};
+
+/**
+ * Reader of a stream of bits starting with the most significant bit.
+ *
+ * The bits past the end of the data are read as zeros.
+ */
+class BitReader {
+public:
+	BitReader(const std::uint8_t *begin, const std::uint8_t *end) :
+		m_begin(begin), m_end(end), m_ptr(begin), m_bits(0), m_count(0) {
+
+	}
+
+	/**
+	 * Make at least 56 bits available if there are less than 40 bits, which is enough for any code.
+	 */
+	void refill() {
+		if (m_count >= 40) {
+			return;
+		}
+		if (m_end - m_ptr >= 8) {
+			// read a whole big endian word and advance by the bytes that fit in
+			std::uint64_t word;
+			std::memcpy(&word, m_ptr, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			word = __builtin_bswap64(word);
+#endif
+			m_bits |= word >> m_count;
+			m_ptr += (63 - m_count) >> 3;
+			m_count |= 56;
+		}
+		else {
+			while (m_count <= 56) {
+				const std::uint64_t byte = m_ptr < m_end ? *m_ptr : 0;
+				m_bits |= byte << (56 - m_count);
+				++m_ptr;
+				m_count += 8;
+			}
+		}
+	}
+
+	int countZeros() const {
+		return m_bits == 0 ? 64 : __builtin_clzll(m_bits);
+	}
+
+	void skip(int count) {
+		m_bits <<= count;
+		m_count -= count;
+	}
+
+	std::uint32_t read(int count) {
+		const std::uint32_t value = (m_bits >> 1) >> (63 - count);
+		skip(count);
+		return value;
+	}
+
+	/**
+	 * Check whether more bits were read than available.
+	 */
+	bool isOverrun() const {
+		return static_cast<std::uint64_t>(m_ptr - m_begin) * 8 - m_count > static_cast<std::uint64_t>(m_end - m_begin) * 8;
+	}
+
+private:
+	const std::uint8_t *m_begin;
+	const std::uint8_t *m_end;
+	const std::uint8_t *m_ptr;
+	std::uint64_t m_bits;
+	int m_count;
+};
+
+/**
+ * Encoder of the prediction errors using the Rice codes.
+ *
+ * Each block of a row stores the parameter giving the shortest code for the block.
+ * Unlike an adaptive parameter, this allows the decoder to read the codes without
+ * waiting for the previous pixels to be reconstructed.
+ */
+class Encoder {
+public:
+	Encoder(std::vector<std::uint8_t> &out, int bits) : m_writer(out), m_bits(bits) {
+
+	}
+
+	/**
+	 * Encode the values of a row.
+	 */
+	void encode(const std::uint32_t *values, int count) {
+		for (int block = 0; block < count; block += BLOCK_SIZE) {
+			const int size = std::min(BLOCK_SIZE, count - block);
+			const int k = selectParameter(values + block, size);
+			m_writer.put(k, PARAMETER_BITS);
+			for (int i = block; i < block + size; ++i) {
+				const std::uint32_t quotient = values[i] >> k;
+				if (quotient < ESCAPE_LENGTH) {
+					m_writer.put(1, quotient + 1);
+					m_writer.put(values[i] & ((1 << k) - 1), k);
+				}
+				else {
+					m_writer.put(1, ESCAPE_LENGTH + 1);
+					m_writer.put(values[i], m_bits);
+				}
+			}
+		}
+	}
+
+	void flush() {
+		m_writer.flush();
+	}
+
+private:
+	BitWriter m_writer;
+	int m_bits;
+
+	int selectParameter(const std::uint32_t *values, int count) const {
+		// the best parameter is close to the bit length of the mean value
+		std::uint64_t sum = 0;
+		for (int i = 0; i < count; ++i) {
+			sum += values[i];
+		}
+		const std::uint32_t mean = sum / count;
+		const int length = mean == 0 ? 0 : 32 - __builtin_clz(mean);
+
+		int best = 0;
+		std::uint64_t bestLength = UINT64_MAX;
+		for (int k = std::max(length - 2, 0); k <= std::min(length + 1, m_bits); ++k) {
+			std::uint64_t length = 0;
+			for (int i = 0; i < count; ++i) {
+				const std::uint32_t quotient = values[i] >> k;
+				length += quotient < ESCAPE_LENGTH ? quotient + 1 + k : ESCAPE_LENGTH + 1 + m_bits;
+			}
+			if (length < bestLength) {
+				best = k;
+				bestLength = length;
+			}
+		}
+		return best;
+	}
+};
+
+/**
+ * Decoder of the prediction errors written by the Encoder.
+ */
+class Decoder {
+public:
+	Decoder(const std::uint8_t *begin, const std::uint8_t *end, int bits) : m_reader(begin, end), m_bits(bits) {
+
+	}
+
+	/**
+	 * Decode the prediction errors of a row.
+	 */
+	void decode(int *errors, int count) {
+		for (int block = 0; block < count; block += BLOCK_SIZE) {
+			const int size = std::min(BLOCK_SIZE, count - block);
+			m_reader.refill();
+			const int k = std::min<int>(m_reader.read(PARAMETER_BITS), m_bits);
+			for (int i = block; i < block + size; ++i) {
+				m_reader.refill();
+				const int zeros = std::min(m_reader.countZeros(), ESCAPE_LENGTH);
+				m_reader.skip(zeros + 1);
+				const std::uint32_t value = zeros < ESCAPE_LENGTH ? (zeros << k) | m_reader.read(k) : m_reader.read(m_bits);
+				errors[i] = getError(value);
+			}
+		}
+	}
+
+	bool isOverrun() const {
+		return m_reader.isOverrun();
+	}
+
+private:
+	BitReader m_reader;
+	int m_bits;
+};
+
+}
+
+namespace Lyli {
+namespace Image {
+
+constexpr std::size_t CompressedRaw::HEADER_SIZE;
+
+std::vector<std::uint8_t> compressRaw(const std::uint8_t *packed, std::size_t size, const RawFormat &format,
+                                      int stripRows) {
+	format.validate();
+	if (size < format.getFrameBytes()) {
+		throw UnsupportedFormatException("incomplete RAW data cannot be compressed");
+	}
+	if (stripRows <= 0 || stripRows % 2 != 0) {
+		throw UnsupportedFormatException("the compressed strips must have an even number of rows");
+	}
+
+	const int width = format.width;
+	const int height = format.height;
+	const int shift = 16 - format.bitsPerPixel;
+	const std::size_t rowBytes = format.getRowBytes();
+	const UnpackFunction unpack = getUnpack(format.bitsPerPixel, format.byteOrder);
+
+	// compress the strips in parallel
+	const std::size_t stripCount = (height + stripRows - 1) / stripRows;
+	std::vector<std::vector<std::uint8_t>> strips(stripCount);
+	tbb::parallel_for(std::size_t(0), stripCount, [&](std::size_t strip) {
+		const int first = strip * stripRows;
+		const int rows = std::min(stripRows, height - first);
+		std::vector<std::uint16_t> pixels(rows * width);
+		for (int y = 0; y < rows; ++y) {
+			std::uint16_t *row = pixels.data() + y * width;
+			unpack(packed + (first + y) * rowBytes, row, width);
+			for (int x = 0; x < width; ++x) {
+				row[x] >>= shift;
+			}
+		}
+
+		std::vector<std::uint8_t> &out = strips[strip];
+		out.reserve(rows * rowBytes);
+		out.push_back(RICE_STRIP);
+		Encoder encoder(out, format.bitsPerPixel);
+		std::vector<std::uint32_t> values(width);
+		for (int y = 0; y < rows; ++y) {
+			const std::uint16_t *row = pixels.data() + y * width;
+			const std::uint16_t *up = y >= 2 ? row - 2 * width : nullptr;
+			predictRow(row, up, width, format.bitsPerPixel, [&](int x, int prediction) {
+				values[x] = getValue(row[x], prediction, format.bitsPerPixel);
+			});
+			encoder.encode(values.data(), width);
+		}
+		encoder.flush();
+
+		// avoid expanding the data that do not compress, such as noise
+		if (out.size() > 1 + rows * rowBytes) {
+			const std::uint8_t *begin = packed + first * rowBytes;
+			out.assign(1, PACKED_STRIP);
+			out.insert(out.end(), begin, begin + rows * rowBytes);
+		}
+	});
+
+	// assemble the file
+	const std::size_t trailing = size - format.getFrameBytes();
+	std::vector<std::uint8_t> out(MAGIC, MAGIC + sizeof(MAGIC));
+	putLittle(out, VERSION, 2);
+	putLittle(out, format.bitsPerPixel, 1);
+	putLittle(out, static_cast<int>(format.byteOrder), 1);
+	putLittle(out, static_cast<int>(format.phase), 1);
+	putLittle(out, 0, 3);
+	putLittle(out, width, 4);
+	putLittle(out, height, 4);
+	putLittle(out, stripRows, 4);
+	putLittle(out, stripCount, 4);
+	putLittle(out, trailing, 8);
+
+	std::uint64_t offset = CompressedRaw::HEADER_SIZE + 8 * (stripCount + 1);
+	for (const auto &strip : strips) {
+		putLittle(out, offset, 8);
+		offset += strip.size();
+	}
+	putLittle(out, offset, 8);
+
+	out.reserve(offset + trailing);
+	for (const auto &strip : strips) {
+		out.insert(out.end(), strip.begin(), strip.end());
+	}
+	out.insert(out.end(), packed + format.getFrameBytes(), packed + size);
+	return out;
+}
+
+CompressedRaw::CompressedRaw(const std::uint8_t *data, std::size_t size) : m_data(data), m_size(size) {
+	if (!isCompressed(data, size) || size < HEADER_SIZE) {
+		throw UnsupportedFormatException("the data are not compressed RAW data");
+	}
+	if (getLittle(data + 8, 2) != VERSION) {
+		throw UnsupportedFormatException("unsupported version of the compressed RAW data");
+	}
+
+	const int byteOrder = data[11];
+	const int phase = data[12];
+	if (byteOrder > static_cast<int>(ByteOrder::LITTLE) || phase > static_cast<int>(CfaPhase::RGGB)) {
+		throwCorrupted();
+	}
+	m_format.bitsPerPixel = data[10];
+	m_format.byteOrder = static_cast<ByteOrder>(byteOrder);
+	m_format.phase = static_cast<CfaPhase>(phase);
+	m_format.width = getLittle(data + 16, 4);
+	m_format.height = getLittle(data + 20, 4);
+	m_format.validate();
+
+	m_stripRows = getLittle(data + 24, 4);
+	const std::uint64_t stripCount = getLittle(data + 28, 4);
+	const std::uint64_t trailing = getLittle(data + 32, 8);
+	if (m_stripRows <= 0 || m_stripRows % 2 != 0
+	    || stripCount != (m_format.height + m_stripRows - 1) / m_stripRows
+	    || stripCount + 1 > (size - HEADER_SIZE) / 8) {
+		throwCorrupted();
+	}
+
+	// the strips must follow the table of offsets and the trailing bytes must end the data
+	m_offsets.resize(stripCount + 1);
+	for (std::size_t i = 0; i < m_offsets.size(); ++i) {
+		m_offsets[i] = getLittle(data + HEADER_SIZE + 8 * i, 8);
+	}
+	if (m_offsets.front() != HEADER_SIZE + 8 * m_offsets.size()
+	    || !std::is_sorted(m_offsets.begin(), m_offsets.end())
+	    || m_offsets.back() > size || size - m_offsets.back() != trailing) {
+		throwCorrupted();
+	}
+	// each pixel takes at least one bit, which also limits the memory allocated for corrupted data
+	for (std::size_t strip = 0; strip < stripCount; ++strip) {
+		const std::uint64_t rows = std::min<std::uint64_t>(m_stripRows, m_format.height - strip * m_stripRows);
+		if (rows * m_format.width > 8 * (m_offsets[strip + 1] - m_offsets[strip])) {
+			throwCorrupted();
+		}
+	}
+}
+
+bool CompressedRaw::isCompressed(const std::uint8_t *data, std::size_t size) {
+	return size >= sizeof(MAGIC) && std::memcmp(data, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+const RawFormat &CompressedRaw::getFormat() const {
+	return m_format;
+}
+
+int CompressedRaw::getStripRows() const {
+	return m_stripRows;
+}
+
+std::size_t CompressedRaw::getStripCount() const {
+	return m_offsets.size() - 1;
+}
+
+void CompressedRaw::decodeRows(int first, int last, cv::Mat &mosaic) const {
+	const int width = m_format.width;
+	const int height = m_format.height;
+	const int shift = 16 - m_format.bitsPerPixel;
+
+	std::vector<std::uint16_t> pixels(m_stripRows * width);
+	for (int strip = first / m_stripRows; strip * m_stripRows < last; ++strip) {
+		// only the rows up to the last requested one are decoded
+		const int stripFirst = strip * m_stripRows;
+		const int stripLast = std::min({stripFirst + m_stripRows, last, height});
+		decodeStrip(strip, stripLast - stripFirst, pixels.data());
+
+		for (int y = std::max(first, stripFirst); y < stripLast; ++y) {
+			const std::uint16_t *src = pixels.data() + (y - stripFirst) * width;
+			std::uint16_t *dst = mosaic.ptr<std::uint16_t>(y - first);
+			for (int x = 0; x < width; ++x) {
+				dst[x] = src[x] << shift;
+			}
+		}
+	}
+}
+
+std::vector<std::uint8_t> CompressedRaw::decompress() const {
+	const int width = m_format.width;
+	const int height = m_format.height;
+	const int shift = 16 - m_format.bitsPerPixel;
+	const std::size_t rowBytes = m_format.getRowBytes();
+	const PackFunction pack = getPack(m_format.bitsPerPixel, m_format.byteOrder);
+
+	std::vector<std::uint8_t> out(m_format.getFrameBytes() + (m_size - m_offsets.back()));
+	tbb::parallel_for(std::size_t(0), getStripCount(), [&](std::size_t strip) {
+		const int first = strip * m_stripRows;
+		const int rows = std::min(m_stripRows, height - first);
+		std::vector<std::uint16_t> pixels(rows * width);
+		decodeStrip(strip, rows, pixels.data());
+
+		for (int y = 0; y < rows; ++y) {
+			std::uint16_t *row = pixels.data() + y * width;
+			for (int x = 0; x < width; ++x) {
+				row[x] <<= shift;
+			}
+			pack(row, out.data() + (first + y) * rowBytes, width);
+		}
+	});
+
+	std::copy(m_data + m_offsets.back(), m_data + m_size, out.begin() + m_format.getFrameBytes());
+	return out;
+}
+
+void CompressedRaw::decodeStrip(std::size_t strip, int rows, std::uint16_t *pixels) const {
+	const int width = m_format.width;
+	const std::uint8_t *begin = m_data + m_offsets[strip];
+	const std::uint8_t *end = m_data + m_offsets[strip + 1];
+	if (begin == end) {
+		throwCorrupted();
+	}
+
+	if (*begin == PACKED_STRIP) {
+		const std::size_t rowBytes = m_format.getRowBytes();
+		const int stripRows = std::min<int>(m_stripRows, m_format.height - strip * m_stripRows);
+		if (static_cast<std::size_t>(end - begin) != 1 + stripRows * rowBytes) {
+			throwCorrupted();
+		}
+		const int shift = 16 - m_format.bitsPerPixel;
+		const UnpackFunction unpack = getUnpack(m_format.bitsPerPixel, m_format.byteOrder);
+		for (int y = 0; y < rows; ++y) {
+			std::uint16_t *row = pixels + y * width;
+			unpack(begin + 1 + y * rowBytes, row, width);
+			for (int x = 0; x < width; ++x) {
+				row[x] >>= shift;
+			}
+		}
+		return;
+	}
+	if (*begin != RICE_STRIP) {
+		throwCorrupted();
+	}
+
+	const int mask = (1 << m_format.bitsPerPixel) - 1;
+	Decoder decoder(begin + 1, end, m_format.bitsPerPixel);
+	std::vector<int> errors(width);
+	for (int y = 0; y < rows; ++y) {
+		std::uint16_t *row = pixels + y * width;
+		const std::uint16_t *up = y >= 2 ? row - 2 * width : nullptr;
+		decoder.decode(errors.data(), width);
+		predictRow(row, up, width, m_format.bitsPerPixel, [&](int x, int prediction) {
+			row[x] = (prediction + errors[x]) & mask;
+		});
+	}
+	if (decoder.isOverrun()) {
+		throwCorrupted();
+	}
+}
+
+}
+}
@@ -0,0 +1,131 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LYLI_IMAGE_RAWCODEC_H_
+#define LYLI_IMAGE_RAWCODEC_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include <image/rawformat.h>
+
+/*
+ * Lossless compression of the RAW images.
+ *
+ * Each pixel is predicted from the neighbouring pixels of the same color
+ * using the median edge detector of LOCO-I and the prediction errors are
+ * stored using Rice codes with the parameter selected for short blocks of pixels.
+ *
+ * The image is split into strips of rows that are compressed independently,
+ * so that both the compression and the decompression run in parallel and
+ * any rows can be decoded without decoding the whole image. The strips that
+ * do not compress are stored unchanged.
+ *
+ * The compressed data consist of a header, the offsets of the strips,
+ * the strips and the bytes of the original file following the image, if any.
+ */
+
+namespace Lyli {
+namespace Image {
+
+/** The default number of rows of the independently compressed strips. */
+constexpr int COMPRESSED_STRIP_ROWS = 16;
+
+/** Compress a RAW file.
+ *
+ * \param packed the contents of a .RAW file
+ * \param size size of the data in bytes
+ * \param format layout of the data
+ * \param stripRows number of rows of the independently compressed strips, must be even
+ * \return the compressed file
+ * \throw UnsupportedFormatException when the format cannot be compressed or the data are incomplete
+ */
+std::vector<std::uint8_t> compressRaw(const std::uint8_t *packed, std::size_t size, const RawFormat &format,
+                                      int stripRows = COMPRESSED_STRIP_ROWS);
+
+/** A compressed RAW image in memory.
+ *
+ * The class only parses the header, the data are decoded on request
+ * and they have to stay valid while the object is used.
+ */
+class CompressedRaw {
+public:
+	/** Size of the fixed part of the header in bytes. */
+	static constexpr std::size_t HEADER_SIZE = 40;
+
+	/** Parse the compressed data.
+	 *
+	 * \param data the contents of a compressed file
+	 * \param size size of the data in bytes
+	 * \throw UnsupportedFormatException when the data are not valid compressed data
+	 */
+	CompressedRaw(const std::uint8_t *data, std::size_t size);
+
+	/** Check whether the data start with the header of the compressed data.
+	 */
+	static bool isCompressed(const std::uint8_t *data, std::size_t size);
+
+	/** Get the format of the original file.
+	 */
+	const RawFormat &getFormat() const;
+
+	/** Get number of rows of a strip, only the last strip may be shorter.
+	 */
+	int getStripRows() const;
+
+	/** Get number of the strips.
+	 */
+	std::size_t getStripCount() const;
+
+	/** Decode rows of the mosaic.
+	 *
+	 * The pixels are scaled to the full 16-bit range, the same as the unpacked pixels.
+	 * Only the strips containing the rows are decoded.
+	 *
+	 * \param first the first row to decode
+	 * \param last one past the last row to decode
+	 * \param mosaic output uint16_t rows, the row first is stored in the row 0
+	 * \throw UnsupportedFormatException when the data are corrupted
+	 */
+	void decodeRows(int first, int last, cv::Mat &mosaic) const;
+
+	/** Restore the original RAW file.
+	 *
+	 * \return the contents of the original file
+	 * \throw UnsupportedFormatException when the data are corrupted
+	 */
+	std::vector<std::uint8_t> decompress() const;
+
+private:
+	const std::uint8_t *m_data;
+	std::size_t m_size;
+	RawFormat m_format;
+	int m_stripRows;
+	// offsets of the strips in the data followed by the offset of the trailing bytes
+	std::vector<std::uint64_t> m_offsets;
+
+	/** Decode the first rows of a strip into unscaled pixels. */
+	void decodeStrip(std::size_t strip, int rows, std::uint16_t *pixels) const;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,396 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rawdecode.h"
+
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+#include "defectmap.h"
+#include "demosaic.h"
+#include "framestatistics.h"
+#include "rawcodec.h"
+#include "rawformat.h"
+#include "rawimage.h"
+#include "unpack.h"
+
+namespace {
+
+using Lyli::Image::CfaPhase;
+using Lyli::Image::DecodeOptions;
+using Lyli::Image::FrameStatistics;
+using Lyli::Image::Normalization;
+using Lyli::Image::RawFormat;
+
+/**
+ * Get the row of the red pixel in a bayer quad.
+ */
+constexpr int getRedRow(CfaPhase phase) {
+	return phase == CfaPhase::RGGB || phase == CfaPhase::GRBG ? 0 : 1;
+}
+
+/**
+ * Get the column of the red pixel in a bayer quad, the blue pixel is in the other row and column.
+ */
+constexpr int getRedColumn(CfaPhase phase) {
+	return phase == CfaPhase::RGGB || phase == CfaPhase::GBRG ? 0 : 1;
+}
+
+/**
+ * Get the channel of a pixel in a bayer quad, the channels are ordered as R, Gr, Gb, B.
+ */
+int getChannel(CfaPhase phase, int row, int column) {
+	if (row == getRedRow(phase)) {
+		return column == getRedColumn(phase) ? 0 : 1;
+	}
+	return column == getRedColumn(phase) ? 2 : 3;
+}
+
+/**
+ * Fixed point normalization of a single line of the mosaic.
+ *
+ * The first entries belong to the pixels in even columns, the second ones to the odd columns.
+ */
+struct LineNormalization {
+	std::uint16_t black[2];
+	std::uint32_t multiplier[2];
+};
+
+/**
+ * Get the white level of a channel in the sensor units, an unset level is the largest value of the format.
+ */
+int getWhite(const Normalization &normalization, int channel, const RawFormat &format) {
+	return normalization.white[channel] > 0 ? normalization.white[channel] : (1 << format.bitsPerPixel) - 1;
+}
+
+/**
+ * Convert the normalization of a single channel to the fixed point representation.
+ */
+void setChannel(const Normalization &normalization, const RawFormat &format, int channel, int column, LineNormalization &line) {
+	// the levels are in the sensor units, while the unpacked data use the full 16-bit range
+	const int shift = 16 - format.bitsPerPixel;
+	const int black = std::max(normalization.black[channel], 0) << shift;
+	const int range = std::max((getWhite(normalization, channel, format) << shift) - black, 1);
+	const double multiplier = normalization.gain[channel] * 65535.0 / range * (1 << Lyli::Image::NORMALIZE_SHIFT);
+	line.black[column] = std::min(black, 65535);
+	line.multiplier[column] = std::min(std::max(multiplier + 0.5, 0.0), 65535.0);
+}
+
+/**
+ * Get the normalization of the even and the odd lines.
+ */
+void getLineNormalization(const Normalization &normalization, const RawFormat &format, LineNormalization lines[2]) {
+	for (int row = 0; row < 2; ++row) {
+		for (int column = 0; column < 2; ++column) {
+			setChannel(normalization, format, getChannel(format.phase, row, column), column, lines[row]);
+		}
+	}
+}
+
+/**
+ * The channels and the clipping levels of a single line of the mosaic for the statistics.
+ *
+ * The first entries belong to the pixels in even columns, the second ones to the odd columns.
+ */
+struct LineStatistics {
+	int channel[2];
+	std::uint16_t black[2];
+	std::uint16_t white[2];
+};
+
+/**
+ * Get the channels and the clipping levels of the even and the odd lines.
+ */
+void getLineStatistics(const DecodeOptions &options, const RawFormat &format, LineStatistics lines[2]) {
+	const int shift = 16 - format.bitsPerPixel;
+	for (int row = 0; row < 2; ++row) {
+		for (int column = 0; column < 2; ++column) {
+			const int channel = getChannel(format.phase, row, column);
+			lines[row].channel[column] = channel;
+			if (options.normalize) {
+				// the normalization maps the levels to the limits of the range
+				lines[row].black[column] = 0;
+				lines[row].white[column] = 65535;
+			}
+			else {
+				lines[row].black[column] = std::min(std::max(options.normalization.black[channel], 0) << shift, 65535);
+				lines[row].white[column] = std::min(getWhite(options.normalization, channel, format) << shift, 65535);
+			}
+		}
+	}
+}
+
+/**
+ * Add a row of the mosaic to the statistics if they are gathered.
+ */
+void addStatistics(FrameStatistics *statistics, const LineStatistics lines[2], int y, const std::uint16_t *row, std::size_t width) {
+	if (statistics) {
+		const LineStatistics &line = lines[y & 1];
+		statistics->addRow(row, width, line.channel, line.black, line.white);
+	}
+}
+
+using BinFunction = void (*)(const std::uint16_t *, const std::uint16_t *, std::uint16_t *, std::size_t);
+
+/**
+ * Bin the quads of an even and an odd row into RGB pixels.
+ */
+template<CfaPhase Phase>
+void binQuads(const std::uint16_t *even, const std::uint16_t *odd, std::uint16_t *out, std::size_t width) {
+	constexpr int RED_COLUMN = getRedColumn(Phase);
+	const std::uint16_t *red = getRedRow(Phase) == 0 ? even : odd;
+	const std::uint16_t *blue = getRedRow(Phase) == 0 ? odd : even;
+	for (std::size_t x = 0; x < width / 2; ++x) {
+		out[3 * x] = red[2 * x + RED_COLUMN];
+		out[3 * x + 1] = (red[2 * x + 1 - RED_COLUMN] + blue[2 * x + RED_COLUMN]) >> 1;
+		out[3 * x + 2] = blue[2 * x + 1 - RED_COLUMN];
+	}
+}
+
+BinFunction selectBinQuads(CfaPhase phase) {
+	switch (phase) {
+		case CfaPhase::GBRG:
+			return binQuads<CfaPhase::GBRG>;
+		case CfaPhase::GRBG:
+			return binQuads<CfaPhase::GRBG>;
+		case CfaPhase::RGGB:
+			return binQuads<CfaPhase::RGGB>;
+		case CfaPhase::BGGR:
+		default:
+			return binQuads<CfaPhase::BGGR>;
+	}
+}
+
+/**
+ * Bin the quads of the rows of a mosaic whose first pixel is in the first column and row of a quad.
+ */
+void binMosaic(const cv::Mat &mosaic, BinFunction bin, cv::Mat &rgb) {
+	for (int y = 0; y < rgb.rows; ++y) {
+		bin(mosaic.ptr<std::uint16_t>(2 * y), mosaic.ptr<std::uint16_t>(2 * y + 1), rgb.ptr<std::uint16_t>(y), mosaic.cols);
+	}
+}
+
+}
+
+namespace Lyli {
+namespace Image {
+
+void unpackRows(const std::uint8_t *packed, std::size_t size, const RawFormat &format, const DecodeOptions &options,
+                int first, int last, cv::Mat &mosaic, FrameStatistics *statistics) {
+	const std::size_t width = format.width;
+	const std::size_t rowBytes = format.getRowBytes();
+	const UnpackFunction unpack = getUnpack(format.bitsPerPixel, format.byteOrder);
+
+	LineNormalization lines[2];
+	getLineNormalization(options.normalization, format, lines);
+	LineStatistics statisticsLines[2];
+	getLineStatistics(options, format, statisticsLines);
+
+	for (int y = first; y < last; ++y) {
+		std::uint16_t *row = mosaic.ptr<std::uint16_t>(y - first);
+		// missing rows are treated as black
+		if ((y + 1) * rowBytes <= size) {
+			unpack(packed + y * rowBytes, row, width);
+			if (options.defects) {
+				options.defects->correctRow(y, 0, width, row);
+			}
+			if (options.normalize) {
+				normalize(row, width, lines[y & 1].black, lines[y & 1].multiplier);
+			}
+		}
+		else {
+			std::fill(row, row + width, 0);
+		}
+		// the row is still in the cache
+		addStatistics(statistics, statisticsLines, y, row, width);
+	}
+}
+
+void unpackRows(const CompressedRaw &compressed, const DecodeOptions &options, int first, int last, cv::Mat &mosaic,
+                FrameStatistics *statistics) {
+	compressed.decodeRows(first, last, mosaic);
+
+	const std::size_t width = compressed.getFormat().width;
+	LineNormalization lines[2];
+	getLineNormalization(options.normalization, compressed.getFormat(), lines);
+	LineStatistics statisticsLines[2];
+	getLineStatistics(options, compressed.getFormat(), statisticsLines);
+	for (int y = first; y < last; ++y) {
+		std::uint16_t *row = mosaic.ptr<std::uint16_t>(y - first);
+		if (options.defects) {
+			options.defects->correctRow(y, 0, width, row);
+		}
+		if (options.normalize) {
+			normalize(row, width, lines[y & 1].black, lines[y & 1].multiplier);
+		}
+		addStatistics(statistics, statisticsLines, y, row, width);
+	}
+}
+
+void addRowStatistics(const RawFormat &format, const DecodeOptions &options, const cv::Mat &mosaic,
+                      int first, int begin, int end, FrameStatistics &statistics) {
+	LineStatistics statisticsLines[2];
+	getLineStatistics(options, format, statisticsLines);
+	for (int y = begin; y < end; ++y) {
+		addStatistics(&statistics, statisticsLines, y, mosaic.ptr<std::uint16_t>(y - first), mosaic.cols);
+	}
+}
+
+void unpackRegion(const std::uint8_t *packed, std::size_t size, const RawFormat &format, const DecodeOptions &options,
+                  const cv::Rect &region, cv::Mat &mosaic) {
+	checkRegion(region, format.width, format.height);
+
+	// the unpacking has to start and end at a group of pixels sharing the same bytes,
+	// which is at most 4 pixels for all packings, the rows consist of whole groups;
+	// one more group on each side provides the neighbours for the defect correction
+	const int begin = std::max((region.x & ~3) - 4, 0);
+	const int end = std::min<int>(((region.x + region.width + 3) & ~3) + 4, format.width);
+	const std::size_t rowBytes = format.getRowBytes();
+	const std::size_t offset = begin * format.bitsPerPixel / 8;
+	const UnpackFunction unpack = getUnpack(format.bitsPerPixel, format.byteOrder);
+
+	LineNormalization lines[2];
+	getLineNormalization(options.normalization, format, lines);
+
+	std::vector<std::uint16_t> row(end - begin);
+	for (int y = region.y; y < region.y + region.height; ++y) {
+		std::uint16_t *out = mosaic.ptr<std::uint16_t>(y - region.y);
+		// missing rows are treated as black
+		if ((y + 1) * rowBytes <= size) {
+			unpack(packed + y * rowBytes + offset, row.data(), row.size());
+			if (options.defects) {
+				options.defects->correctRow(y, begin, row.size(), row.data());
+			}
+			if (options.normalize) {
+				// the unpacked part starts at an even column
+				normalize(row.data(), row.size(), lines[y & 1].black, lines[y & 1].multiplier);
+			}
+			std::copy_n(row.begin() + (region.x - begin), region.width, out);
+		}
+		else {
+			std::fill(out, out + region.width, 0);
+		}
+	}
+}
+
+void unpackRegion(const CompressedRaw &compressed, const DecodeOptions &options, const cv::Rect &region, cv::Mat &mosaic) {
+	checkRegion(region, compressed.getFormat().width, compressed.getFormat().height);
+
+	// the strips are always decoded whole
+	cv::Mat rows(region.height, compressed.getFormat().width, CV_16UC1);
+	unpackRows(compressed, options, region.y, region.y + region.height, rows);
+	rows.colRange(region.x, region.x + region.width).copyTo(mosaic);
+}
+
+void binRows(const std::uint8_t *packed, std::size_t size, const RawFormat &format, const DecodeOptions &options,
+             int first, int last, cv::Mat &rgb, FrameStatistics *statistics) {
+	const std::size_t width = format.width;
+	const std::size_t rowBytes = format.getRowBytes();
+	const UnpackFunction unpack = getUnpack(format.bitsPerPixel, format.byteOrder);
+	const BinFunction bin = selectBinQuads(format.phase);
+
+	LineNormalization lines[2];
+	getLineNormalization(options.normalization, format, lines);
+	LineStatistics statisticsLines[2];
+	getLineStatistics(options, format, statisticsLines);
+
+	// the even and the odd row of a quad
+	std::vector<std::uint16_t> even(width);
+	std::vector<std::uint16_t> odd(width);
+	for (int y = first; y < last; ++y) {
+		// missing rows are treated as black
+		if ((2 * y + 2) * rowBytes <= size) {
+			unpack(packed + 2 * y * rowBytes, even.data(), width);
+			unpack(packed + (2 * y + 1) * rowBytes, odd.data(), width);
+			if (options.defects) {
+				options.defects->correctRow(2 * y, 0, width, even.data());
+				options.defects->correctRow(2 * y + 1, 0, width, odd.data());
+			}
+			if (options.normalize) {
+				normalize(even.data(), width, lines[0].black, lines[0].multiplier);
+				normalize(odd.data(), width, lines[1].black, lines[1].multiplier);
+			}
+		}
+		else {
+			std::fill(even.begin(), even.end(), 0);
+			std::fill(odd.begin(), odd.end(), 0);
+		}
+		addStatistics(statistics, statisticsLines, 0, even.data(), width);
+		addStatistics(statistics, statisticsLines, 1, odd.data(), width);
+
+		bin(even.data(), odd.data(), rgb.ptr<std::uint16_t>(y - first), width);
+	}
+}
+
+void binRows(const CompressedRaw &compressed, const DecodeOptions &options, int first, int last, cv::Mat &rgb,
+             FrameStatistics *statistics) {
+	const RawFormat &format = compressed.getFormat();
+	const BinFunction bin = selectBinQuads(format.phase);
+
+	cv::Mat mosaic(2 * (last - first), format.width, CV_16UC1);
+	unpackRows(compressed, options, 2 * first, 2 * last, mosaic, statistics);
+	binMosaic(mosaic, bin, rgb);
+}
+
+void binRegion(const std::uint8_t *packed, std::size_t size, const RawFormat &format, const DecodeOptions &options,
+               const cv::Rect &region, cv::Mat &rgb) {
+	cv::Mat mosaic(2 * region.height, 2 * region.width, CV_16UC1);
+	unpackRegion(packed, size, format, options, cv::Rect(2 * region.x, 2 * region.y, mosaic.cols, mosaic.rows), mosaic);
+	binMosaic(mosaic, selectBinQuads(format.phase), rgb);
+}
+
+void binRegion(const CompressedRaw &compressed, const DecodeOptions &options, const cv::Rect &region, cv::Mat &rgb) {
+	cv::Mat mosaic(2 * region.height, 2 * region.width, CV_16UC1);
+	unpackRegion(compressed, options, cv::Rect(2 * region.x, 2 * region.y, mosaic.cols, mosaic.rows), mosaic);
+	binMosaic(mosaic, selectBinQuads(compressed.getFormat().phase), rgb);
+}
+
+void checkDemosaicFormat(const RawFormat &format) {
+	if (format.phase != CfaPhase::BGGR) {
+		throw UnsupportedFormatException("only the BGGR bayer filter can be demosaiced");
+	}
+}
+
+void checkRegion(const cv::Rect &region, int width, int height) {
+	if (region.width <= 0 || region.height <= 0 || region.x < 0 || region.y < 0
+	    || region.x + region.width > width || region.y + region.height > height) {
+		std::stringstream ss;
+		ss << "the region " << region.width << "x" << region.height << " at " << region.x << ", " << region.y
+		   << " does not lie inside a " << width << "x" << height << " image";
+		throw InvalidRegionException(ss.str());
+	}
+}
+
+void checkDefectMap(const RawFormat &format, const DecodeOptions &options) {
+	if (options.defects && (options.defects->getWidth() != format.width || options.defects->getHeight() != format.height)) {
+		std::stringstream ss;
+		ss << "the defect map of a " << options.defects->getWidth() << "x" << options.defects->getHeight()
+		   << " sensor does not match a " << format.width << "x" << format.height << " image";
+		throw UnsupportedFormatException(ss.str());
+	}
+}
+
+std::shared_ptr<const DemosaicInterface> selectDemosaic(const DecodeOptions &options) {
+	if (options.demosaic) {
+		return options.demosaic;
+	}
+	return std::make_shared<BilinearDemosaic>();
+}
+
+}
+}
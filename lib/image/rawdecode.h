@@ -0,0 +1,193 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LYLI_IMAGE_RAWDECODE_H_
+#define LYLI_IMAGE_RAWDECODE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include <opencv2/core/core.hpp>
+
+/*
+ * Building blocks shared by the RAW decoders.
+ *
+ * The functions work on a contiguous range of rows, so that the callers
+ * can decide how to split the image between tasks.
+ */
+
+namespace Lyli {
+namespace Image {
+
+class CompressedRaw;
+class DemosaicInterface;
+class FrameStatistics;
+struct DecodeOptions;
+struct RawFormat;
+
+/** Unpack rows of the mosaic.
+ *
+ * Rows that are missing in the data are treated as black.
+ *
+ * \param packed the contents of a .RAW file
+ * \param size size of the data in bytes
+ * \param format layout of the data, must be valid
+ * \param options decoding options, the defects are corrected and the normalization is applied if requested
+ * \param first the first row to unpack
+ * \param last one past the last row to unpack
+ * \param mosaic output uint16_t rows, the row first is stored in the row 0
+ * \param statistics if not null, the unpacked pixels are added to the statistics
+ */
+void unpackRows(const std::uint8_t *packed, std::size_t size, const RawFormat &format, const DecodeOptions &options,
+                int first, int last, cv::Mat &mosaic, FrameStatistics *statistics = nullptr);
+
+/** Decode rows of a compressed mosaic.
+ *
+ * \param compressed the compressed image
+ * \param options decoding options, the defects are corrected and the normalization is applied if requested
+ * \param first the first row to decode
+ * \param last one past the last row to decode
+ * \param mosaic output uint16_t rows, the row first is stored in the row 0
+ * \param statistics if not null, the unpacked pixels are added to the statistics
+ */
+void unpackRows(const CompressedRaw &compressed, const DecodeOptions &options, int first, int last, cv::Mat &mosaic,
+                FrameStatistics *statistics = nullptr);
+
+/** Add unpacked rows of the mosaic to the statistics.
+ *
+ * Used when the unpacked rows overlap, so that every row is added only once.
+ *
+ * \param format layout of the data, must be valid
+ * \param options the decoding options used to unpack the rows
+ * \param mosaic uint16_t rows unpacked by unpackRows()
+ * \param first the row stored in the row 0 of the mosaic
+ * \param begin the first row to add
+ * \param end one past the last row to add
+ * \param statistics the statistics to add the rows to
+ */
+void addRowStatistics(const RawFormat &format, const DecodeOptions &options, const cv::Mat &mosaic,
+                      int first, int begin, int end, FrameStatistics &statistics);
+
+/** Unpack a rectangular part of the mosaic.
+ *
+ * Only the bytes of the region are read from each row, so the cost depends
+ * on the size of the region rather than on the size of the image.
+ *
+ * \param packed the contents of a .RAW file
+ * \param size size of the data in bytes
+ * \param format layout of the data, must be valid
+ * \param options decoding options, the defects are corrected and the normalization is applied if requested
+ * \param region the part of the mosaic to unpack, must lie inside the mosaic
+ * \param mosaic output uint16_t pixels, the pixel region.tl() is stored at (0, 0)
+ * \throw InvalidRegionException when the region does not lie inside the mosaic
+ */
+void unpackRegion(const std::uint8_t *packed, std::size_t size, const RawFormat &format, const DecodeOptions &options,
+                  const cv::Rect &region, cv::Mat &mosaic);
+
+/** Decode a rectangular part of a compressed mosaic.
+ *
+ * Only the strips containing the rows of the region are decoded.
+ *
+ * \param compressed the compressed image
+ * \param options decoding options, the defects are corrected and the normalization is applied if requested
+ * \param region the part of the mosaic to decode, must lie inside the mosaic
+ * \param mosaic output uint16_t pixels, the pixel region.tl() is stored at (0, 0)
+ * \throw InvalidRegionException when the region does not lie inside the mosaic
+ */
+void unpackRegion(const CompressedRaw &compressed, const DecodeOptions &options, const cv::Rect &region, cv::Mat &mosaic);
+
+/** Bin the bayer quads of rows of a half size image.
+ *
+ * \param packed the contents of a .RAW file
+ * \param size size of the data in bytes
+ * \param format layout of the data, must be valid
+ * \param options decoding options, the defects are corrected and the normalization is applied if requested
+ * \param first the first row of the half size image
+ * \param last one past the last row of the half size image
+ * \param rgb output RGB uint16_t rows, the row first is stored in the row 0
+ * \param statistics if not null, the unpacked pixels of the mosaic are added to the statistics
+ */
+void binRows(const std::uint8_t *packed, std::size_t size, const RawFormat &format, const DecodeOptions &options,
+             int first, int last, cv::Mat &rgb, FrameStatistics *statistics = nullptr);
+
+/** Bin the bayer quads of rows of a half size image decoded from a compressed mosaic.
+ *
+ * \param compressed the compressed image
+ * \param options decoding options, the defects are corrected and the normalization is applied if requested
+ * \param first the first row of the half size image
+ * \param last one past the last row of the half size image
+ * \param rgb output RGB uint16_t rows, the row first is stored in the row 0
+ * \param statistics if not null, the unpacked pixels of the mosaic are added to the statistics
+ */
+void binRows(const CompressedRaw &compressed, const DecodeOptions &options, int first, int last, cv::Mat &rgb,
+             FrameStatistics *statistics = nullptr);
+
+/** Bin the bayer quads of a rectangular part of a half size image.
+ *
+ * \param packed the contents of a .RAW file
+ * \param size size of the data in bytes
+ * \param format layout of the data, must be valid
+ * \param options decoding options, the defects are corrected and the normalization is applied if requested
+ * \param region the part of the half size image, must lie inside the image
+ * \param rgb output RGB uint16_t pixels, the pixel region.tl() is stored at (0, 0)
+ * \throw InvalidRegionException when the region does not lie inside the image
+ */
+void binRegion(const std::uint8_t *packed, std::size_t size, const RawFormat &format, const DecodeOptions &options,
+               const cv::Rect &region, cv::Mat &rgb);
+
+/** Bin the bayer quads of a rectangular part of a half size image decoded from a compressed mosaic.
+ *
+ * \param compressed the compressed image
+ * \param options decoding options, the defects are corrected and the normalization is applied if requested
+ * \param region the part of the half size image, must lie inside the image
+ * \param rgb output RGB uint16_t pixels, the pixel region.tl() is stored at (0, 0)
+ * \throw InvalidRegionException when the region does not lie inside the image
+ */
+void binRegion(const CompressedRaw &compressed, const DecodeOptions &options, const cv::Rect &region, cv::Mat &rgb);
+
+/** Check that the mosaic of the format can be demosaiced.
+ *
+ * The demosaic algorithms expect the bayer filter of the Lytro camera, ie. the BGGR phase.
+ *
+ * \throw UnsupportedFormatException when the mosaic cannot be demosaiced
+ */
+void checkDemosaicFormat(const RawFormat &format);
+
+/** Check that a region lies inside an image.
+ *
+ * \param region the region to check
+ * \param width width of the image
+ * \param height height of the image
+ * \throw InvalidRegionException when the region is empty or exceeds the image
+ */
+void checkRegion(const cv::Rect &region, int width, int height);
+
+/** Check that the defect map in the options, if any, matches the format.
+ *
+ * \throw UnsupportedFormatException when the size of the defect map differs
+ */
+void checkDefectMap(const RawFormat &format, const DecodeOptions &options);
+
+/** Get the demosaic algorithm selected in the options, bilinear by default.
+ */
+std::shared_ptr<const DemosaicInterface> selectDemosaic(const DecodeOptions &options);
+
+}
+}
+
+#endif
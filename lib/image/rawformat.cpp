@@ -0,0 +1,127 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rawformat.h"
+
+#include <sstream>
+
+#include "metadata.h"
+
+namespace {
+
+using Lyli::Image::ByteOrder;
+using Lyli::Image::CfaPhase;
+using Lyli::Image::UnsupportedFormatException;
+
+ByteOrder parseByteOrder(const std::string &endianness) {
+	if (endianness == "big") {
+		return ByteOrder::BIG;
+	}
+	if (endianness == "little") {
+		return ByteOrder::LITTLE;
+	}
+	throw UnsupportedFormatException("unsupported endianness: " + endianness);
+}
+
+CfaPhase parsePhase(const std::string &upperLeftPixel) {
+	if (upperLeftPixel == "b") {
+		return CfaPhase::BGGR;
+	}
+	if (upperLeftPixel == "gb") {
+		return CfaPhase::GBRG;
+	}
+	if (upperLeftPixel == "gr") {
+		return CfaPhase::GRBG;
+	}
+	if (upperLeftPixel == "r") {
+		return CfaPhase::RGGB;
+	}
+	throw UnsupportedFormatException("unsupported upper left pixel of the mosaic: " + upperLeftPixel);
+}
+
+}
+
+namespace Lyli {
+namespace Image {
+
+UnsupportedFormatException::UnsupportedFormatException(const std::string& reason) : m_reason(reason) {
+
+}
+
+UnsupportedFormatException::~UnsupportedFormatException() {
+
+}
+
+const char* UnsupportedFormatException::what() const noexcept {
+	return m_reason.c_str();
+}
+
+InvalidRegionException::InvalidRegionException(const std::string& reason) : m_reason(reason) {
+
+}
+
+InvalidRegionException::~InvalidRegionException() {
+
+}
+
+const char* InvalidRegionException::what() const noexcept {
+	return m_reason.c_str();
+}
+
+RawFormat::RawFormat() :
+	width(3280), height(3280), bitsPerPixel(12), byteOrder(ByteOrder::BIG), phase(CfaPhase::BGGR) {
+
+}
+
+RawFormat::RawFormat(const Metadata &metadata) {
+	const Metadata::Image image(metadata.getImage());
+	const Metadata::Image::Rawdetails rawdetails(image.getRawdetails());
+	const Metadata::Image::Rawdetails::Pixelpacking pixelpacking(rawdetails.getPixelpacking());
+
+	width = image.getWidth();
+	height = image.getHeight();
+	bitsPerPixel = pixelpacking.getBitsperpixel();
+	byteOrder = parseByteOrder(pixelpacking.getEndianness());
+	phase = parsePhase(rawdetails.getMosaic().getUpperleftpixel());
+
+	validate();
+}
+
+std::size_t RawFormat::getRowBytes() const {
+	return width * bitsPerPixel / 8;
+}
+
+std::size_t RawFormat::getFrameBytes() const {
+	return getRowBytes() * height;
+}
+
+void RawFormat::validate() const {
+	if (bitsPerPixel != 10 && bitsPerPixel != 12 && bitsPerPixel != 14) {
+		std::stringstream ss;
+		ss << "unsupported number of bits per pixel: " << bitsPerPixel;
+		throw UnsupportedFormatException(ss.str());
+	}
+	// the rows have to consist of whole pairs of the bayer filter and whole groups of packed pixels
+	if (width == 0 || height == 0 || width % 2 != 0 || (width * bitsPerPixel) % 8 != 0) {
+		std::stringstream ss;
+		ss << "unsupported image size " << width << "x" << height << " with " << bitsPerPixel << " bits per pixel";
+		throw UnsupportedFormatException(ss.str());
+	}
+}
+
+}
+}
@@ -0,0 +1,119 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LYLI_IMAGE_RAWFORMAT_H_
+#define LYLI_IMAGE_RAWFORMAT_H_
+
+#include <cstddef>
+#include <string>
+
+#include <image/exception.h>
+
+namespace Lyli {
+namespace Image {
+
+class Metadata;
+
+class UnsupportedFormatException : public Exception {
+public:
+	explicit UnsupportedFormatException(const std::string& reason);
+	virtual ~UnsupportedFormatException();
+
+	virtual const char* what() const noexcept;
+
+private:
+	std::string m_reason;
+};
+
+class InvalidRegionException : public Exception {
+public:
+	explicit InvalidRegionException(const std::string& reason);
+	virtual ~InvalidRegionException();
+
+	virtual const char* what() const noexcept;
+
+private:
+	std::string m_reason;
+};
+
+/** Arrangement of the bayer filter.
+ *
+ * The name lists the colors of the two top left pixels in the first row
+ * followed by the two pixels in the second row.
+ */
+enum class CfaPhase {
+	BGGR,
+	GBRG,
+	GRBG,
+	RGGB
+};
+
+/** Order of the bits in the packed pixels.
+ */
+enum class ByteOrder {
+	/** The pixels are a stream of bits, each starting with the most significant bit. */
+	BIG,
+	/** The MIPI packing, the most significant byte of each pixel in a group
+	 * is followed by the remaining low bits of all the pixels in the group. */
+	LITTLE
+};
+
+/** Layout of the data in a RAW file.
+ */
+struct RawFormat {
+	/** Construct the format of the first generation Lytro camera.
+	 */
+	RawFormat();
+
+	/** Construct the format described by the image metadata.
+	 *
+	 * Uses the image size, the pixel packing and the mosaic description.
+	 *
+	 * \throw UnsupportedFormatException when the format cannot be decoded
+	 */
+	explicit RawFormat(const Metadata &metadata);
+
+	/** Get size of a single packed row.
+	 */
+	std::size_t getRowBytes() const;
+
+	/** Get size of the whole packed image.
+	 */
+	std::size_t getFrameBytes() const;
+
+	/** Check whether the format can be decoded.
+	 *
+	 * \throw UnsupportedFormatException when the format cannot be decoded
+	 */
+	void validate() const;
+
+	/** width of the image in pixels */
+	std::size_t width;
+	/** height of the image in pixels */
+	std::size_t height;
+	/** number of bits of a packed pixel, 10, 12 and 14 bits are supported */
+	int bitsPerPixel;
+	/** order of the bits in the packed data */
+	ByteOrder byteOrder;
+	/** the arrangement of the bayer filter */
+	CfaPhase phase;
+};
+
+}
+}
+
+#endif
@@ -17,147 +17,316 @@
 
 #include "rawimage.h"
 
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+#include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+#include <tbb/partitioner.h>
+
+#include "banddecoder.h"
+#include "demosaic.h"
+#include "framebufferpool.h"
+#include "mappedfile.h"
+#include "metadata.h"
+#include "parallel.h"
+#include "rawcodec.h"
+#include "rawdecode.h"
+#include "readahead.h"
+
 namespace {
 
-/** Return the index of a color corresponding to the value in bayer filter.
- *
- * The function takes an x,y position in the image as the input and returns
- * the color that is stored at that position.
- *
- * @return 0 - red, 1 - green, 2 - blue
+/**
+ * Merge the statistics gathered by the threads.
  */
-std::size_t getColorIndex(std::size_t x, std::size_t y) {
-	if ((y & 1) != 0) {
-		// even lines - red/green
-		if ((x & 1) != 0) {
-			return 0;
-		}
-		else {
-			return 1;
+Lyli::Image::FrameStatistics mergeStatistics(const tbb::enumerable_thread_specific<Lyli::Image::FrameStatistics> &statistics) {
+	Lyli::Image::FrameStatistics result;
+	for (const auto &local : statistics) {
+		result.merge(local);
+	}
+	return result;
+}
+
+}
+
+namespace Lyli {
+namespace Image {
+
+Normalization::Normalization() :
+	black{0, 0, 0, 0}, white{0, 0, 0, 0}, gain{1.0f, 1.0f, 1.0f, 1.0f} {
+
+}
+
+Normalization::Normalization(const Metadata &metadata) {
+	const Metadata::Image::Rawdetails::Pixelformat pixelformat(metadata.getImage().getRawdetails().getPixelformat());
+	const Metadata::Image::Rawdetails::Pixelformat::Black blackLevels(pixelformat.getBlack());
+	const Metadata::Image::Rawdetails::Pixelformat::White whiteLevels(pixelformat.getWhite());
+	const Metadata::Image::Color::Whitebalancegain gains(metadata.getImage().getColor().getWhitebalancegain());
+
+	black[0] = blackLevels.getR();
+	black[1] = blackLevels.getGr();
+	black[2] = blackLevels.getGb();
+	black[3] = blackLevels.getB();
+	white[0] = whiteLevels.getR();
+	white[1] = whiteLevels.getGr();
+	white[2] = whiteLevels.getGb();
+	white[3] = whiteLevels.getB();
+	gain[0] = gains.getR();
+	gain[1] = gains.getGr();
+	gain[2] = gains.getGb();
+	gain[3] = gains.getB();
+}
+
+RawImage::RawImage(std::istream& is, const RawFormat &format, const DecodeOptions &options) :
+	m_format(format), m_storage(options.storage), m_demosaic(selectDemosaic(options)) {
+	// the compressed data are recognized by their header
+	std::vector<std::uint8_t> data(CompressedRaw::HEADER_SIZE);
+	is.read(reinterpret_cast<char*>(data.data()), data.size());
+	data.resize(is.gcount());
+
+	if (CompressedRaw::isCompressed(data.data(), data.size())) {
+		// the size of the compressed data is not known in advance
+		std::size_t size = data.size();
+		while (is.good()) {
+			data.resize(size + (1 << 20));
+			is.read(reinterpret_cast<char*>(data.data() + size), data.size() - size);
+			size += is.gcount();
 		}
+		data.resize(size);
 	}
 	else {
-		// odd lines - blue/green
-		if ((x & 1) != 0) {
-			return 1;
-		}
-		else {
-			return 2;
-		}
+		// read the rest of the packed frame at once
+		m_format.validate();
+		const std::size_t size = data.size();
+		data.resize(std::max(size, m_format.getFrameBytes()));
+		is.read(reinterpret_cast<char*>(data.data() + size), data.size() - size);
 	}
+
+	load(data.data(), data.size(), options);
 }
 
-uint16_t bilinearInterpolation(double f00, double f01, double f10, double f11) {
-	double a = 0.5 * (f00 + f10);
-	double b = 0.5 * (f01 + f11);
-	return 0.5 * (a + b);
+RawImage::RawImage(const std::uint8_t *data, std::size_t size, const RawFormat &format, const DecodeOptions &options) :
+	m_format(format), m_storage(options.storage), m_demosaic(selectDemosaic(options)) {
+	load(data, size, options);
 }
 
-uint16_t avgInterpolation(double f00, double f01, double f10, double f11) {
-	return 0.25 * (f00 + f01 + f10 + f11);
+RawImage RawImage::fromFile(const std::string &path, const RawFormat &format, const DecodeOptions &options) {
+	MappedFile file(path);
+	if (!CompressedRaw::isCompressed(file.getData(), file.getSize()) && file.getSize() < format.getFrameBytes()) {
+		std::stringstream ss;
+		ss << path << " is too short for a " << format.width << "x" << format.height << " image";
+		throw FileAccessException(ss.str());
+	}
+	return RawImage(file.getData(), file.getSize(), format, options);
 }
 
+RawImage RawImage::fromBuffer(const FileBuffer &buffer, const RawFormat &format, const DecodeOptions &options) {
+	if (!CompressedRaw::isCompressed(buffer.getData(), buffer.getSize()) && buffer.getSize() < format.getFrameBytes()) {
+		std::stringstream ss;
+		ss << buffer.getPath() << " is too short for a " << format.width << "x" << format.height << " image";
+		throw FileAccessException(ss.str());
+	}
+	return RawImage(buffer.getData(), buffer.getSize(), format, options);
 }
 
-namespace Lyli {
-namespace Image {
+const RawFormat &RawImage::getFormat() const {
+	return m_format;
+}
 
-RawImage::RawImage(std::istream& is, std::size_t width, std::size_t height) :
-	m_data(height, width, CV_16UC3) {
-	unsigned char buf[3];
-	std::uint16_t tmp;
-	std::size_t pos(0);
-
-	uint16_t *data = reinterpret_cast<uint16_t*>(m_data.data);
-	for (std::size_t y = 0; y < height; ++y) {
-		// this assumes that the x-dimension has even number of pixels
-		// so two pixels can be read at once
-		for (std::size_t x = 0; x < width;) {
-			is.read(reinterpret_cast<char*>(buf), 3);
-
-			// mask out the first twelve bits
-			// the data are stored as big endian, so we have to fix that, too
-			tmp = (buf[0] << 8) | (buf[1] & 0xF0);
-			data[pos + getColorIndex(x, y)] = tmp;
-			pos += 3;
-			++x;
-
-			// the second 12b
-			tmp = ((buf[1] & 0xF) << 12) | (buf[2] << 4);
-			data[pos + getColorIndex(x, y)] = tmp;
-			pos += 3;
-			++x;
-		}
-	}
+int RawImage::getWidth() const {
+	return m_mosaic.empty() ? m_format.width / 2 : m_format.width;
+}
+
+int RawImage::getHeight() const {
+	return m_mosaic.empty() ? m_format.height / 2 : m_format.height;
+}
+
+PixelStorage RawImage::getStorage() const {
+	return m_storage;
+}
+
+const cv::Mat &RawImage::getMosaic() const {
+	return m_mosaic;
+}
 
-	demosaic();
+const FrameStatistics &RawImage::getStatistics() const {
+	return m_statistics;
 }
 
 const cv::Mat &RawImage::getData() const {
+	if (m_data.empty() && !m_mosaic.empty()) {
+		if (m_storage == PixelStorage::UINT16) {
+			m_data = demosaic(cv::Rect(0, 0, m_mosaic.cols, m_mosaic.rows));
+		}
+		else {
+			// demosaic by bands, so that the full precision image is never stored
+			checkDemosaicFormat(m_format);
+			createStorage(m_data, m_mosaic.rows, m_mosaic.cols, m_storage);
+			const std::size_t bandRows = getBandRows(m_mosaic.cols * 3 * sizeof(std::uint16_t));
+			tbb::parallel_for(tbb::blocked_range<int>(0, m_mosaic.rows, bandRows), [&](const tbb::blocked_range<int> &band) {
+				const cv::Mat rgb(m_demosaic->demosaic(m_mosaic, cv::Rect(0, band.begin(), m_mosaic.cols, band.size())));
+				cv::Mat rows(m_data.rowRange(band.begin(), band.end()));
+				storeRows(rgb, rows, m_storage);
+			}, tbb::simple_partitioner());
+		}
+	}
 	return m_data;
 }
 
-// simple bilinear interpolation
-void RawImage::demosaic() {
-	uint16_t *data = reinterpret_cast<uint16_t*>(m_data.data);
-	const int Y_OFF = m_data.cols * 3; // the offset used when adding (or subtracting) 1 to y-dimension
-	const int X_OFF = 3; // // the offset used when adding (or subtracting) 1 to x-dimension
-	// bounds, the -1 is required as the computation use 1px neighborhood
-	const int ROW_MAX = m_data.rows - 1;
-	const int COL_MAX = m_data.cols - 1;
-	// temp variables for keeping position
-	int x, y, pos;
-	// red lines and blue stripes
-	for (y = 1; y < ROW_MAX; y += 2) {
-		for (x = 2; x < COL_MAX; x += 2) {
-			pos = (y * m_data.cols + x) * 3;
-			// red line
-			data[pos] = 0.5 * (data[pos - X_OFF]+ data[pos + X_OFF]);
-			// blue stripe
-			data[pos+2] = 0.5 * (data[pos - Y_OFF + 2] + data[pos + Y_OFF + 2]);
+cv::Mat RawImage::demosaic(const cv::Rect &region) const {
+	// half size images are already RGB
+	if (m_mosaic.empty()) {
+		if (m_storage == PixelStorage::UINT16) {
+			return m_data(region).clone();
 		}
+		// the packed rows cannot be split by columns
+		const cv::Mat rows(loadRows(m_data.rowRange(region.y, region.y + region.height), getWidth(), m_storage));
+		return rows.colRange(region.x, region.x + region.width).clone();
 	}
-	// blue lines and red stripes
-	for (y = 2; y < ROW_MAX; y += 2) {
-		for (x = 1; x < COL_MAX; x += 2) {
-			pos = (y * m_data.cols + x) * 3;
-			// red stripe
-			data[pos] = 0.5 * (data[pos - Y_OFF] + data[pos + Y_OFF]);
-			// blue line
-			data[pos + 2] = 0.5 * (data[pos - X_OFF + 2] + data[pos + X_OFF + 2]);
+
+	checkDemosaicFormat(m_format);
+	return m_demosaic->demosaic(m_mosaic, region);
+}
+
+cv::Mat RawImage::getLuminance() const {
+	return getLuminance(cv::Rect(0, 0, getWidth(), getHeight()));
+}
+
+cv::Mat RawImage::getLuminance(const cv::Rect &region) const {
+	// half size images are already RGB
+	if (m_mosaic.empty()) {
+		cv::Mat result;
+		FrameBufferPool::getDefault().create(result, region.height, region.width, CV_8UC1);
+		if (m_storage == PixelStorage::UINT16) {
+			tbb::parallel_for(0, region.height, [&](int y) {
+				rgbToLuminance(m_data.ptr<std::uint16_t>(region.y + y) + 3 * region.x, result.ptr<std::uint8_t>(y), region.width);
+			});
 		}
-	}
-	// red middle, green #1
-	for (y = 2; y < ROW_MAX; y += 2) {
-		for (x = 2; x < COL_MAX; x += 2) {
-			pos = (y * m_data.cols + x) * 3;
-			data[pos] = bilinearInterpolation(data[pos - X_OFF + Y_OFF], data[pos - X_OFF - Y_OFF],
-			                                  data[pos + X_OFF + Y_OFF], data[pos + X_OFF - Y_OFF]);
-			data[pos + 1] = avgInterpolation(data[pos - X_OFF + 1], data[pos + X_OFF + 1],
-			                                 data[pos - Y_OFF + 1], data[pos + Y_OFF + 1]);
+		else {
+			tbb::enumerable_thread_specific<std::vector<std::uint16_t>> rows;
+			tbb::parallel_for(0, region.height, [&](int y) {
+				std::vector<std::uint16_t> &row = rows.local();
+				row.resize(3 * getWidth());
+				loadRow(m_data.ptr<std::uint8_t>(region.y + y), row.data(), getWidth(), m_storage);
+				rgbToLuminance(row.data() + 3 * region.x, result.ptr<std::uint8_t>(y), region.width);
+			});
 		}
+		return result;
 	}
-	// blue middle, green #2
-	for (y = 1; y < ROW_MAX; y += 2) {
-		for (x = 1; x < COL_MAX; x += 2) {
-			pos = (y * m_data.cols + x) * 3;
-			data[pos + 2] = bilinearInterpolation(data[pos - X_OFF + Y_OFF + 2], data[pos - X_OFF - Y_OFF + 2],
-			                                      data[pos + X_OFF + Y_OFF + 2], data[pos + X_OFF - Y_OFF + 2]);
-			data[pos + 1] = avgInterpolation(data[pos - X_OFF + 1], data[pos + X_OFF + 1],
-			                                 data[pos - Y_OFF + 1], data[pos + Y_OFF + 1]);
+
+	checkDemosaicFormat(m_format);
+	return m_demosaic->luminance(m_mosaic, region);
+}
+
+cv::Mat RawImage::decodeRegion(const std::uint8_t *data, std::size_t size, const RawFormat &format,
+                               const cv::Rect &region, const DecodeOptions &options) {
+	return BandDecoder(data, size, format, options).decodeRegion(region);
+}
+
+cv::Mat RawImage::decodeRegionLuminance(const std::uint8_t *data, std::size_t size, const RawFormat &format,
+                                        const cv::Rect &region, const DecodeOptions &options) {
+	return BandDecoder(data, size, format, options).decodeRegionLuminance(region);
+}
+
+void RawImage::load(const std::uint8_t *data, std::size_t size, const DecodeOptions &options) {
+	if (CompressedRaw::isCompressed(data, size)) {
+		const CompressedRaw compressed(data, size);
+		m_format = compressed.getFormat();
+		checkDefectMap(m_format, options);
+		if (options.halfSize) {
+			decodeHalfSize(compressed, options);
+		}
+		else {
+			decode(compressed, options);
 		}
+		return;
 	}
 
-	// and now borders!
-	// actually use a braindead solution - just extend the first valid row/col to the border
-	// top
-	m_data.row(1).copyTo(m_data.row(0));
-	// bottom
-	m_data.row(ROW_MAX - 1).copyTo(m_data.row(ROW_MAX));
-	// left
-	m_data.col(1).copyTo(m_data.col(0));
-	// right
-	m_data.col(COL_MAX - 1).copyTo(m_data.col(COL_MAX));
+	m_format.validate();
+	checkDefectMap(m_format, options);
+	if (options.halfSize) {
+		decodeHalfSize(data, size, options);
+	}
+	else {
+		decode(data, size, options);
+	}
+}
+
+void RawImage::decode(const std::uint8_t *packed, std::size_t size, const DecodeOptions &options) {
+	const std::size_t width = m_format.width;
+	FrameBufferPool::getDefault().create(m_mosaic, m_format.height, width, CV_16UC1);
+
+	const std::size_t bandRows = getBandRows(m_format.getRowBytes() + width * sizeof(std::uint16_t));
+	tbb::enumerable_thread_specific<FrameStatistics> statistics;
+	tbb::parallel_for(tbb::blocked_range<int>(0, m_format.height, bandRows), [&](const tbb::blocked_range<int> &band) {
+		cv::Mat rows(m_mosaic.rowRange(band.begin(), band.end()));
+		unpackRows(packed, size, m_format, options, band.begin(), band.end(), rows,
+		           options.statistics ? &statistics.local() : nullptr);
+	}, tbb::simple_partitioner());
+	m_statistics = mergeStatistics(statistics);
+}
+
+void RawImage::decodeHalfSize(const std::uint8_t *packed, std::size_t size, const DecodeOptions &options) {
+	const std::size_t width = m_format.width;
+	createStorage(m_data, m_format.height / 2, width / 2, m_storage);
+
+	const std::size_t bandRows = getBandRows(2 * m_format.getRowBytes() + width * 3 * sizeof(std::uint16_t) / 2);
+	tbb::enumerable_thread_specific<FrameStatistics> statistics;
+	tbb::parallel_for(tbb::blocked_range<int>(0, m_data.rows, bandRows), [&](const tbb::blocked_range<int> &band) {
+		cv::Mat rows(m_data.rowRange(band.begin(), band.end()));
+		if (m_storage == PixelStorage::UINT16) {
+			binRows(packed, size, m_format, options, band.begin(), band.end(), rows,
+			        options.statistics ? &statistics.local() : nullptr);
+		}
+		else {
+			cv::Mat rgb(band.size(), width / 2, CV_16UC3);
+			binRows(packed, size, m_format, options, band.begin(), band.end(), rgb,
+			        options.statistics ? &statistics.local() : nullptr);
+			storeRows(rgb, rows, m_storage);
+		}
+	}, tbb::simple_partitioner());
+	m_statistics = mergeStatistics(statistics);
+}
+
+void RawImage::decode(const CompressedRaw &compressed, const DecodeOptions &options) {
+	FrameBufferPool::getDefault().create(m_mosaic, m_format.height, m_format.width, CV_16UC1);
+
+	// the bands follow the independently compressed strips
+	const int stripRows = compressed.getStripRows();
+	tbb::enumerable_thread_specific<FrameStatistics> statistics;
+	tbb::parallel_for(std::size_t(0), compressed.getStripCount(), [&](std::size_t strip) {
+		const int first = strip * stripRows;
+		const int last = std::min<int>(first + stripRows, m_format.height);
+		cv::Mat rows(m_mosaic.rowRange(first, last));
+		unpackRows(compressed, options, first, last, rows, options.statistics ? &statistics.local() : nullptr);
+	});
+	m_statistics = mergeStatistics(statistics);
+}
+
+void RawImage::decodeHalfSize(const CompressedRaw &compressed, const DecodeOptions &options) {
+	createStorage(m_data, m_format.height / 2, m_format.width / 2, m_storage);
+
+	// the strips have an even number of rows, so each of them is binned separately
+	const int stripRows = compressed.getStripRows() / 2;
+	tbb::enumerable_thread_specific<FrameStatistics> statistics;
+	tbb::parallel_for(std::size_t(0), compressed.getStripCount(), [&](std::size_t strip) {
+		const int first = strip * stripRows;
+		const int last = std::min<int>(first + stripRows, m_data.rows);
+		if (first < last) {
+			cv::Mat rows(m_data.rowRange(first, last));
+			if (m_storage == PixelStorage::UINT16) {
+				binRows(compressed, options, first, last, rows, options.statistics ? &statistics.local() : nullptr);
+			}
+			else {
+				cv::Mat rgb(last - first, m_format.width / 2, CV_16UC3);
+				binRows(compressed, options, first, last, rgb, options.statistics ? &statistics.local() : nullptr);
+				storeRows(rgb, rows, m_storage);
+			}
+		}
+	});
+	m_statistics = mergeStatistics(statistics);
 }
 
 }
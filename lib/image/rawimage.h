@@ -23,31 +23,281 @@
 #include <cstddef>
 #include <cstdint>
 #include <iostream>
+#include <memory>
+#include <string>
+
+#include <image/framestatistics.h>
+#include <image/pixelstorage.h>
+#include <image/rawformat.h>
 
 namespace Lyli {
 namespace Image {
 
+class CompressedRaw;
+class DefectMap;
+class DemosaicInterface;
+class FileBuffer;
+class Metadata;
+
+/** Radiometric normalization of the sensor data.
+ *
+ * All arrays are indexed by the bayer channel in the order R, Gr, Gb, B,
+ * where Gr is the green pixel in the red lines and Gb the green pixel in the blue lines.
+ * The normalized pixel is (pixel - black) / (white - black) * gain scaled to 16 bits.
+ */
+struct Normalization {
+	/** Construct an identity normalization of the whole range of the sensor data.
+	 *
+	 * The white levels are left unset, so they follow the bits per pixel of the decoded format.
+	 */
+	Normalization();
+
+	/** Construct the normalization using the image metadata.
+	 *
+	 * Uses the black and white levels from the raw details and
+	 * the white balance gains from the color section.
+	 */
+	explicit Normalization(const Metadata &metadata);
+
+	/** black levels in sensor units */
+	int black[4];
+	/** white levels in sensor units, 0 stands for the largest value of the format */
+	int white[4];
+	/** white balance gains, must be less than 16 */
+	float gain[4];
+};
+
+/** Options controlling how the RAW data are decoded.
+ */
+struct DecodeOptions {
+	/**
+	 * Bin each 2x2 quad of the bayer filter into a single RGB pixel.
+	 *
+	 * The resulting image has half the width and height of the sensor, it is
+	 * meant for previews. No mosaic is stored in this mode.
+	 */
+	bool halfSize = false;
+
+	/**
+	 * Apply the normalization to the data while unpacking.
+	 */
+	bool normalize = false;
+
+	/** The normalization to use when normalize is set. */
+	Normalization normalization;
+
+	/**
+	 * The algorithm used to demosaic the image, BilinearDemosaic is used when not set.
+	 */
+	std::shared_ptr<const DemosaicInterface> demosaic;
+
+	/**
+	 * The defective pixels replaced while unpacking, none when not set.
+	 *
+	 * The map has to have the same size as the decoded image.
+	 */
+	std::shared_ptr<const DefectMap> defects;
+
+	/**
+	 * Gather the statistics of the mosaic while unpacking, see RawImage::getStatistics()
+	 * and BandDecoder::decode().
+	 */
+	bool statistics = false;
+
+	/**
+	 * Precision of the RGB image returned by RawImage::getData().
+	 *
+	 * The pixels are converted to the storage while demosaicing or binning,
+	 * the mosaic itself always uses uint16_t pixels.
+	 */
+	PixelStorage storage = PixelStorage::UINT16;
+};
+
 /** A class providing a simple interface for accessing the Lytro RAW images.
  *
+ * The image is stored as the single channel bayer mosaic read from the sensor.
+ * The RGB image is demosaiced only when it is requested for the first time.
+ * As the demosaiced image is cached, the getData() is not thread safe.
+ *
+ * Both the .RAW files and the files compressed by compressRaw() are accepted.
+ * The format stored in the compressed files is used instead of the given one.
  */
 class RawImage {
 public:
 	/** Construct the image.
 	 *
 	 * \param is input stream to the opened .RAW file
+	 * \param format layout of the data
+	 * \param options decoding options
+	 * \throw UnsupportedFormatException when the format cannot be decoded
 	 */
-	RawImage(std::istream &is, std::size_t width, std::size_t height);
+	RawImage(std::istream &is, const RawFormat &format, const DecodeOptions &options = DecodeOptions());
+
+	/** Construct the image from packed data in memory.
+	 *
+	 * \param data the contents of a .RAW file or of a compressed file
+	 * \param size size of the data in bytes
+	 * \param format layout of the data
+	 * \param options decoding options
+	 * \throw UnsupportedFormatException when the format cannot be decoded
+	 */
+	RawImage(const std::uint8_t *data, std::size_t size, const RawFormat &format,
+	         const DecodeOptions &options = DecodeOptions());
+
+	/** Load the image from a file.
+	 *
+	 * The file is memory mapped and decoded directly from the mapping,
+	 * which avoids copying the data through a stream buffer.
+	 *
+	 * \param path path to the .RAW file
+	 * \param format layout of the data
+	 * \param options decoding options
+	 * \throw FileAccessException when the file cannot be read or is too short
+	 * \throw UnsupportedFormatException when the format cannot be decoded
+	 */
+	static RawImage fromFile(const std::string &path, const RawFormat &format,
+	                         const DecodeOptions &options = DecodeOptions());
+
+	/** Decode a file that was read into memory.
+	 *
+	 * \param buffer contents of the .RAW file
+	 * \param format layout of the data
+	 * \param options decoding options
+	 * \throw FileAccessException when the file is too short
+	 * \throw UnsupportedFormatException when the format cannot be decoded
+	 */
+	static RawImage fromBuffer(const FileBuffer &buffer, const RawFormat &format,
+	                           const DecodeOptions &options = DecodeOptions());
+
+	/** Get the format of the decoded data.
+	 */
+	const RawFormat &getFormat() const;
+
+	/** Get width of the RGB image in pixels.
+	 */
+	int getWidth() const;
+
+	/** Get height of the RGB image in pixels.
+	 */
+	int getHeight() const;
+
+	/** Get the precision of the pixels returned by getData().
+	 */
+	PixelStorage getStorage() const;
+
+	/** Get the bayer mosaic.
+	 *
+	 * The arrangement of the bayer filter is given by the phase of the format.
+	 *
+	 * \return width*height uint16_t pixels, empty for half size images
+	 */
+	const cv::Mat &getMosaic() const;
+
+	/** Get the statistics of the mosaic.
+	 *
+	 * The statistics are gathered only when requested in the decoding options,
+	 * they describe the unpacked pixels after the defect correction and the
+	 * normalization. With the normalization, the pixels are clipped at the limits
+	 * of the uint16_t range, otherwise at the levels of the normalization, so the levels
+	 * of the sensor should be given by Normalization(const Metadata&) when they are known.
+	 * The unset white levels clip at the largest value of the format.
+	 *
+	 * \return the statistics, empty if they were not requested
+	 */
+	const FrameStatistics &getStatistics() const;
 
 	/** Get processed image data
 	 *
-	 * \return pointer to a buffer containing width*height RGB uint16_t pixels
+	 * The image is demosaiced on the first call.
+	 *
+	 * \return width*height RGB pixels in the storage selected by the decoding options
 	 */
 	const cv::Mat &getData() const;
 
+	/** Demosaic only a part of the image.
+	 *
+	 * The result is identical to the corresponding part of getData() with the UINT16
+	 * storage, but the whole image is not demosaiced nor cached. The half size images
+	 * stored in a reduced precision are converted back from the storage.
+	 *
+	 * \param region the region to demosaic, must lie inside the image
+	 * \return RGB uint16_t pixels of the region
+	 * \throw UnsupportedFormatException when the mosaic cannot be demosaiced
+	 */
+	cv::Mat demosaic(const cv::Rect &region) const;
+
+	/** Get 8-bit luminance of the image.
+	 *
+	 * The result is the same as converting the output of getData() to gray
+	 * and scaling it to 8 bits. With the bilinear demosaic, the luminance is
+	 * computed directly from the mosaic in a single pass without creating
+	 * the demosaiced image.
+	 *
+	 * \return width*height uint8_t pixels
+	 */
+	cv::Mat getLuminance() const;
+
+	/** Get 8-bit luminance of a part of the image.
+	 *
+	 * \param region the region to convert, must lie inside the image
+	 * \return uint8_t pixels of the region
+	 */
+	cv::Mat getLuminance(const cv::Rect &region) const;
+
+	/** Decode only a part of an image without decoding the whole image.
+	 *
+	 * Only the rows and columns of the region and the neighbouring pixels
+	 * needed for the interpolation are unpacked. The result is identical
+	 * to the corresponding part of getData() of the whole image, which makes
+	 * it suitable for cheap checks of the image contents before the full decode.
+	 *
+	 * \param data the contents of a .RAW file or of a compressed file
+	 * \param size size of the data in bytes
+	 * \param format layout of the data
+	 * \param region the region to decode, must lie inside the decoded image
+	 * \param options decoding options
+	 * \return RGB uint16_t pixels of the region
+	 * \throw InvalidRegionException when the region does not lie inside the decoded image
+	 * \throw UnsupportedFormatException when the format cannot be decoded
+	 */
+	static cv::Mat decodeRegion(const std::uint8_t *data, std::size_t size, const RawFormat &format,
+	                            const cv::Rect &region, const DecodeOptions &options = DecodeOptions());
+
+	/** Decode 8-bit luminance of only a part of an image.
+	 *
+	 * The result is identical to the corresponding part of getLuminance() of the whole image.
+	 *
+	 * \param data the contents of a .RAW file or of a compressed file
+	 * \param size size of the data in bytes
+	 * \param format layout of the data
+	 * \param region the region to decode, must lie inside the decoded image
+	 * \param options decoding options
+	 * \return uint8_t pixels of the region
+	 * \throw InvalidRegionException when the region does not lie inside the decoded image
+	 * \throw InvalidRegionException when the region does not lie inside the decoded image
+	 * \throw UnsupportedFormatException when the format cannot be decoded
+	 */
+	static cv::Mat decodeRegionLuminance(const std::uint8_t *data, std::size_t size, const RawFormat &format,
+	                                     const cv::Rect &region, const DecodeOptions &options = DecodeOptions());
+
 private:
-	cv::Mat m_data;
+	RawFormat m_format;
+	FrameStatistics m_statistics;
+	PixelStorage m_storage;
+	cv::Mat m_mosaic;
+	mutable cv::Mat m_data;
+	std::shared_ptr<const DemosaicInterface> m_demosaic;
 
-	void demosaic();
+	/** Decode either the packed or the compressed data. */
+	void load(const std::uint8_t *data, std::size_t size, const DecodeOptions &options);
+	/** Unpack the mosaic. */
+	void decode(const std::uint8_t *data, std::size_t size, const DecodeOptions &options);
+	/** Bin the bayer quads into a half size RGB image. */
+	void decodeHalfSize(const std::uint8_t *data, std::size_t size, const DecodeOptions &options);
+	/** Decode the compressed mosaic. */
+	void decode(const CompressedRaw &compressed, const DecodeOptions &options);
+	/** Bin the bayer quads of the compressed mosaic into a half size RGB image. */
+	void decodeHalfSize(const CompressedRaw &compressed, const DecodeOptions &options);
 };
 
 }
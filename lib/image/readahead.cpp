@@ -0,0 +1,500 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "readahead.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "framebufferpool.h"
+#include "mappedfile.h"
+
+namespace {
+
+std::string errorMessage(const std::string &action, const std::string &path, int error) {
+	std::stringstream ss;
+	ss << "cannot " << action << " " << path << ": " << std::strerror(error);
+	return ss.str();
+}
+
+/**
+ * An asynchronous reader of whole files.
+ */
+class Backend {
+public:
+	/** Called when the read finishes, the parameter is the errno value or 0 on success. */
+	using Callback = std::function<void(int error)>;
+
+	Backend() = default;
+	virtual ~Backend() = default;
+
+	/** Start reading size bytes from the beginning of the file into data. */
+	virtual void read(int fd, std::uint8_t *data, std::size_t size, Callback done) = 0;
+
+	// avoid copying
+	Backend(const Backend&) = delete;
+	Backend& operator=(const Backend&) = delete;
+};
+
+/**
+ * Reads the files using blocking reads in a pool of threads.
+ */
+class ThreadPoolBackend : public Backend {
+public:
+	explicit ThreadPoolBackend(std::size_t threads) : m_stop(false) {
+		for (std::size_t i = 0; i < threads; ++i) {
+			m_threads.emplace_back([this]() { work(); });
+		}
+	}
+
+	~ThreadPoolBackend() {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_condition.notify_all();
+		for (std::thread &thread : m_threads) {
+			thread.join();
+		}
+	}
+
+	void read(int fd, std::uint8_t *data, std::size_t size, Callback done) override {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_queue.push_back(Request{fd, data, size, std::move(done)});
+		}
+		m_condition.notify_one();
+	}
+
+private:
+	struct Request {
+		int fd;
+		std::uint8_t *data;
+		std::size_t size;
+		Callback done;
+	};
+
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	std::deque<Request> m_queue;
+	bool m_stop;
+	std::vector<std::thread> m_threads;
+
+	void work() {
+		for (;;) {
+			Request request;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_condition.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+				// the queued requests are finished before stopping
+				if (m_queue.empty()) {
+					return;
+				}
+				request = std::move(m_queue.front());
+				m_queue.pop_front();
+			}
+
+			int error = 0;
+			std::size_t offset = 0;
+			while (offset < request.size) {
+				const ssize_t count = pread(request.fd, request.data + offset, request.size - offset, offset);
+				if (count < 0) {
+					if (errno == EINTR) {
+						continue;
+					}
+					error = errno;
+					break;
+				}
+				if (count == 0) {
+					// the file was truncated
+					error = EIO;
+					break;
+				}
+				offset += count;
+			}
+			request.done(error);
+		}
+	}
+};
+
+#ifdef HAVE_LIBURING
+
+/**
+ * Reads the files using io_uring, the completions are processed by a dedicated thread.
+ */
+class UringBackend : public Backend {
+public:
+	/**
+	 * \throw std::runtime_error when io_uring is not supported
+	 */
+	explicit UringBackend(std::size_t depth) {
+		const unsigned int entries = std::max<std::size_t>(2 * depth, 32);
+		if (io_uring_queue_init(entries, &m_ring, 0) < 0) {
+			throw std::runtime_error("io_uring is not supported");
+		}
+		m_completion = std::thread([this]() { complete(); });
+	}
+
+	~UringBackend() {
+		// all reads are finished by now, the request without data stops the completion thread
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			io_uring_sqe *sqe = getSqe();
+			io_uring_prep_nop(sqe);
+			io_uring_sqe_set_data(sqe, nullptr);
+			io_uring_submit(&m_ring);
+		}
+		m_completion.join();
+		io_uring_queue_exit(&m_ring);
+	}
+
+	void read(int fd, std::uint8_t *data, std::size_t size, Callback done) override {
+		submit(new Request{fd, data, size, 0, std::move(done)});
+	}
+
+private:
+	struct Request {
+		int fd;
+		std::uint8_t *data;
+		std::size_t size;
+		std::size_t offset;
+		Callback done;
+	};
+
+	/** Maximal size of a single read. */
+	static constexpr std::size_t MAX_READ = 1 << 30;
+
+	io_uring m_ring;
+	std::mutex m_mutex;
+	std::thread m_completion;
+
+	/** Get a submission queue entry, must be called with the mutex locked. */
+	io_uring_sqe *getSqe() {
+		io_uring_sqe *sqe = io_uring_get_sqe(&m_ring);
+		while (sqe == nullptr) {
+			// the queue is full, pass the entries to the kernel
+			io_uring_submit(&m_ring);
+			sqe = io_uring_get_sqe(&m_ring);
+		}
+		return sqe;
+	}
+
+	void submit(Request *request) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		io_uring_sqe *sqe = getSqe();
+		const std::size_t size = std::min(request->size - request->offset, MAX_READ);
+		io_uring_prep_read(sqe, request->fd, request->data + request->offset, size, request->offset);
+		io_uring_sqe_set_data(sqe, request);
+		io_uring_submit(&m_ring);
+	}
+
+	void finish(Request *request, int error) {
+		request->done(error);
+		delete request;
+	}
+
+	void complete() {
+		for (;;) {
+			io_uring_cqe *cqe;
+			const int ret = io_uring_wait_cqe(&m_ring, &cqe);
+			if (ret == -EINTR) {
+				continue;
+			}
+			if (ret < 0) {
+				return;
+			}
+			Request *request = static_cast<Request*>(io_uring_cqe_get_data(cqe));
+			const int result = cqe->res;
+			io_uring_cqe_seen(&m_ring, cqe);
+
+			if (request == nullptr) {
+				return;
+			}
+			if (result < 0) {
+				finish(request, -result);
+			}
+			else if (result == 0) {
+				// the file was truncated
+				finish(request, EIO);
+			}
+			else {
+				// continue a short read
+				request->offset += result;
+				if (request->offset < request->size) {
+					submit(request);
+				}
+				else {
+					finish(request, 0);
+				}
+			}
+		}
+	}
+};
+
+#endif
+
+std::unique_ptr<Backend> createBackend(std::size_t depth) {
+#ifdef HAVE_LIBURING
+	try {
+		return std::make_unique<UringBackend>(depth);
+	} catch (const std::runtime_error &) {
+		// fall back to the threads
+	}
+#endif
+	return std::make_unique<ThreadPoolBackend>(depth);
+}
+
+}
+
+namespace Lyli {
+namespace Image {
+
+FileBuffer::FileBuffer(const std::string &path, std::size_t size) :
+	m_path(path), m_data(nullptr), m_size(size) {
+	// the buffer is never empty, so that the empty files have valid data too
+	m_data = static_cast<std::uint8_t*>(FrameBufferPool::getDefault().acquire(std::max<std::size_t>(m_size, 1)));
+}
+
+FileBuffer::~FileBuffer() {
+	FrameBufferPool::getDefault().release(m_data, std::max<std::size_t>(m_size, 1));
+}
+
+const std::string &FileBuffer::getPath() const {
+	return m_path;
+}
+
+const std::uint8_t *FileBuffer::getData() const {
+	return m_data;
+}
+
+std::uint8_t *FileBuffer::getData() {
+	return m_data;
+}
+
+std::size_t FileBuffer::getSize() const {
+	return m_size;
+}
+
+class ReadAhead::Impl {
+public:
+	enum class State {
+		WAITING,
+		READING,
+		DONE,
+		FAILED,
+		TAKEN
+	};
+
+	struct Entry {
+		State state = State::WAITING;
+		std::shared_ptr<FileBuffer> buffer;
+		std::string error;
+	};
+
+	Impl(const std::vector<std::string> &paths_, std::size_t depth_) :
+		paths(paths_), depth(std::max<std::size_t>(depth_, 1)), entries(paths_.size()), started(0), reading(0),
+		backend(createBackend(depth)) {
+
+	}
+
+	~Impl() {
+		// the buffers must stay valid until the backend finishes
+		std::unique_lock<std::mutex> lock(mutex);
+		condition.wait(lock, [this]() { return reading == 0; });
+	}
+
+	std::vector<std::string> paths;
+	std::size_t depth;
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::vector<Entry> entries;
+	// all files before this one have been started
+	std::size_t started;
+	// number of files being read
+	std::size_t reading;
+	std::unique_ptr<Backend> backend;
+
+	/** Start reading all files up to the end. */
+	void startReads(std::size_t end) {
+		end = std::min(end, paths.size());
+		for (;;) {
+			std::size_t index;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (started >= end) {
+					return;
+				}
+				index = started++;
+				entries[index].state = State::READING;
+				++reading;
+			}
+			start(index);
+		}
+	}
+
+	void start(std::size_t index) {
+		const std::string &path = paths[index];
+		const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			finish(index, errorMessage("open", path, errno));
+			return;
+		}
+
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			const std::string reason(errorMessage("stat", path, errno));
+			close(fd);
+			finish(index, reason);
+			return;
+		}
+
+		std::shared_ptr<FileBuffer> buffer;
+		try {
+			buffer = std::make_shared<FileBuffer>(path, st.st_size);
+		} catch (const std::bad_alloc &) {
+			close(fd);
+			finish(index, errorMessage("allocate memory for", path, ENOMEM));
+			return;
+		}
+		std::uint8_t *data = buffer->getData();
+		const std::size_t size = buffer->getSize();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			entries[index].buffer = std::move(buffer);
+		}
+		if (size == 0) {
+			close(fd);
+			finish(index, std::string());
+			return;
+		}
+
+		// the advice is just a hint, so the errors are ignored
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+		backend->read(fd, data, size, [this, index, fd](int error) {
+			close(fd);
+			finish(index, error != 0 ? errorMessage("read", paths[index], error) : std::string());
+		});
+	}
+
+	/** Mark the read as finished, the error is empty on success. */
+	void finish(std::size_t index, const std::string &error) {
+		std::lock_guard<std::mutex> lock(mutex);
+		Entry &entry = entries[index];
+		if (error.empty()) {
+			entry.state = State::DONE;
+		}
+		else {
+			entry.state = State::FAILED;
+			entry.error = error;
+			entry.buffer.reset();
+		}
+		--reading;
+		// notify with the mutex locked, the reader may be destroyed as soon as it is unlocked
+		condition.notify_all();
+	}
+};
+
+ReadAhead::ReadAhead(const std::vector<std::string> &paths, std::size_t depth) :
+	pimpl(new Impl(paths, depth)) {
+	pimpl->startReads(pimpl->depth);
+}
+
+ReadAhead::~ReadAhead() {
+
+}
+
+std::size_t ReadAhead::getSize() const {
+	return pimpl->paths.size();
+}
+
+std::shared_ptr<const FileBuffer> ReadAhead::read(std::size_t index) {
+	if (index >= pimpl->paths.size()) {
+		std::stringstream ss;
+		ss << "no file with index " << index;
+		throw FileAccessException(ss.str());
+	}
+
+	// keep the files after this one in flight
+	pimpl->startReads(index + 1 + pimpl->depth);
+
+	std::unique_lock<std::mutex> lock(pimpl->mutex);
+	Impl::Entry &entry = pimpl->entries[index];
+	pimpl->condition.wait(lock, [&entry]() {
+		return entry.state != Impl::State::WAITING && entry.state != Impl::State::READING;
+	});
+
+	switch (entry.state) {
+		case Impl::State::FAILED:
+			throw FileAccessException(entry.error);
+		case Impl::State::TAKEN:
+			throw FileAccessException(pimpl->paths[index] + " was already read");
+		default:
+			break;
+	}
+
+	entry.state = Impl::State::TAKEN;
+	std::shared_ptr<const FileBuffer> buffer(std::move(entry.buffer));
+	entry.buffer.reset();
+	return buffer;
+}
+
+std::vector<std::string> listRawFiles(const std::string &directory, bool requireMetadata) {
+	DIR *dir = opendir(directory.c_str());
+	if (dir == nullptr) {
+		throw FileAccessException(errorMessage("open", directory, errno));
+	}
+	std::vector<std::string> files;
+	dirent *ent;
+	const std::string ext(".RAW");
+	while ((ent = readdir(dir)) != nullptr) {
+		std::string file(ent->d_name);
+		if (file.size() < ext.size()
+		    || ! std::equal(ext.rbegin(), ext.rend(), file.rbegin())) {
+			// skip the file
+			continue;
+		}
+		std::string filebase(file.substr(0, file.size() - ext.size()));
+		if (requireMetadata && access((directory + "/" + filebase + ".TXT").c_str(), F_OK) != 0) {
+			continue;
+		}
+		files.push_back(filebase);
+	}
+	closedir(dir);
+	std::sort(files.begin(), files.end());
+	return files;
+}
+
+}
+}
@@ -0,0 +1,129 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LYLI_IMAGE_READAHEAD_H_
+#define LYLI_IMAGE_READAHEAD_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Lyli {
+namespace Image {
+
+/** Contents of a file read into memory.
+ *
+ * The data are stored in a buffer from the default FrameBufferPool.
+ */
+class FileBuffer {
+public:
+	/** Allocate a buffer for a file.
+	 *
+	 * \param path path to the file
+	 * \param size size of the file in bytes
+	 * \throw std::bad_alloc when the buffer cannot be allocated
+	 */
+	FileBuffer(const std::string &path, std::size_t size);
+	~FileBuffer();
+
+	/** Get path to the file.
+	 */
+	const std::string &getPath() const;
+
+	/** Get the contents of the file.
+	 */
+	const std::uint8_t *getData() const;
+
+	/** Get the buffer to read the file into.
+	 */
+	std::uint8_t *getData();
+
+	/** Get size of the file.
+	 */
+	std::size_t getSize() const;
+
+	// avoid copying
+	FileBuffer(const FileBuffer&) = delete;
+	FileBuffer& operator=(const FileBuffer&) = delete;
+
+private:
+	std::string m_path;
+	std::uint8_t *m_data;
+	std::size_t m_size;
+};
+
+/** A reader of a list of files that reads the files ahead in the background.
+ *
+ * The files are expected to be requested roughly in the order of the list.
+ * Whenever a file is requested, the reads of the following files are started,
+ * so that they are already in memory when they are needed.
+ *
+ * The files are read using io_uring when the library is built with liburing
+ * and the kernel supports it, a pool of threads reading the files is used otherwise.
+ */
+class ReadAhead {
+public:
+	/** Start reading the files.
+	 *
+	 * \param paths paths to the files to read
+	 * \param depth number of files read ahead of the requested one
+	 */
+	ReadAhead(const std::vector<std::string> &paths, std::size_t depth);
+
+	/** Wait for the outstanding reads and free the unused files.
+	 */
+	~ReadAhead();
+
+	/** Get number of the files.
+	 */
+	std::size_t getSize() const;
+
+	/** Get a file.
+	 *
+	 * Waits until the file is read. Every file can be obtained only once,
+	 * the reader does not keep it afterwards. The method is thread safe.
+	 *
+	 * \param index index of the file in the list
+	 * \return the contents of the file
+	 * \throw FileAccessException when the file cannot be read or was already obtained
+	 */
+	std::shared_ptr<const FileBuffer> read(std::size_t index);
+
+	// avoid copying
+	ReadAhead(const ReadAhead&) = delete;
+	ReadAhead& operator=(const ReadAhead&) = delete;
+
+private:
+	class Impl;
+	std::unique_ptr<Impl> pimpl;
+};
+
+/** List the RAW images in a directory.
+ *
+ * \param directory the directory to list
+ * \param requireMetadata skip the images that have no accompanying .TXT metadata
+ * \return sorted names of the images without the .RAW extension
+ * \throw FileAccessException when the directory cannot be read
+ */
+std::vector<std::string> listRawFiles(const std::string &directory, bool requireMetadata);
+
+}
+}
+
+#endif
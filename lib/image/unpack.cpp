@@ -0,0 +1,394 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "unpack.h"
+
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LYLI_UNPACK_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+
+using Lyli::Image::ByteOrder;
+using Lyli::Image::UnpackFunction;
+using NormalizeFunction = void (*)(std::uint16_t *, std::size_t, const std::uint16_t *, const std::uint32_t *);
+
+constexpr int gcd(int a, int b) {
+	return b == 0 ? a : gcd(b, a % b);
+}
+
+/**
+ * Pixels packed into the smallest group of whole bytes.
+ */
+template<int Bits>
+struct PixelGroup {
+	static constexpr int PIXELS = 8 / gcd(Bits, 8);
+	static constexpr int BYTES = Bits * PIXELS / 8;
+	static constexpr std::uint32_t MASK = (1 << Bits) - 1;
+};
+
+template<int Bits, ByteOrder Order>
+struct GroupUnpacker;
+
+template<int Bits>
+struct GroupUnpacker<Bits, ByteOrder::BIG> {
+	static void unpack(const std::uint8_t *src, std::uint16_t *dst) {
+		using Group = PixelGroup<Bits>;
+		// the group is read as a single big endian number, the first pixel is in the most significant bits
+		std::uint64_t bits = 0;
+		for (int i = 0; i < Group::BYTES; ++i) {
+			bits = (bits << 8) | src[i];
+		}
+		for (int i = 0; i < Group::PIXELS; ++i) {
+			dst[i] = ((bits >> (Bits * (Group::PIXELS - 1 - i))) & Group::MASK) << (16 - Bits);
+		}
+	}
+};
+
+template<int Bits>
+struct GroupUnpacker<Bits, ByteOrder::LITTLE> {
+	static void unpack(const std::uint8_t *src, std::uint16_t *dst) {
+		using Group = PixelGroup<Bits>;
+		constexpr int LOW_BITS = Bits - 8;
+		// the low bits follow the high bytes, the first pixel is in the least significant bits
+		std::uint64_t low = 0;
+		for (int i = Group::BYTES - 1; i >= Group::PIXELS; --i) {
+			low = (low << 8) | src[i];
+		}
+		for (int i = 0; i < Group::PIXELS; ++i) {
+			const std::uint32_t pixel = (src[i] << LOW_BITS) | ((low >> (LOW_BITS * i)) & ((1 << LOW_BITS) - 1));
+			dst[i] = pixel << (16 - Bits);
+		}
+	}
+};
+
+template<int Bits, ByteOrder Order>
+struct GroupPacker;
+
+template<int Bits>
+struct GroupPacker<Bits, ByteOrder::BIG> {
+	static void pack(const std::uint16_t *src, std::uint8_t *dst) {
+		using Group = PixelGroup<Bits>;
+		std::uint64_t bits = 0;
+		for (int i = 0; i < Group::PIXELS; ++i) {
+			bits = (bits << Bits) | (src[i] >> (16 - Bits));
+		}
+		for (int i = 0; i < Group::BYTES; ++i) {
+			dst[i] = bits >> (8 * (Group::BYTES - 1 - i));
+		}
+	}
+};
+
+template<int Bits>
+struct GroupPacker<Bits, ByteOrder::LITTLE> {
+	static void pack(const std::uint16_t *src, std::uint8_t *dst) {
+		using Group = PixelGroup<Bits>;
+		constexpr int LOW_BITS = Bits - 8;
+		std::uint64_t low = 0;
+		for (int i = 0; i < Group::PIXELS; ++i) {
+			const std::uint32_t pixel = src[i] >> (16 - Bits);
+			dst[i] = pixel >> LOW_BITS;
+			low |= static_cast<std::uint64_t>(pixel & ((1 << LOW_BITS) - 1)) << (LOW_BITS * i);
+		}
+		for (int i = Group::PIXELS; i < Group::BYTES; ++i) {
+			dst[i] = low >> (8 * (i - Group::PIXELS));
+		}
+	}
+};
+
+template<int Bits, ByteOrder Order>
+void packGroups(const std::uint16_t *src, std::uint8_t *dst, std::size_t count) {
+	using Group = PixelGroup<Bits>;
+	for (std::size_t i = 0; i < count; i += Group::PIXELS) {
+		GroupPacker<Bits, Order>::pack(src + i, dst);
+		dst += Group::BYTES;
+	}
+}
+
+/**
+ * Unpack the pixels group by group, the loops over the group are unrolled by the compiler.
+ */
+template<int Bits, ByteOrder Order>
+void unpackGroups(const std::uint8_t *src, std::uint16_t *dst, std::size_t count) {
+	using Group = PixelGroup<Bits>;
+	for (std::size_t i = 0; i < count; i += Group::PIXELS) {
+		GroupUnpacker<Bits, Order>::unpack(src, dst + i);
+		src += Group::BYTES;
+	}
+}
+
+#ifdef LYLI_UNPACK_X86
+
+/*
+ * The SIMD versions use a byte shuffle to put the three bytes of each pixel pair
+ * into two 16-bit lanes:
+ *   lane 2i   = (b0 << 8) | b1, the first pixel is obtained by masking out the low nibble
+ *   lane 2i+1 = (b1 << 8) | b2, the second pixel is obtained by shifting left by 4
+ * Each 128-bit lane consumes 12 input bytes and produces 8 pixels.
+ */
+
+__attribute__((target("ssse3")))
+void unpack12Ssse3(const std::uint8_t *src, std::uint16_t *dst, std::size_t count) {
+	const __m128i shuffle = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+	const __m128i maskFirst = _mm_set1_epi32(0x0000FFF0);
+	const __m128i maskSecond = _mm_set1_epi32(static_cast<int>(0xFFFF0000));
+
+	const std::size_t bytes = count * 3 / 2;
+	std::size_t i = 0;
+	std::size_t ib = 0;
+	// the load reads 16 bytes, even though only 12 are used
+	for (; ib + 16 <= bytes; i += 8, ib += 12) {
+		__m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + ib));
+		__m128i v = _mm_shuffle_epi8(in, shuffle);
+		__m128i first = _mm_and_si128(v, maskFirst);
+		__m128i second = _mm_and_si128(_mm_slli_epi16(v, 4), maskSecond);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_or_si128(first, second));
+	}
+
+	Lyli::Image::unpack12Scalar(src + ib, dst + i, count - i);
+}
+
+__attribute__((target("avx2")))
+void unpack12Avx2(const std::uint8_t *src, std::uint16_t *dst, std::size_t count) {
+	const __m256i shuffle = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+	                                         1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+	const __m256i maskFirst = _mm256_set1_epi32(0x0000FFF0);
+	const __m256i maskSecond = _mm256_set1_epi32(static_cast<int>(0xFFFF0000));
+
+	const std::size_t bytes = count * 3 / 2;
+	std::size_t i = 0;
+	std::size_t ib = 0;
+	// the high lane is loaded from src + 12, so 28 bytes are touched in each iteration
+	for (; ib + 28 <= bytes; i += 16, ib += 24) {
+		__m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + ib));
+		__m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + ib + 12));
+		__m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+		__m256i v = _mm256_shuffle_epi8(in, shuffle);
+		__m256i first = _mm256_and_si256(v, maskFirst);
+		__m256i second = _mm256_and_si256(_mm256_slli_epi16(v, 4), maskSecond);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_or_si256(first, second));
+	}
+
+	unpack12Ssse3(src + ib, dst + i, count - i);
+}
+
+/*
+ * The other packings are unpacked by eight pixels. Each pixel gets a 32-bit lane
+ * containing all bytes it spans, the lanes are shifted by the bit offsets of the
+ * pixels and packed to 16 bits.
+ *
+ * A big endian pixel starting at the bit b of byte s is shifted left by b, so that
+ * its most significant bit becomes the bit 31 of the lane filled with bytes s..s+2.
+ * A little endian pixel has the high byte in the byte 3 of the lane and its low bits
+ * in the bytes 0..1, they are shifted right by their bit offset.
+ */
+template<int Bits, ByteOrder Order>
+__attribute__((target("avx2")))
+void unpackGroupsAvx2(const std::uint8_t *src, std::uint16_t *dst, std::size_t count) {
+	using Group = PixelGroup<Bits>;
+	constexpr int LOW_BITS = Bits - 8;
+
+	// the shuffle indices are relative to the beginning of each 128-bit lane, which hold the same bytes
+	alignas(32) std::int8_t shuffleIndices[32];
+	alignas(32) std::int32_t shifts[8];
+	for (int i = 0; i < 8; ++i) {
+		std::int8_t *lane = shuffleIndices + 4 * i;
+		if (Order == ByteOrder::BIG) {
+			const int start = Bits * i / 8;
+			lane[0] = -1;
+			lane[1] = start + 2;
+			lane[2] = start + 1;
+			lane[3] = start;
+			shifts[i] = Bits * i % 8;
+		}
+		else {
+			const int group = i / Group::PIXELS;
+			const int pixel = i % Group::PIXELS;
+			const int lowStart = group * Group::BYTES + Group::PIXELS + LOW_BITS * pixel / 8;
+			lane[0] = lowStart;
+			lane[1] = lowStart + 1;
+			lane[2] = -1;
+			lane[3] = group * Group::BYTES + pixel;
+			shifts[i] = LOW_BITS * pixel % 8;
+		}
+	}
+	const __m256i shuffle = _mm256_load_si256(reinterpret_cast<const __m256i*>(shuffleIndices));
+	const __m256i shift = _mm256_load_si256(reinterpret_cast<const __m256i*>(shifts));
+	const __m256i maskHigh = _mm256_set1_epi32(Order == ByteOrder::BIG ? (0xFFFF << (16 - Bits)) & 0xFFFF : 0xFF00);
+	const __m256i maskLow = _mm256_set1_epi32((1 << LOW_BITS) - 1);
+
+	const std::size_t bytes = count * Bits / 8;
+	std::size_t i = 0;
+	std::size_t ib = 0;
+	// the load reads 16 bytes, even though only Bits bytes are used
+	for (; ib + 16 <= bytes; i += 8, ib += Bits) {
+		const __m256i in = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + ib)));
+		const __m256i v = _mm256_shuffle_epi8(in, shuffle);
+		__m256i pixels;
+		if (Order == ByteOrder::BIG) {
+			pixels = _mm256_and_si256(_mm256_srli_epi32(_mm256_sllv_epi32(v, shift), 16), maskHigh);
+		}
+		else {
+			const __m256i high = _mm256_and_si256(_mm256_srli_epi32(v, 16), maskHigh);
+			const __m256i low = _mm256_and_si256(_mm256_srlv_epi32(v, shift), maskLow);
+			pixels = _mm256_or_si256(high, _mm256_slli_epi32(low, 16 - Bits));
+		}
+		// the pack works within 128-bit lanes, move the pixels to the low lane
+		const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(pixels, _mm256_setzero_si256()), 0xD8);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm256_castsi256_si128(packed));
+	}
+
+	unpackGroups<Bits, Order>(src + ib, dst + i, count - i);
+}
+
+/*
+ * The pixels are reduced by the black level using a saturating subtraction
+ * and widened to 32 bits for the multiplication. As the multiplier is less
+ * than 2^16, the product fits into 32 bits and the shifted result is
+ * saturated to 16 bits by the final pack.
+ */
+__attribute__((target("avx2")))
+void normalizeAvx2(std::uint16_t *data, std::size_t count, const std::uint16_t black[2], const std::uint32_t multiplier[2]) {
+	const __m256i blackv = _mm256_set1_epi32(static_cast<int>(black[0] | (black[1] << 16)));
+	const __m256i multiplierv = _mm256_setr_epi32(multiplier[0], multiplier[1], multiplier[0], multiplier[1],
+	                                              multiplier[0], multiplier[1], multiplier[0], multiplier[1]);
+
+	std::size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+		v = _mm256_subs_epu16(v, blackv);
+		__m256i lo = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(v));
+		__m256i hi = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1));
+		lo = _mm256_srli_epi32(_mm256_mullo_epi32(lo, multiplierv), Lyli::Image::NORMALIZE_SHIFT);
+		hi = _mm256_srli_epi32(_mm256_mullo_epi32(hi, multiplierv), Lyli::Image::NORMALIZE_SHIFT);
+		// the pack works within 128-bit lanes, restore the order of the quadwords
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xD8);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(data + i), packed);
+	}
+
+	Lyli::Image::normalizeScalar(data + i, count - i, black, multiplier);
+}
+
+#endif
+
+template<int Bits, ByteOrder Order>
+UnpackFunction selectUnpackGroups() {
+#ifdef LYLI_UNPACK_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return unpackGroupsAvx2<Bits, Order>;
+	}
+#endif
+	return unpackGroups<Bits, Order>;
+}
+
+UnpackFunction selectUnpack12() {
+#ifdef LYLI_UNPACK_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return unpack12Avx2;
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		return unpack12Ssse3;
+	}
+#endif
+	return Lyli::Image::unpack12Scalar;
+}
+
+NormalizeFunction selectNormalize() {
+#ifdef LYLI_UNPACK_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return normalizeAvx2;
+	}
+#endif
+	return Lyli::Image::normalizeScalar;
+}
+
+}
+
+namespace Lyli {
+namespace Image {
+
+UnpackFunction getUnpack(int bitsPerPixel, ByteOrder byteOrder) {
+	static const UnpackFunction unpack10Big = selectUnpackGroups<10, ByteOrder::BIG>();
+	static const UnpackFunction unpack10Little = selectUnpackGroups<10, ByteOrder::LITTLE>();
+	static const UnpackFunction unpack12Little = selectUnpackGroups<12, ByteOrder::LITTLE>();
+	static const UnpackFunction unpack14Big = selectUnpackGroups<14, ByteOrder::BIG>();
+	static const UnpackFunction unpack14Little = selectUnpackGroups<14, ByteOrder::LITTLE>();
+
+	const bool big = byteOrder == ByteOrder::BIG;
+	switch (bitsPerPixel) {
+		case 10:
+			return big ? unpack10Big : unpack10Little;
+		case 12:
+			// the big endian 12-bit data have their own implementation
+			return big ? unpack12 : unpack12Little;
+		case 14:
+			return big ? unpack14Big : unpack14Little;
+		default:
+			return nullptr;
+	}
+}
+
+PackFunction getPack(int bitsPerPixel, ByteOrder byteOrder) {
+	const bool big = byteOrder == ByteOrder::BIG;
+	switch (bitsPerPixel) {
+		case 10:
+			return big ? packGroups<10, ByteOrder::BIG> : packGroups<10, ByteOrder::LITTLE>;
+		case 12:
+			return big ? packGroups<12, ByteOrder::BIG> : packGroups<12, ByteOrder::LITTLE>;
+		case 14:
+			return big ? packGroups<14, ByteOrder::BIG> : packGroups<14, ByteOrder::LITTLE>;
+		default:
+			return nullptr;
+	}
+}
+
+void unpack12(const std::uint8_t *src, std::uint16_t *dst, std::size_t count) {
+	static const UnpackFunction unpack = selectUnpack12();
+	unpack(src, dst, count);
+}
+
+void unpack12Scalar(const std::uint8_t *src, std::uint16_t *dst, std::size_t count) {
+	for (std::size_t i = 0; i < count; i += 2) {
+		// the data are stored as big endian, the first pixel takes the first
+		// twelve bits, the second one the remaining twelve bits
+		dst[i] = (src[0] << 8) | (src[1] & 0xF0);
+		dst[i + 1] = ((src[1] & 0xF) << 12) | (src[2] << 4);
+		src += 3;
+	}
+}
+
+void normalize(std::uint16_t *data, std::size_t count, const std::uint16_t black[2], const std::uint32_t multiplier[2]) {
+	static const NormalizeFunction normalizeFunction = selectNormalize();
+	normalizeFunction(data, count, black, multiplier);
+}
+
+void normalizeScalar(std::uint16_t *data, std::size_t count, const std::uint16_t black[2], const std::uint32_t multiplier[2]) {
+	for (std::size_t i = 0; i < count; ++i) {
+		const std::uint32_t c = i & 1;
+		const std::uint32_t pixel = data[i] > black[c] ? data[i] - black[c] : 0;
+		data[i] = std::min<std::uint32_t>((pixel * multiplier[c]) >> NORMALIZE_SHIFT, 65535);
+	}
+}
+
+}
+}
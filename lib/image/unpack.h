@@ -0,0 +1,107 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LYLI_IMAGE_UNPACK_H_
+#define LYLI_IMAGE_UNPACK_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <image/rawformat.h>
+
+namespace Lyli {
+namespace Image {
+
+/** A function unpacking count pixels from src to dst.
+ */
+using UnpackFunction = void (*)(const std::uint8_t *src, std::uint16_t *dst, std::size_t count);
+
+/** Get the unpacking function for a pixel packing.
+ *
+ * Each supported packing has its own specialized implementation. The unpacked values
+ * are scaled to the full 16-bit range, ie. the bits are stored in the most significant
+ * bits of the output. The number of pixels to unpack must be a multiple of the number
+ * of pixels sharing the same bytes, 2 for the 12-bit pixels and 4 otherwise.
+ *
+ * \param bitsPerPixel number of bits of a packed pixel
+ * \param byteOrder the order of the bits
+ * \return the unpacking function or nullptr if the packing is not supported
+ */
+UnpackFunction getUnpack(int bitsPerPixel, ByteOrder byteOrder);
+
+/** A function packing count pixels from src to dst.
+ */
+using PackFunction = void (*)(const std::uint16_t *src, std::uint8_t *dst, std::size_t count);
+
+/** Get the packing function for a pixel packing.
+ *
+ * The packing is the inverse of the unpacking function returned by getUnpack(),
+ * only the most significant bits of the input pixels are stored. It is meant
+ * for restoring RAW files, so it uses a plain C++ implementation only.
+ *
+ * \param bitsPerPixel number of bits of a packed pixel
+ * \param byteOrder the order of the bits
+ * \return the packing function or nullptr if the packing is not supported
+ */
+PackFunction getPack(int bitsPerPixel, ByteOrder byteOrder);
+
+/** Unpack big endian 12-bit pixels.
+ *
+ * Every two pixels are stored in three bytes. The unpacked values are
+ * scaled to the full 16-bit range, ie. the 12 bits are stored in the most
+ * significant bits of the output.
+ *
+ * The best implementation available on the running CPU is selected
+ * (AVX2, SSSE3 or a plain C++ fallback). All of them produce identical output.
+ *
+ * \param src packed input, must contain at least count*3/2 bytes
+ * \param dst output buffer for count pixels
+ * \param count number of pixels to unpack, must be even
+ */
+void unpack12(const std::uint8_t *src, std::uint16_t *dst, std::size_t count);
+
+/** Unpack big endian 12-bit pixels using the plain C++ implementation.
+ *
+ * Behaves exactly like unpack12(), it is exposed mainly for comparison.
+ */
+void unpack12Scalar(const std::uint8_t *src, std::uint16_t *dst, std::size_t count);
+
+/** Number of fractional bits of the normalize() multipliers. */
+constexpr unsigned int NORMALIZE_SHIFT = 12;
+
+/** Normalize unpacked pixels of two interleaved bayer channels in place.
+ *
+ * The even pixels belong to the first channel, the odd pixels to the second one.
+ * Each pixel is transformed as min((max(pixel, black) - black) * multiplier >> NORMALIZE_SHIFT, 65535).
+ *
+ * \param data pixels to normalize
+ * \param count number of pixels, must be even
+ * \param black black level of both channels in the 16-bit scale
+ * \param multiplier fixed point multiplier of both channels, must be less than 65536
+ */
+void normalize(std::uint16_t *data, std::size_t count, const std::uint16_t black[2], const std::uint32_t multiplier[2]);
+
+/** Normalize pixels using the plain C++ implementation.
+ *
+ * Behaves exactly like normalize(), it is exposed mainly for comparison.
+ */
+void normalizeScalar(std::uint16_t *data, std::size_t count, const std::uint16_t black[2], const std::uint32_t multiplier[2]);
+
+}
+}
+
+#endif
@@ -15,17 +15,20 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <atomic>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <dirent.h>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <string>
+#include <unistd.h>
 
-#include <tbb/parallel_for_each.h>
+#include <tbb/parallel_for.h>
 
 #include <opencv2/opencv.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -39,14 +42,20 @@
 #include <camera.h>
 #include <context.h>
 #include <calibration/calibrator.h>
+#include <calibration/defectdetector.h>
 #include <calibration/fftpreprocessor.h>
 #include <calibration/lensdetector.h>
 #include <calibration/pointgrid.h>
 #include <filesystem/filesystemaccess.h>
 #include <filesystem/photo.h>
+#include <image/banddecoder.h>
+#include <image/defectmap.h>
+#include <image/exception.h>
+#include <image/framestatistics.h>
 #include <image/lightfieldimage.h>
 #include <image/metadata.h>
 #include <image/rawimage.h>
+#include <image/readahead.h>
 
 void showHelp() {
 	std::cout << "Usage:" << std::endl;
@@ -58,13 +67,99 @@ void showHelp() {
 	std::cout << "\t-t dir\t download calibration images to a specified directory" << std::endl;
 	std::cout << "\t-c dir\t calibrate using files from a specified directory" << std::endl;
 	std::cout << "\t      \t The output is stored in file \"calibration.json\"" << std::endl;
+	std::cout << "\t-D dir\t detect defective pixels using calibration files from a specified directory" << std::endl;
+	std::cout << "\t      \t The output is stored in file \"defects.json\"" << std::endl;
 	std::cout << "\t-p dir\t process images in the selected directory." << std::endl;
 	std::cout << "\t      \t The option requires a file \"calibration.json\" to exist" << std::endl;
 	std::cout << "\t      \t in the selected directory." << std::endl;
+	std::cout << "\t-s dir\t create half resolution previews of images in the selected directory" << std::endl;
+	std::cout << "\t      \t and print a summary of their exposure." << std::endl;
+	std::cout << "\t      \t The defective pixels listed in \"defects.json\" are corrected by -p and -s" << std::endl;
+	std::cout << "\t      \t if the file exists in the selected directory." << std::endl;
+	std::cout << "\t-r num\t number of images read ahead by -c, -D, -p and -s, 4 by default (must precede them)" << std::endl;
+	std::cout << "\t-T size\t split the images into tiles of the given size for the lens detection by -c," << std::endl;
+	std::cout << "\t       \t 0 processes whole images, the default (must precede -c)" << std::endl;
 	std::cout << "\t-f path\t download a file specified by a full path, potentialy dangerous" << std::endl;
 	std::cout << "\t     \t Requires knowledge of the camera file structure." << std::endl;
 }
 
+/**
+ * Parse metadata from a file read into memory.
+ */
+Lyli::Image::Metadata readMetadata(const Lyli::Image::FileBuffer &buffer) {
+	std::istringstream is(std::string(reinterpret_cast<const char*>(buffer.getData()), buffer.getSize()));
+	return Lyli::Image::Metadata(is);
+}
+
+/**
+ * Check whether a file exists.
+ */
+bool fileExists(const std::string &path) {
+	return access(path.c_str(), F_OK) == 0;
+}
+
+/**
+ * List the RAW files in the current directory.
+ *
+ * \param requireMetadata skip the files without metadata
+ */
+std::vector<std::string> listRawFiles(bool requireMetadata) {
+	try {
+		return Lyli::Image::listRawFiles(".", requireMetadata);
+	} catch (Lyli::Image::Exception& e) {
+		std::cerr << e.what() << std::endl;
+		return std::vector<std::string>();
+	}
+}
+
+/**
+ * Read the defect map if the file exists.
+ */
+std::shared_ptr<const Lyli::Image::DefectMap> readDefectMap(const std::string &path) {
+	if (!fileExists(path)) {
+		return nullptr;
+	}
+	std::fstream fin(path, std::fstream::in | std::fstream::binary);
+	Json::CharReaderBuilder readerbuilder;
+	Json::Value root;
+	Json::parseFromStream(readerbuilder, fin, &root, 0);
+	auto defects = std::make_shared<Lyli::Image::DefectMap>();
+	defects->deserialize(root);
+	return defects;
+}
+
+/**
+ * Get the options correcting the defects if the defect map belongs to the camera that took the image.
+ */
+Lyli::Image::DecodeOptions getDefectOptions(const Lyli::Image::DecodeOptions &options,
+                                            const std::shared_ptr<const Lyli::Image::DefectMap> &defects,
+                                            const Lyli::Image::Metadata &metadata) {
+	Lyli::Image::DecodeOptions result(options);
+	if (defects && defects->getSerial() == metadata.getPrivatemetadata().getCamera().getSerialnumber()) {
+		result.defects = defects;
+	}
+	return result;
+}
+
+/**
+ * Print a summary of the exposure of an image.
+ */
+void printExposure(const std::string &filebase, const Lyli::Image::FrameStatistics &statistics) {
+	static const char *CHANNEL_NAMES[Lyli::Image::FrameStatistics::CHANNELS] = {"R", "Gr", "Gb", "B"};
+	std::stringstream ss;
+	ss << filebase << " mean";
+	std::uint64_t count = 0;
+	std::uint64_t clipped = 0;
+	for (int channel = 0; channel < Lyli::Image::FrameStatistics::CHANNELS; ++channel) {
+		ss << " " << CHANNEL_NAMES[channel] << " " << std::fixed << std::setprecision(1)
+		   << 100.0 * statistics.getMean(channel) / 65535.0 << "%";
+		count += statistics.getCount(channel);
+		clipped += statistics.getClippedWhite(channel);
+	}
+	ss << ", clipped " << std::setprecision(2) << (count == 0 ? 0.0 : 100.0 * clipped / count) << "%";
+	std::cout << ss.str() << std::endl;
+}
+
 /**
  * Prepare the selected camera and return a pointer to the camera to use.
  */
@@ -167,67 +262,51 @@ void downloadCalib(Lyli::Camera *camera, const std::string &path) {
 	}
 }
 
-void calibrate(const std::string& path, const std::string& out) {
-	std::vector<std::string> files;
-
+void calibrate(const std::string& path, const std::string& out, std::size_t readAhead, int tileSize) {
 	if (chdir(path.c_str()) != 0) {
 		std::perror("failed to change directory");
 		return;
 	}
 
 	// read all files
-	DIR *dir = opendir(".");
-	if (dir == nullptr) {
-		std::perror("failed to change directory");
-		return;
-	}
-	dirent *ent;
-	const std::string ext(".RAW");
-	while ((ent = readdir(dir)) != nullptr) {
-		std::string file(ent->d_name);
-		if (file.size() < ext.size()
-		    || ! std::equal(ext.rbegin(), ext.rend(), file.rbegin())) {
-			// skip the file
-			continue;
-		}
-		std::string filebase(file.substr(0, file.size() - 4));
-		files.push_back(filebase);
+	const std::vector<std::string> files(listRawFiles(true));
+
+	// the metadata and the image of each file are read ahead in the order of processing
+	std::vector<std::string> paths;
+	for (const auto &filebase : files) {
+		paths.push_back(filebase + ".TXT");
+		paths.push_back(filebase + ".RAW");
 	}
-	closedir(dir);
 
 	// calibrate
 	Lyli::Calibration::Calibrator calibrator;
-	Lyli::Calibration::LensDetector lensDetector(std::make_unique<Lyli::Calibration::FFTPreprocessor>());
+	Lyli::Calibration::LensDetector lensDetector(std::make_unique<Lyli::Calibration::FFTPreprocessor>(tileSize));
 	try {
-		tbb::parallel_for_each(
-			std::begin(files),
-			std::end(files),
-			[&calibrator,&lensDetector](const auto &filebase) {
+		Lyli::Image::ReadAhead reader(paths, 2 * readAhead);
+		std::atomic<std::size_t> next(0);
+		tbb::parallel_for(std::size_t(0), files.size(), [&](std::size_t) {
+			// the files are taken in order regardless of the iteration, so that they match the read ahead
+			const std::size_t index = next++;
+			const std::string &filebase = files[index];
 			std::cout << filebase << " reading image..." << std::endl;
-			std::stringstream ss;
 
 			// read metadata
-			ss << filebase << ".TXT";
-			std::fstream finmeta(ss.str(), std::fstream::in | std::fstream::binary);
-			if (!finmeta.good()) {
-				std::cout << filebase << " missing metadata, skipping" << std::endl;
-				return;
-			}
-			ss.str("");
-			ss.clear();
-			Lyli::Image::Metadata metadata(finmeta);
+			Lyli::Image::Metadata metadata(readMetadata(*reader.read(2 * index)));
 
 			// read image
-			ss << filebase << ".RAW";
-			std::fstream fin(ss.str(), std::fstream::in | std::fstream::binary);
-			ss.str("");
-			ss.clear();
-			Lyli::Image::RawImage rawimg(fin, 3280, 3280);
+			Lyli::Image::BandDecoder decoder(Lyli::Image::BandDecoder::fromBuffer(reader.read(2 * index + 1),
+			                                                                      Lyli::Image::RawFormat(metadata)));
+
+			// reject the flat images before decoding the whole image
+			if (Lyli::Calibration::LensDetector::isFlat(decoder)) {
+				std::cout << filebase << " image is too flat, skipping" << std::endl;
+				return;
+			}
 
 			// detect the lenses
 			std::cout << filebase << " processing image..." << std::endl;
 
-			Lyli::Calibration::PointGrid pointGrid = lensDetector.detect(rawimg.getData());
+			Lyli::Calibration::PointGrid pointGrid = lensDetector.detect(decoder);
 			if (pointGrid.isEmpty()) {
 				std::cout << filebase << " image is too flat, skipping" << std::endl;
 				return;
@@ -239,6 +318,9 @@ void calibrate(const std::string& path, const std::string& out) {
 	} catch (Lyli::Calibration::CameraDiffersException& e) {
 		std::cerr << e.what() << std::endl;
 		std::exit(EXIT_FAILURE);
+	} catch (Lyli::Image::Exception& e) {
+		std::cerr << e.what() << std::endl;
+		std::exit(EXIT_FAILURE);
 	}
 
 	// CALIBRATE!
@@ -254,33 +336,72 @@ void calibrate(const std::string& path, const std::string& out) {
 	fout.close();
 }
 
-void process(const std::string& path, const std::string& in) {
-	std::vector<std::string> files;
-
+void detectDefects(const std::string& path, const std::string& out, std::size_t readAhead) {
 	if (chdir(path.c_str()) != 0) {
 		std::perror("failed to change directory");
 		return;
 	}
 
 	// read all files
-	DIR *dir = opendir(".");
-	if (dir == nullptr) {
+	const std::vector<std::string> files(listRawFiles(true));
+
+	// the metadata and the image of each file are read ahead in the order of processing
+	std::vector<std::string> paths;
+	for (const auto &filebase : files) {
+		paths.push_back(filebase + ".TXT");
+		paths.push_back(filebase + ".RAW");
+	}
+
+	// gather the statistics, all images are used, including the flat ones
+	Lyli::Calibration::DefectDetector detector;
+	try {
+		Lyli::Image::ReadAhead reader(paths, 2 * readAhead);
+		std::atomic<std::size_t> next(0);
+		tbb::parallel_for(std::size_t(0), files.size(), [&](std::size_t) {
+			// the files are taken in order regardless of the iteration, so that they match the read ahead
+			const std::size_t index = next++;
+			const std::string &filebase = files[index];
+			std::cout << filebase << " processing image..." << std::endl;
+
+			Lyli::Image::Metadata metadata(readMetadata(*reader.read(2 * index)));
+			Lyli::Image::RawImage rawimg(Lyli::Image::RawImage::fromBuffer(*reader.read(2 * index + 1),
+			                                                               Lyli::Image::RawFormat(metadata)));
+			detector.addImage(rawimg.getMosaic(), metadata);
+		});
+	} catch (Lyli::Calibration::CameraDiffersException& e) {
+		std::cerr << e.what() << std::endl;
+		std::exit(EXIT_FAILURE);
+	} catch (Lyli::Image::Exception& e) {
+		std::cerr << e.what() << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+
+	Lyli::Image::DefectMap defects(detector.createDefectMap());
+	std::cout << defects.getPixels().size() << " defective pixels found" << std::endl;
+
+	// store the results
+	Json::Value json = defects.serialize();
+	std::ofstream fout(out, std::fstream::out | std::fstream::trunc | std::fstream::binary);
+	Json::StyledStreamWriter styledWriter;
+	styledWriter.write(fout, json);
+	fout.close();
+}
+
+void process(const std::string& path, const std::string& in, std::size_t readAhead) {
+	if (chdir(path.c_str()) != 0) {
 		std::perror("failed to change directory");
 		return;
 	}
-	dirent *ent;
-	const std::string ext(".RAW");
-	while ((ent = readdir(dir)) != nullptr) {
-		std::string file(ent->d_name);
-		if (file.size() < ext.size()
-		    || ! std::equal(ext.rbegin(), ext.rend(), file.rbegin())) {
-			// skip the file
-			continue;
-		}
-		std::string filebase(file.substr(0, file.size() - 4));
-		files.push_back(filebase);
+
+	// read all files
+	const std::vector<std::string> files(listRawFiles(true));
+
+	// the metadata and the image of each file are read ahead in the order of processing
+	std::vector<std::string> paths;
+	for (const auto &filebase : files) {
+		paths.push_back(filebase + ".TXT");
+		paths.push_back(filebase + ".RAW");
 	}
-	closedir(dir);
 
 	// read calibration data
 	std::fstream fin(in, std::fstream::in | std::fstream::binary);
@@ -289,34 +410,110 @@ void process(const std::string& path, const std::string& in) {
 	Json::parseFromStream(readerbuilder, fin, &root, 0);
 	Lyli::Calibration::CalibrationData calibration;
 	calibration.deserialize(root);
+	const std::shared_ptr<const Lyli::Image::DefectMap> defects(readDefectMap("defects.json"));
 
-	tbb::parallel_for_each(files, [&calibration](const auto &filebase) {
-		std::cout << filebase << " reading image..." << std::endl;
-		std::stringstream ss;
+	try {
+		Lyli::Image::ReadAhead reader(paths, 2 * readAhead);
+		std::atomic<std::size_t> next(0);
+		tbb::parallel_for(std::size_t(0), files.size(), [&](std::size_t) {
+			// the files are taken in order regardless of the iteration, so that they match the read ahead
+			const std::size_t index = next++;
+			const std::string &filebase = files[index];
+			std::cout << filebase << " reading image..." << std::endl;
+			std::stringstream ss;
 
-		// read image
-		ss << filebase << ".RAW";
-		std::fstream fin(ss.str(), std::fstream::in | std::fstream::binary);
-		ss.str("");
-		ss.clear();
-		Lyli::Image::RawImage rawimg(fin, 3280, 3280);
+			// read metadata
+			Lyli::Image::Metadata metadata(readMetadata(*reader.read(2 * index)));
 
-		// read metadata
-		ss << filebase << ".TXT";
-		std::fstream finmeta(ss.str(), std::fstream::in | std::fstream::binary);
-		ss.str("");
-		ss.clear();
-		Lyli::Image::Metadata metadata(finmeta);
-
-		// straighten etc.
-		Lyli::Image::LightfieldImage lightfieldimg(rawimg, metadata, calibration);
-		cv::Mat bgrImage;
-		cv::cvtColor(lightfieldimg.getData(), bgrImage, cv::COLOR_RGB2BGR);
-		ss << filebase << "-flat.png";
-		cv::imwrite(ss.str(), bgrImage);
-		ss.str("");
-		ss.clear();
-	});
+			// read image
+			Lyli::Image::BandDecoder decoder(Lyli::Image::BandDecoder::fromBuffer(reader.read(2 * index + 1),
+			                                                                      Lyli::Image::RawFormat(metadata),
+			                                                                      getDefectOptions(Lyli::Image::DecodeOptions(), defects, metadata)));
+
+			// straighten etc., the image is sampled while it is decoded
+			Lyli::Image::LightfieldImage lightfieldimg(decoder, metadata, calibration);
+			cv::Mat bgrImage;
+			cv::cvtColor(lightfieldimg.getData(), bgrImage, cv::COLOR_RGB2BGR);
+			ss << filebase << "-flat.png";
+			cv::imwrite(ss.str(), bgrImage);
+			ss.str("");
+			ss.clear();
+		});
+	} catch (Lyli::Image::Exception& e) {
+		std::cerr << e.what() << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+}
+
+void preview(const std::string& path, std::size_t readAhead) {
+	if (chdir(path.c_str()) != 0) {
+		std::perror("failed to change directory");
+		return;
+	}
+
+	// read all files
+	const std::vector<std::string> files(listRawFiles(false));
+
+	// the metadata are read ahead only for images that have them
+	const std::size_t NO_METADATA = static_cast<std::size_t>(-1);
+	std::vector<std::string> paths;
+	std::vector<std::size_t> metaIndices;
+	std::vector<std::size_t> rawIndices;
+	for (const auto &filebase : files) {
+		if (fileExists(filebase + ".TXT")) {
+			metaIndices.push_back(paths.size());
+			paths.push_back(filebase + ".TXT");
+		}
+		else {
+			metaIndices.push_back(NO_METADATA);
+		}
+		rawIndices.push_back(paths.size());
+		paths.push_back(filebase + ".RAW");
+	}
+
+	Lyli::Image::DecodeOptions options;
+	options.halfSize = true;
+	options.statistics = true;
+	// the preview is stored as an 8-bit gamma encoded image
+	options.storage = Lyli::Image::PixelStorage::GAMMA8;
+	const std::shared_ptr<const Lyli::Image::DefectMap> defects(readDefectMap("defects.json"));
+
+	try {
+		Lyli::Image::ReadAhead reader(paths, 2 * readAhead);
+		std::atomic<std::size_t> next(0);
+		tbb::parallel_for(std::size_t(0), files.size(), [&](std::size_t) {
+			// the files are taken in order regardless of the iteration, so that they match the read ahead
+			const std::size_t index = next++;
+			const std::string &filebase = files[index];
+			std::cout << filebase << " reading image..." << std::endl;
+			std::stringstream ss;
+
+			// read the format from metadata if they are available
+			Lyli::Image::RawFormat format;
+			Lyli::Image::DecodeOptions imageOptions(options);
+			if (metaIndices[index] != NO_METADATA) {
+				const Lyli::Image::Metadata metadata(readMetadata(*reader.read(metaIndices[index])));
+				format = Lyli::Image::RawFormat(metadata);
+				imageOptions = getDefectOptions(options, defects, metadata);
+				// the pixels are clipped at the levels of the sensor
+				imageOptions.normalization = Lyli::Image::Normalization(metadata);
+			}
+
+			// read image
+			Lyli::Image::RawImage rawimg(Lyli::Image::RawImage::fromBuffer(*reader.read(rawIndices[index]), format, imageOptions));
+			printExposure(filebase, rawimg.getStatistics());
+
+			cv::Mat bgrImage;
+			cv::cvtColor(rawimg.getData(), bgrImage, cv::COLOR_RGB2BGR);
+			ss << filebase << "-preview.png";
+			cv::imwrite(ss.str(), bgrImage);
+			ss.str("");
+			ss.clear();
+		});
+	} catch (Lyli::Image::Exception& e) {
+		std::cerr << e.what() << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
 }
 
 void downloadFile(Lyli::Camera *camera, const std::string &path) {
@@ -339,7 +536,7 @@ int main(int argc, char *argv[]) {
 
 	// first prepare camera if we are calling a function requiring camera to be operating
 	int c;
-	while ((c = getopt(argc, argv, "ild:t:c:f:p:")) != -1) {
+	while ((c = getopt(argc, argv, "ild:t:c:D:f:p:s:r:T:")) != -1) {
 		switch (c) {
 			case 'i':
 			case 'l':
@@ -357,7 +554,9 @@ int main(int argc, char *argv[]) {
 	optind = 1;
 
 	// process the options
-	while ((c = getopt(argc, argv, "ild:t:c:f:p:")) != -1) {
+	std::size_t readAhead = 4;
+	int tileSize = 0;
+	while ((c = getopt(argc, argv, "ild:t:c:D:f:p:s:r:T:")) != -1) {
 		switch (c) {
 			case 'i':
 				getCameraInformation(camera);
@@ -372,14 +571,34 @@ int main(int argc, char *argv[]) {
 				downloadCalib(camera, optarg);
 				return 0;
 			case 'c':
-				calibrate(optarg, "calibration.json");
+				calibrate(optarg, "calibration.json", readAhead, tileSize);
+				return 0;
+			case 'D':
+				detectDefects(optarg, "defects.json", readAhead);
 				return 0;
 			case 'f':
 				downloadFile(camera, optarg);
 				return 0;
 			case 'p':
-				process(optarg, "calibration.json");
+				process(optarg, "calibration.json", readAhead);
+				return 0;
+			case 's':
+				preview(optarg, readAhead);
 				return 0;
+			case 'r':
+				if (atoi(optarg) <= 0) {
+					std::cerr << "The number of images read ahead must be positive" << std::endl;
+					return 1;
+				}
+				readAhead = atoi(optarg);
+				break;
+			case 'T':
+				if (atoi(optarg) < 0) {
+					std::cerr << "The tile size must not be negative" << std::endl;
+					return 1;
+				}
+				tileSize = atoi(optarg);
+				break;
 			default:
 				showHelp();
 				return 1;
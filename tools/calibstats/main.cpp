@@ -19,7 +19,6 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <dirent.h>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
@@ -35,8 +34,10 @@
 #include <calibration/fftpreprocessor.h>
 #include <calibration/lensdetector.h>
 #include <calibration/pointgrid.h>
+#include <image/banddecoder.h>
+#include <image/exception.h>
 #include <image/metadata.h>
-#include <image/rawimage.h>
+#include <image/readahead.h>
 
 void showHelp() {
 	std::cout << "Usage:" << std::endl;
@@ -45,36 +46,19 @@ void showHelp() {
 }
 
 void calibrate(const std::string &path) {
-	std::vector<std::string> files;
-
 	if (chdir(path.c_str()) != 0) {
 		std::perror("failed to change directory");
 		return;
 	}
 
-	// read all files
-	DIR *dir = opendir(".");
-	if (dir == nullptr) {
-		std::perror("failed to change directory");
+	// read all files, sorted (it's more user-friendly)
+	std::vector<std::string> files;
+	try {
+		files = Lyli::Image::listRawFiles(".", true);
+	} catch (Lyli::Image::Exception& e) {
+		std::cerr << e.what() << std::endl;
 		return;
 	}
-	dirent *ent;
-	const std::string ext(".RAW");
-	while ((ent = readdir(dir)) != nullptr) {
-		std::string file(ent->d_name);
-		if (file.size() < ext.size()
-		    || ! std::equal(ext.rbegin(), ext.rend(), file.rbegin())) {
-			// skip the files without the .RAW extension
-			continue;
-		}
-		std::string filebase(file.substr(0, file.size() - 4));
-		files.push_back(filebase);
-	}
-	closedir(dir);
-	//files.push_back("MOD_0054");
-
-	// sort the files (it's more user-friendly)
-	std::sort(files.begin(), files.end());
 
 	// add images to the calibrator
 	Lyli::Calibration::Calibrator calibrator;
@@ -86,23 +70,29 @@ void calibrate(const std::string &path) {
 		std::cout << filebase << " reading image..." << std::endl;
 		std::stringstream ss;
 
-		// read image
-		ss << filebase << ".RAW";
-		std::fstream fin(ss.str(), std::fstream::in | std::fstream::binary);
-		ss.str("");
-		ss.clear();
-		Lyli::Image::RawImage rawimg(fin, 3280, 3280);
-
 		// read metadata
 		ss << filebase << ".TXT";
 		std::fstream finmeta(ss.str(), std::fstream::in | std::fstream::binary);
 		ss.str("");
 		ss.clear();
 		Lyli::Image::Metadata metadata(finmeta);
+
+		// read image
+		ss << filebase << ".RAW";
+		Lyli::Image::BandDecoder decoder(Lyli::Image::BandDecoder::fromFile(ss.str(), Lyli::Image::RawFormat(metadata)));
+		ss.str("");
+		ss.clear();
+
+		// reject the flat images before decoding the whole image
+		if (Lyli::Calibration::LensDetector::isFlat(decoder)) {
+			std::cout << filebase << " image is too flat, skipping" << std::endl;
+			return;
+		}
+
 		// detect the lenses
 		std::cout << filebase << " processing image..." << std::endl;
 
-		Lyli::Calibration::PointGrid pointGrid = lensDetector.detect(rawimg.getData());
+		Lyli::Calibration::PointGrid pointGrid = lensDetector.detect(decoder);
 		if (pointGrid.isEmpty()) {
 			std::cout << filebase << " image is too flat, skipping" << std::endl;
 			return;
@@ -180,6 +170,11 @@ int main(int argc, char *argv[]) {
 		std::cerr << "exitting" << std::endl;
 		return 1;
 	}
+	catch (const ::Lyli::Image::Exception& e) {
+		std::cerr << "caught exception: " << e.what() << std::endl;
+		std::cerr << "exitting" << std::endl;
+		return 1;
+	}
 	return 0;
 }
 
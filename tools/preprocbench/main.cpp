@@ -0,0 +1,381 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include <json/reader.h>
+#include <json/value.h>
+
+#include <calibration/boxpreprocessor.h>
+#include <calibration/calibrationdata.h>
+#include <calibration/exception.h>
+#include <calibration/fftpreprocessor.h>
+#include <calibration/lensdetector.h>
+#include <calibration/pointgrid.h>
+#include <image/banddecoder.h>
+#include <image/exception.h>
+#include <image/metadata.h>
+#include <image/readahead.h>
+
+namespace {
+
+// the centroids closer than this are considered the same lens
+constexpr float MATCH_DISTANCE = 1.0f;
+
+/**
+ * A preprocessor and a lens detector using the same preprocessing.
+ *
+ * Both are kept for all images, so that their caches are filled only once.
+ */
+struct Method {
+	/**
+	 * @param create function creating a new instance of the preprocessor
+	 */
+	template<typename Create>
+	Method(const std::string &name_, const Create &create) :
+		name(name_), preprocessor(create()), detector(create()) {
+
+	}
+
+	std::string name;
+	std::unique_ptr<Lyli::Calibration::PreprocessorInterface> preprocessor;
+	Lyli::Calibration::LensDetector detector;
+	// size of the last preprocessed image, the caches are warm for it
+	cv::Size warmSize;
+	// size of the last image processed by the detector
+	cv::Size detectorWarmSize;
+	// statistics accumulated over all images
+	double time = 0.0;
+	std::size_t points = 0;
+};
+
+/**
+ * Statistics of the comparison accumulated over all images.
+ */
+struct Totals {
+	int images = 0;
+	double maskAgreement = 0.0;
+	std::size_t matched = 0;
+	double distance = 0.0;
+};
+
+/**
+ * Statistics of the guided detection accumulated over all images.
+ */
+struct GuidedTotals {
+	int images = 0;
+	double time = 0.0;
+	std::size_t predicted = 0;
+	std::size_t detected = 0;
+	std::size_t points = 0;
+	// sum of the drifts of all detected lenses
+	double drift = 0.0;
+	std::size_t matched = 0;
+	double distance = 0.0;
+};
+
+void showHelp() {
+	std::cout << "Usage:" << std::endl;
+	std::cout << std::endl;
+	std::cout << "\tpreprocbench [-t size | -g | -c calibration.json] path/to/calibration/files" << std::endl;
+	std::cout << std::endl;
+	std::cout << "\tCompares the masks and the lens centroids of the BoxPreprocessor with the FFTPreprocessor." << std::endl;
+	std::cout << std::endl;
+	std::cout << "\t-t size\t compare the FFTPreprocessor transforming tiles of the given size instead" << std::endl;
+	std::cout << "\t       \t of the BoxPreprocessor, " << int(Lyli::Calibration::FFTPreprocessor::DEFAULT_TILE_SIZE)
+	          << " is the size recommended for the tiles" << std::endl;
+	std::cout << "\t-g\t compare the lenses found by the GuidedLensDetector from the metadata of each image" << std::endl;
+	std::cout << "\t  \t with the lenses found by the LensDetector and report their drift" << std::endl;
+	std::cout << "\t-c file\t the same as -g, but the lenses are predicted from an existing calibration" << std::endl;
+}
+
+double getMilliseconds(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * Preprocess an image and measure the time, the caches of the method are filled before the measurement.
+ */
+cv::Mat preprocess(Method &method, const cv::Mat &gray, double &time) {
+	if (method.warmSize != gray.size()) {
+		method.preprocessor->preprocess(gray);
+		method.warmSize = gray.size();
+	}
+	const auto start = std::chrono::steady_clock::now();
+	cv::Mat mask = method.preprocessor->preprocess(gray);
+	time = getMilliseconds(start);
+	return mask;
+}
+
+/**
+ * Get the positions of the points of the grid sorted by the x coordinate.
+ */
+std::vector<cv::Point2f> getPositions(const Lyli::Calibration::PointGrid &grid) {
+	std::vector<cv::Point2f> result;
+	for (const auto &line : grid.getHorizontalLines()) {
+		for (const Lyli::Calibration::PointGrid::Point *point : line.line) {
+			result.push_back(point->getPosition());
+		}
+	}
+	std::sort(result.begin(), result.end(), [](const cv::Point2f &a, const cv::Point2f &b) { return a.x < b.x; });
+	return result;
+}
+
+/**
+ * Find the number of the points that have a counterpart in the reference.
+ *
+ * @param distance sum of the distances to the counterparts
+ */
+std::size_t matchPoints(const std::vector<cv::Point2f> &points, const std::vector<cv::Point2f> &reference, double &distance) {
+	std::size_t matched = 0;
+	for (const cv::Point2f &point : points) {
+		auto it = std::lower_bound(reference.begin(), reference.end(), point.x - MATCH_DISTANCE,
+		                           [](const cv::Point2f &a, float x) { return a.x < x; });
+		float best = MATCH_DISTANCE;
+		for (; it != reference.end() && it->x <= point.x + MATCH_DISTANCE; ++it) {
+			best = std::min(best, std::hypot(it->x - point.x, it->y - point.y));
+		}
+		if (best < MATCH_DISTANCE) {
+			++matched;
+			distance += best;
+		}
+	}
+	return matched;
+}
+
+void compare(const std::string &filebase, Method &reference, Method &candidate, Totals &totals) {
+	std::ifstream finmeta(filebase + ".TXT", std::ifstream::in | std::ifstream::binary);
+	Lyli::Image::Metadata metadata(finmeta);
+	Lyli::Image::BandDecoder decoder(Lyli::Image::BandDecoder::fromFile(filebase + ".RAW", Lyli::Image::RawFormat(metadata)));
+	if (Lyli::Calibration::LensDetector::isFlat(decoder)) {
+		std::cout << filebase << " image is too flat, skipping" << std::endl;
+		return;
+	}
+
+	// masks
+	const cv::Mat gray = decoder.decodeLuminance();
+	double referenceTime;
+	double candidateTime;
+	const cv::Mat referenceMask = preprocess(reference, gray, referenceTime);
+	const cv::Mat candidateMask = preprocess(candidate, gray, candidateTime);
+	const double agreement = 1.0 - static_cast<double>(cv::countNonZero(referenceMask != candidateMask)) / referenceMask.total();
+
+	// centroids
+	const std::vector<cv::Point2f> referencePoints = getPositions(reference.detector.detect(decoder));
+	const std::vector<cv::Point2f> candidatePoints = getPositions(candidate.detector.detect(decoder));
+	double distance = 0.0;
+	const std::size_t matched = matchPoints(candidatePoints, referencePoints, distance);
+
+	std::cout << filebase << std::fixed << std::setprecision(1)
+	          << " " << reference.name << ": " << referenceTime << " ms, "
+	          << candidate.name << ": " << candidateTime << " ms, mask agreement: "
+	          << std::setprecision(2) << 100.0 * agreement << "%, centroids " << reference.name << ": " << referencePoints.size()
+	          << ", " << candidate.name << ": " << candidatePoints.size() << ", matched: " << matched << std::endl;
+
+	++totals.images;
+	totals.maskAgreement += agreement;
+	totals.matched += matched;
+	totals.distance += distance;
+	reference.time += referenceTime;
+	reference.points += referencePoints.size();
+	candidate.time += candidateTime;
+	candidate.points += candidatePoints.size();
+}
+
+void compareGuided(const std::string &filebase, Method &reference, const Lyli::Calibration::CalibrationData *calibration,
+                   GuidedTotals &totals) {
+	std::ifstream finmeta(filebase + ".TXT", std::ifstream::in | std::ifstream::binary);
+	Lyli::Image::Metadata metadata(finmeta);
+	Lyli::Image::BandDecoder decoder(Lyli::Image::BandDecoder::fromFile(filebase + ".RAW", Lyli::Image::RawFormat(metadata)));
+	if (Lyli::Calibration::LensDetector::isFlat(decoder)) {
+		std::cout << filebase << " image is too flat, skipping" << std::endl;
+		return;
+	}
+	std::unique_ptr<Lyli::Calibration::GuidedLensDetector> guided(calibration != nullptr
+		? std::make_unique<Lyli::Calibration::GuidedLensDetector>(*calibration)
+		: std::make_unique<Lyli::Calibration::GuidedLensDetector>(metadata));
+
+	// the caches of the reference are filled before the measurement
+	const cv::Size size(decoder.getWidth(), decoder.getHeight());
+	if (reference.detectorWarmSize != size) {
+		reference.detector.detect(decoder);
+		reference.detectorWarmSize = size;
+	}
+	auto start = std::chrono::steady_clock::now();
+	const std::vector<cv::Point2f> referencePoints = getPositions(reference.detector.detect(decoder));
+	const double referenceTime = getMilliseconds(start);
+	Lyli::Calibration::LensDrift drift;
+	start = std::chrono::steady_clock::now();
+	const std::vector<cv::Point2f> guidedPoints = getPositions(guided->detect(decoder, drift));
+	const double guidedTime = getMilliseconds(start);
+	double distance = 0.0;
+	const std::size_t matched = matchPoints(guidedPoints, referencePoints, distance);
+
+	std::cout << filebase << std::fixed << std::setprecision(1)
+	          << " " << reference.name << ": " << referenceTime << " ms, guided: " << guidedTime << " ms, "
+	          << std::setprecision(2) << "shift: (" << drift.shiftX << ", " << drift.shiftY << ") px, lenses predicted: "
+	          << drift.predicted << ", detected: " << drift.detected << ", mean drift: (" << drift.meanX << ", " << drift.meanY
+	          << ") px, mean distance: " << drift.meanDistance << " px, max: " << drift.maxDistance << " px, centroids "
+	          << reference.name << ": " << referencePoints.size() << ", guided: " << guidedPoints.size()
+	          << ", matched: " << matched << std::endl;
+
+	++totals.images;
+	reference.time += referenceTime;
+	reference.points += referencePoints.size();
+	totals.time += guidedTime;
+	totals.predicted += drift.predicted;
+	totals.detected += drift.detected;
+	totals.points += guidedPoints.size();
+	totals.drift += drift.meanDistance * drift.detected;
+	totals.matched += matched;
+	totals.distance += distance;
+}
+
+void printTotals(const Method &reference, const Method &candidate, const Totals &totals) {
+	std::cout << std::endl << std::fixed << std::setprecision(1)
+	          << "images: " << totals.images << std::endl
+	          << "average " << reference.name << " time: " << reference.time / totals.images << " ms" << std::endl
+	          << "average " << candidate.name << " time: " << candidate.time / totals.images << " ms" << std::endl
+	          << std::setprecision(2)
+	          << "average mask agreement: " << 100.0 * totals.maskAgreement / totals.images << "%" << std::endl
+	          << "centroids " << reference.name << ": " << reference.points << ", " << candidate.name << ": " << candidate.points
+	          << ", matched: " << totals.matched << " (" << 100.0 * totals.matched / std::max<std::size_t>(reference.points, 1)
+	          << "% of " << reference.name << ")" << std::endl
+	          << std::setprecision(3)
+	          << "mean distance of the matched centroids: " << totals.distance / std::max<std::size_t>(totals.matched, 1) << " px" << std::endl;
+}
+
+void printGuidedTotals(const Method &reference, const GuidedTotals &totals) {
+	std::cout << std::endl << std::fixed << std::setprecision(1)
+	          << "images: " << totals.images << std::endl
+	          << "average " << reference.name << " detection time: " << reference.time / totals.images << " ms" << std::endl
+	          << "average guided detection time: " << totals.time / totals.images << " ms" << std::endl
+	          << std::setprecision(2)
+	          << "lenses predicted: " << totals.predicted << ", detected: " << totals.detected
+	          << " (" << 100.0 * totals.detected / std::max<std::size_t>(totals.predicted, 1) << "%)" << std::endl
+	          << "centroids " << reference.name << ": " << reference.points << ", guided: " << totals.points
+	          << ", matched: " << totals.matched << " (" << 100.0 * totals.matched / std::max<std::size_t>(reference.points, 1)
+	          << "% of " << reference.name << ")" << std::endl
+	          << std::setprecision(3)
+	          << "mean drift from the aligned predictions: " << totals.drift / std::max<std::size_t>(totals.detected, 1) << " px" << std::endl
+	          << "mean distance of the matched centroids: " << totals.distance / std::max<std::size_t>(totals.matched, 1) << " px" << std::endl;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+	int tileSize = 0;
+	bool guided = false;
+	std::unique_ptr<Lyli::Calibration::CalibrationData> calibration;
+	int c;
+	while ((c = getopt(argc, argv, "t:gc:")) != -1) {
+		switch (c) {
+			case 't':
+				tileSize = atoi(optarg);
+				if (tileSize <= 0) {
+					std::cerr << "The tile size must be positive" << std::endl;
+					return 1;
+				}
+				break;
+			case 'g':
+				guided = true;
+				break;
+			case 'c': {
+				std::ifstream fin(optarg, std::ifstream::in | std::ifstream::binary);
+				if (!fin.good()) {
+					std::cerr << "cannot open " << optarg << std::endl;
+					return 1;
+				}
+				Json::CharReaderBuilder readerbuilder;
+				Json::Value root;
+				Json::parseFromStream(readerbuilder, fin, &root, 0);
+				calibration = std::make_unique<Lyli::Calibration::CalibrationData>();
+				calibration->deserialize(root);
+				guided = true;
+				break;
+			}
+			default:
+				showHelp();
+				return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		showHelp();
+		return 0;
+	}
+	if (chdir(argv[optind]) != 0) {
+		std::perror("failed to change directory");
+		return 1;
+	}
+
+	Method reference("fft", []() { return std::make_unique<Lyli::Calibration::FFTPreprocessor>(); });
+	std::string candidateName("box");
+	std::function<std::unique_ptr<Lyli::Calibration::PreprocessorInterface>()> createCandidate = []() {
+		return std::make_unique<Lyli::Calibration::BoxPreprocessor>();
+	};
+	if (tileSize > 0) {
+		candidateName = "tiled";
+		createCandidate = [tileSize]() { return std::make_unique<Lyli::Calibration::FFTPreprocessor>(tileSize); };
+	}
+	Method candidate(candidateName, createCandidate);
+	Totals totals;
+	GuidedTotals guidedTotals;
+	try {
+		for (const std::string &filebase : Lyli::Image::listRawFiles(".", true)) {
+			if (guided) {
+				compareGuided(filebase, reference, calibration.get(), guidedTotals);
+			}
+			else {
+				compare(filebase, reference, candidate, totals);
+			}
+		}
+	}
+	catch (const ::Lyli::Calibration::Exception& e) {
+		std::cerr << "caught exception: " << e.what() << std::endl;
+		return 1;
+	}
+	catch (const ::Lyli::Image::Exception& e) {
+		std::cerr << "caught exception: " << e.what() << std::endl;
+		return 1;
+	}
+
+	if (totals.images == 0 && guidedTotals.images == 0) {
+		std::cout << "no images compared" << std::endl;
+		return 0;
+	}
+	if (guided) {
+		printGuidedTotals(reference, guidedTotals);
+	}
+	else {
+		printTotals(reference, candidate, totals);
+	}
+	return 0;
+}
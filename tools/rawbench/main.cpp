@@ -0,0 +1,343 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include <image/banddecoder.h>
+#include <image/demosaic.h>
+#include <image/framebufferpool.h>
+#include <image/malvardemosaic.h>
+#include <image/rawcodec.h>
+#include <image/rawimage.h>
+#include <image/unpack.h>
+
+namespace {
+
+constexpr std::size_t WIDTH = 3280;
+constexpr std::size_t HEIGHT = 3280;
+constexpr int ITERATIONS = 5;
+
+/**
+ * The original RAW decoder reading the data by three bytes.
+ * Used as a reference to compare both the speed and the output.
+ */
+class ReferenceDecoder {
+public:
+	static std::size_t getColorIndex(std::size_t x, std::size_t y) {
+		if ((y & 1) != 0) {
+			return (x & 1) != 0 ? 0 : 1;
+		}
+		else {
+			return (x & 1) != 0 ? 1 : 2;
+		}
+	}
+
+	static cv::Mat unpack(std::istream &is, std::size_t width, std::size_t height) {
+		cv::Mat result(height, width, CV_16UC3);
+		unsigned char buf[3];
+		std::size_t pos(0);
+		uint16_t *data = reinterpret_cast<uint16_t*>(result.data);
+		for (std::size_t y = 0; y < height; ++y) {
+			for (std::size_t x = 0; x < width;) {
+				is.read(reinterpret_cast<char*>(buf), 3);
+				data[pos + getColorIndex(x, y)] = (buf[0] << 8) | (buf[1] & 0xF0);
+				pos += 3;
+				++x;
+				data[pos + getColorIndex(x, y)] = ((buf[1] & 0xF) << 12) | (buf[2] << 4);
+				pos += 3;
+				++x;
+			}
+		}
+		return result;
+	}
+
+	static void demosaic(cv::Mat &image) {
+		uint16_t *data = reinterpret_cast<uint16_t*>(image.data);
+		const int Y_OFF = image.cols * 3;
+		const int X_OFF = 3;
+		const int ROW_MAX = image.rows - 1;
+		const int COL_MAX = image.cols - 1;
+		int x, y, pos;
+		for (y = 1; y < ROW_MAX; y += 2) {
+			for (x = 2; x < COL_MAX; x += 2) {
+				pos = (y * image.cols + x) * 3;
+				data[pos] = 0.5 * (data[pos - X_OFF]+ data[pos + X_OFF]);
+				data[pos+2] = 0.5 * (data[pos - Y_OFF + 2] + data[pos + Y_OFF + 2]);
+			}
+		}
+		for (y = 2; y < ROW_MAX; y += 2) {
+			for (x = 1; x < COL_MAX; x += 2) {
+				pos = (y * image.cols + x) * 3;
+				data[pos] = 0.5 * (data[pos - Y_OFF] + data[pos + Y_OFF]);
+				data[pos + 2] = 0.5 * (data[pos - X_OFF + 2] + data[pos + X_OFF + 2]);
+			}
+		}
+		for (y = 2; y < ROW_MAX; y += 2) {
+			for (x = 2; x < COL_MAX; x += 2) {
+				pos = (y * image.cols + x) * 3;
+				data[pos] = bilinear(data[pos - X_OFF + Y_OFF], data[pos - X_OFF - Y_OFF],
+				                     data[pos + X_OFF + Y_OFF], data[pos + X_OFF - Y_OFF]);
+				data[pos + 1] = average(data[pos - X_OFF + 1], data[pos + X_OFF + 1],
+				                        data[pos - Y_OFF + 1], data[pos + Y_OFF + 1]);
+			}
+		}
+		for (y = 1; y < ROW_MAX; y += 2) {
+			for (x = 1; x < COL_MAX; x += 2) {
+				pos = (y * image.cols + x) * 3;
+				data[pos + 2] = bilinear(data[pos - X_OFF + Y_OFF + 2], data[pos - X_OFF - Y_OFF + 2],
+				                         data[pos + X_OFF + Y_OFF + 2], data[pos + X_OFF - Y_OFF + 2]);
+				data[pos + 1] = average(data[pos - X_OFF + 1], data[pos + X_OFF + 1],
+				                        data[pos - Y_OFF + 1], data[pos + Y_OFF + 1]);
+			}
+		}
+		image.row(1).copyTo(image.row(0));
+		image.row(ROW_MAX - 1).copyTo(image.row(ROW_MAX));
+		image.col(1).copyTo(image.col(0));
+		image.col(COL_MAX - 1).copyTo(image.col(COL_MAX));
+	}
+
+private:
+	static uint16_t bilinear(double f00, double f01, double f10, double f11) {
+		return 0.5 * (0.5 * (f00 + f10) + 0.5 * (f01 + f11));
+	}
+
+	static uint16_t average(double f00, double f01, double f10, double f11) {
+		return 0.25 * (f00 + f01 + f10 + f11);
+	}
+};
+
+/**
+ * Run the function several times and return the best time in milliseconds.
+ */
+template <typename Function>
+double measure(Function function) {
+	double best = 0.0;
+	for (int i = 0; i < ITERATIONS; ++i) {
+		auto start = std::chrono::steady_clock::now();
+		function();
+		auto end = std::chrono::steady_clock::now();
+		double time = std::chrono::duration<double, std::milli>(end - start).count();
+		if (i == 0 || time < best) {
+			best = time;
+		}
+	}
+	return best;
+}
+
+void report(const std::string &name, double time, double reference) {
+	std::cout << std::setw(24) << std::left << name
+	          << std::setw(10) << std::right << std::fixed << std::setprecision(2) << time << " ms"
+	          << std::setw(10) << std::setprecision(2) << reference / time << "x" << std::endl;
+}
+
+bool identical(const cv::Mat &a, const cv::Mat &b) {
+	return a.size() == b.size() && a.type() == b.type() && cv::norm(a, b, cv::NORM_INF) == 0;
+}
+
+void showHelp() {
+	std::cout << "Usage:" << std::endl;
+	std::cout << std::endl;
+	std::cout << "\trawbench [file.RAW]" << std::endl;
+	std::cout << std::endl;
+	std::cout << "\tWithout a file, a random frame is used." << std::endl;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+	if (argc > 2) {
+		showHelp();
+		return 0;
+	}
+
+	// prepare the input
+	std::string packed;
+	if (argc == 2) {
+		std::ifstream fin(argv[1], std::ifstream::in | std::ifstream::binary);
+		if (!fin.good()) {
+			std::cerr << "cannot open " << argv[1] << std::endl;
+			return 1;
+		}
+		packed.assign(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+	}
+	else {
+		std::mt19937 generator;
+		packed.resize(WIDTH * HEIGHT * 3 / 2);
+		for (auto &byte : packed) {
+			byte = generator();
+		}
+	}
+	if (packed.size() < WIDTH * HEIGHT * 3 / 2) {
+		std::cerr << "the input is too short" << std::endl;
+		return 1;
+	}
+	const std::uint8_t *packedData = reinterpret_cast<const std::uint8_t*>(packed.data());
+	const Lyli::Image::RawFormat format;
+
+	// unpacking only
+	std::cout << "unpack" << std::endl;
+	cv::Mat reference;
+	double referenceTime = measure([&]() {
+		std::istringstream is(packed);
+		reference = ReferenceDecoder::unpack(is, WIDTH, HEIGHT);
+	});
+	std::vector<std::uint16_t> unpacked(WIDTH * HEIGHT);
+	report("reference (istream)", referenceTime, referenceTime);
+	report("scalar", measure([&]() {
+		Lyli::Image::unpack12Scalar(packedData, unpacked.data(), unpacked.size());
+	}), referenceTime);
+	report("simd", measure([&]() {
+		Lyli::Image::unpack12(packedData, unpacked.data(), unpacked.size());
+	}), referenceTime);
+	// the other packings, the number of pixels is reduced to fit the same data
+	for (int bits : {10, 12, 14}) {
+		for (Lyli::Image::ByteOrder byteOrder : {Lyli::Image::ByteOrder::BIG, Lyli::Image::ByteOrder::LITTLE}) {
+			const Lyli::Image::UnpackFunction unpack = Lyli::Image::getUnpack(bits, byteOrder);
+			const std::size_t count = std::min(unpacked.size(), packed.size() * 8 / bits / 4 * 4);
+			std::stringstream name;
+			name << bits << "-bit " << (byteOrder == Lyli::Image::ByteOrder::BIG ? "big" : "little");
+			report(name.str(), measure([&]() {
+				unpack(packedData, unpacked.data(), count);
+			}), referenceTime);
+		}
+	}
+
+	// the whole decode
+	std::cout << "decode" << std::endl;
+	referenceTime = measure([&]() {
+		std::istringstream is(packed);
+		reference = ReferenceDecoder::unpack(is, WIDTH, HEIGHT);
+		ReferenceDecoder::demosaic(reference);
+	});
+	report("reference", referenceTime, referenceTime);
+	cv::Mat decoded;
+	report("RawImage", measure([&]() {
+		std::istringstream is(packed);
+		Lyli::Image::RawImage rawimg(is, format);
+		decoded = rawimg.getData();
+	}), referenceTime);
+
+	if (!identical(reference, decoded)) {
+		std::cerr << "RawImage output differs from the reference" << std::endl;
+		return 1;
+	}
+	std::cout << "output is identical" << std::endl;
+
+	// streaming decode, the bands are just dropped
+	const Lyli::Image::BandDecoder decoder(packedData, packed.size(), format);
+	report("BandDecoder", measure([&]() {
+		decoder.decode([](const cv::Mat &, int) {});
+	}), referenceTime);
+
+	std::atomic<bool> bandsIdentical(true);
+	decoder.decode([&](const cv::Mat &band, int firstRow) {
+		if (!identical(band, decoded.rowRange(firstRow, firstRow + band.rows))) {
+			bandsIdentical = false;
+		}
+	});
+	if (!bandsIdentical) {
+		std::cerr << "BandDecoder output differs from RawImage" << std::endl;
+		return 1;
+	}
+
+	// decode with the radiometric normalization, typical Lytro levels are used
+	Lyli::Image::DecodeOptions normalizeOptions;
+	normalizeOptions.normalize = true;
+	for (int i = 0; i < 4; ++i) {
+		normalizeOptions.normalization.black[i] = 168;
+		normalizeOptions.normalization.gain[i] = 1.5f;
+	}
+	report("RawImage normalized", measure([&]() {
+		std::istringstream is(packed);
+		Lyli::Image::RawImage rawimg(is, format, normalizeOptions);
+		decoded = rawimg.getData();
+	}), referenceTime);
+
+	// demosaic algorithms, compared to the bilinear demosaic
+	std::cout << "demosaic" << std::endl;
+	const cv::Mat mosaic(Lyli::Image::RawImage(packedData, packed.size(), format).getMosaic());
+	const cv::Rect frame(0, 0, WIDTH, HEIGHT);
+	const Lyli::Image::BilinearDemosaic bilinear;
+	const Lyli::Image::MalvarDemosaic malvar;
+	double bilinearTime = measure([&]() {
+		decoded = bilinear.demosaic(mosaic, frame);
+	});
+	report("bilinear", bilinearTime, bilinearTime);
+	report("malvar", measure([&]() {
+		decoded = malvar.demosaic(mosaic, frame);
+	}), bilinearTime);
+
+	// preview decode
+	std::cout << "half size" << std::endl;
+	Lyli::Image::DecodeOptions options;
+	options.halfSize = true;
+	report("RawImage half size", measure([&]() {
+		std::istringstream is(packed);
+		Lyli::Image::RawImage rawimg(is, format, options);
+		decoded = rawimg.getData();
+	}), referenceTime);
+
+	// lossless compression, the random data do not compress, so a real RAW file should be used
+	std::cout << "lossless compression" << std::endl;
+	std::vector<std::uint8_t> compressed;
+	const double compressTime = measure([&]() {
+		compressed = Lyli::Image::compressRaw(packedData, packed.size(), format);
+	});
+	std::cout << "compressed size: " << std::fixed << std::setprecision(1)
+	          << 100.0 * compressed.size() / packed.size() << "%, compression: " << compressTime << " ms" << std::endl;
+	double packedTime = measure([&]() {
+		decoded = Lyli::Image::RawImage(packedData, packed.size(), format).getMosaic();
+	});
+	report("RawImage mosaic", packedTime, packedTime);
+	report("compressed mosaic", measure([&]() {
+		decoded = Lyli::Image::RawImage(compressed.data(), compressed.size(), format).getMosaic();
+	}), packedTime);
+	report("restore RAW", measure([&]() {
+		Lyli::Image::CompressedRaw(compressed.data(), compressed.size()).decompress();
+	}), packedTime);
+	if (!identical(decoded, mosaic)) {
+		std::cerr << "the compressed mosaic differs from the original" << std::endl;
+		return 1;
+	}
+
+	// the buffers of the repeated decodes should come from the pool
+	std::cout << "frame buffer pool" << std::endl;
+	Lyli::Image::FrameBufferPool &pool = Lyli::Image::FrameBufferPool::getDefault();
+	const std::uint64_t hits = pool.getHits();
+	const std::uint64_t misses = pool.getMisses();
+	measure([&]() {
+		Lyli::Image::RawImage rawimg(packedData, packed.size(), format);
+		decoded = rawimg.getData();
+	});
+	std::cout << "hits: " << pool.getHits() - hits << ", misses: " << pool.getMisses() - misses
+	          << " (total hits: " << pool.getHits() << ", misses: " << pool.getMisses() << ")" << std::endl;
+
+	return 0;
+}
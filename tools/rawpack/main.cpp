@@ -0,0 +1,112 @@
+/*
+ * This file is part of Lyli, an application to control Lytro camera
+ * Copyright (C) 2016  Lukas Jirkovsky <l.jirkovsky @at@ gmail.com>
+ *
+ * Lyli is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include <image/exception.h>
+#include <image/mappedfile.h>
+#include <image/metadata.h>
+#include <image/rawcodec.h>
+#include <image/rawformat.h>
+
+namespace {
+
+void showHelp() {
+	std::cout << "Usage:" << std::endl;
+	std::cout << std::endl;
+	std::cout << "\trawpack [-m metadata] input.RAW output\tcompress a RAW file" << std::endl;
+	std::cout << "\trawpack -d input output.RAW\t\trestore the original RAW file" << std::endl;
+	std::cout << std::endl;
+	std::cout << "\t-m file\t the metadata describing the RAW file, the first generation camera is assumed otherwise" << std::endl;
+	std::cout << "\t-d\t decompress instead of compressing" << std::endl;
+}
+
+double getMilliseconds(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void writeFile(const std::string &path, const std::vector<std::uint8_t> &data) {
+	std::ofstream ofs(path, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+	ofs.write(reinterpret_cast<const char*>(data.data()), data.size());
+	if (!ofs.good()) {
+		throw Lyli::Image::FileAccessException("cannot write " + path);
+	}
+}
+
+}
+
+int main(int argc, char *argv[]) {
+	bool decompress = false;
+	std::string metadataPath;
+
+	int c;
+	while ((c = getopt(argc, argv, "dm:")) != -1) {
+		switch (c) {
+			case 'd':
+				decompress = true;
+				break;
+			case 'm':
+				metadataPath = optarg;
+				break;
+			default:
+				showHelp();
+				return 1;
+		}
+	}
+	if (argc - optind != 2) {
+		showHelp();
+		return 1;
+	}
+	const std::string input(argv[optind]);
+	const std::string output(argv[optind + 1]);
+
+	try {
+		const Lyli::Image::MappedFile file(input);
+		const auto start = std::chrono::steady_clock::now();
+		std::vector<std::uint8_t> result;
+		if (decompress) {
+			const Lyli::Image::CompressedRaw compressed(file.getData(), file.getSize());
+			result = compressed.decompress();
+		}
+		else {
+			Lyli::Image::RawFormat format;
+			if (!metadataPath.empty()) {
+				std::ifstream finmeta(metadataPath, std::ifstream::in | std::ifstream::binary);
+				format = Lyli::Image::RawFormat(Lyli::Image::Metadata(finmeta));
+			}
+			result = Lyli::Image::compressRaw(file.getData(), file.getSize(), format);
+		}
+		const double time = getMilliseconds(start);
+		writeFile(output, result);
+
+		std::cout << input << ": " << file.getSize() << " -> " << result.size() << " bytes ("
+		          << std::fixed << std::setprecision(1) << 100.0 * result.size() / file.getSize() << "%) in "
+		          << time << " ms" << std::endl;
+	}
+	catch (const Lyli::Image::Exception& e) {
+		std::cerr << "caught exception: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
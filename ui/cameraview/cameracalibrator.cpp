@@ -31,6 +31,7 @@
 #include <QtCore/QString>
 #include <QtCore/QStringList>
 #include <QtCore/QVariant>
+#include <QtWidgets/QMessageBox>
 #include <QtWidgets/QProgressDialog>
 
 #include <tbb/parallel_for_each.h>
@@ -41,8 +42,9 @@
 #include <calibration/fftpreprocessor.h>
 #include <calibration/lensdetector.h>
 #include <calibration/pointgrid.h>
+#include <image/banddecoder.h>
+#include <image/exception.h>
 #include <image/metadata.h>
-#include <image/rawimage.h>
 #include <filesystem/filelist.h>
 #include <filesystem/filesystemaccess.h>
 #include <filesystem/image.h>
@@ -90,7 +92,7 @@ void CameraCalibrator::onCameraChanged(Lyli::Camera* camera) {
 		Lyli::Calibration::Calibrator calibrator;
 		res = preprocess(calibrator, cacheDir, &progress);
 		if (!res) {
-			// the preprocess was cancelled
+			// the preprocess failed, the error was already reported
 			return;
 		}
 
@@ -179,13 +181,17 @@ bool CameraCalibrator::preprocess(Lyli::Calibration::Calibrator& calibrator, con
 
 			// read image
 			ss << filebase << ".RAW";
-			std::fstream fin(ss.str(), std::fstream::in | std::fstream::binary);
+			Lyli::Image::BandDecoder decoder(Lyli::Image::BandDecoder::fromFile(ss.str(), Lyli::Image::RawFormat(metadata)));
 			ss.str("");
 			ss.clear();
-			Lyli::Image::RawImage rawimg(fin, 3280, 3280);
+
+			// reject the flat images before decoding the whole image
+			if (Lyli::Calibration::LensDetector::isFlat(decoder)) {
+				return;
+			}
 
 			// detect the lenses
-			Lyli::Calibration::PointGrid pointGrid = lensDetector.detect(rawimg.getData());
+			Lyli::Calibration::PointGrid pointGrid = lensDetector.detect(decoder);
 			if (pointGrid.isEmpty()) {
 				// image is too flat, skip
 				return;
@@ -197,7 +203,10 @@ bool CameraCalibrator::preprocess(Lyli::Calibration::Calibrator& calibrator, con
 			// TODO: handle cancel
 		});
 	} catch (Lyli::Calibration::CameraDiffersException& e) {
-		// TODO handle error
+		QMessageBox::warning(progress, tr("Cannot calibrate camera"), QString::fromLocal8Bit(e.what()));
+		return false;
+	} catch (Lyli::Image::Exception& e) {
+		QMessageBox::warning(progress, tr("Cannot calibrate camera"), QString::fromLocal8Bit(e.what()));
 		return false;
 	}
 
@@ -22,7 +22,6 @@
 
 #include <QtGui/QImage>
 
-#include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <fstream>
@@ -35,54 +34,40 @@
 
 #include <config/lyliconfig.h>
 
-namespace {
-
-constexpr std::size_t IMG_WIDTH=3280;
-constexpr std::size_t IMG_HEIGHT=3280;
-
-}
-
-unsigned char LytroImage::m_gamma[4096];
-
 LytroImage::LytroImage() : m_image(nullptr) {
 
 }
 
 LytroImage::LytroImage(const char *file) {
-	std::fstream fin(file, std::fstream::in | std::fstream::binary);
-
-	Lyli::Image::RawImage rawimg(fin, IMG_WIDTH, IMG_HEIGHT);
-	fin.close();
-
 	std::string metafile(file);
 	metafile = metafile.substr(0, metafile.find_last_of(".")) + ".TXT";
 	std::fstream finmeta(metafile, std::fstream::in | std::fstream::binary);
 	Lyli::Image::Metadata metadata(finmeta);
 
+	// the displayed image is gamma encoded already when it is stored
 	cv::Mat showImg;
 	std::string serial(metadata.getPrivatemetadata().getCamera().getSerialnumber());
 	std::unique_ptr<::Lyli::Calibration::CalibrationData> calibration = LyliConfig::readCalibrationData(serial);
 	if (calibration) {
-		// simple color img
-		Lyli::Image::LightfieldImage lightfieldimg(rawimg, metadata, *calibration);
+		// simple color img, the lenses are sampled from the linear data
+		Lyli::Image::RawImage rawimg(Lyli::Image::RawImage::fromFile(file, Lyli::Image::RawFormat(metadata)));
+		Lyli::Image::LightfieldImage lightfieldimg(rawimg, metadata, *calibration, Lyli::Image::PixelStorage::GAMMA8);
 		showImg = lightfieldimg.getData();
 	}
 	else {
 		// fallback
+		Lyli::Image::DecodeOptions options;
+		options.storage = Lyli::Image::PixelStorage::GAMMA8;
+		Lyli::Image::RawImage rawimg(Lyli::Image::RawImage::fromFile(file, Lyli::Image::RawFormat(metadata), options));
 		showImg = rawimg.getData();
 	}
 
 	// show the image
-	uint16_t *rawImage = reinterpret_cast<uint16_t*>(showImg.data);
 	m_image = new QImage(showImg.cols, showImg.rows, QImage::Format_RGB32);
-	std::size_t pos(0);
-	for (std::size_t y = 0; y < static_cast<std::size_t>(showImg.rows); ++y) {
-		for (std::size_t x = 0; x < static_cast<std::size_t>(showImg.cols); ++x) {
-			m_image->setPixel(x, y, qRgb(
-								m_gamma[rawImage[pos] >> 4],
-								m_gamma[rawImage[pos+1] >> 4],
-								m_gamma[rawImage[pos+2] >> 4]));
-			pos += 3;
+	for (int y = 0; y < showImg.rows; ++y) {
+		const std::uint8_t *row = showImg.ptr<std::uint8_t>(y);
+		for (int x = 0; x < showImg.cols; ++x) {
+			m_image->setPixel(x, y, qRgb(row[3 * x], row[3 * x + 1], row[3 * x + 2]));
 		}
 	}
 }
@@ -120,14 +105,6 @@ LytroImage& LytroImage::operator=(LytroImage&& other) {
 	return *this;
 }
 
-void LytroImage::init() {
-	static double gamma = 1.0/2.2;
-	for (uint16_t i = 0; i < 4096; ++i) {
-		double tmp = i / 4096.0;
-		m_gamma[i] = std::pow(tmp, gamma) * 255;
-	}
-}
-
 const QImage *LytroImage::getQImage() const {
 	return m_image;
 }
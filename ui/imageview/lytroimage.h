@@ -26,6 +26,10 @@ class QImage;
 class LytroImage {
 public:
 	LytroImage();
+	/** Load the image.
+	 *
+	 * \throw Lyli::Image::Exception when the image cannot be loaded
+	 */
 	LytroImage(const char *file);
 	~LytroImage();
 
@@ -34,16 +38,10 @@ public:
 	LytroImage &operator=(const LytroImage &other);
 	LytroImage &operator=(LytroImage &&other);
 
-	/** Initialize static members.
-	 *
-	 */
-	static void init();
-
 	const QImage *getQImage() const;
 
 private:
 	QImage *m_image;
-	static unsigned char m_gamma[4096];
 };
 
 #endif // LYTROIMAGE_H
@@ -25,12 +25,13 @@
 #include <QtGui/QPixmap>
 #include <QtWidgets/QFileDialog>
 #include <QtWidgets/QFileSystemModel>
+#include <QtWidgets/QMessageBox>
+
+#include <image/exception.h>
 
 #include "lytroimage.h"
 
 ViewerForm::ViewerForm(QWidget *parent) : QWidget(parent), m_scale(1.0) {
-	LytroImage::init();
-
 	ui = new Ui::ViewerForm;
 	ui->setupUi(this);
 
@@ -72,7 +73,13 @@ void ViewerForm::directoryViewClicked(const QModelIndex& index) {
 
 void ViewerForm::fileViewClicked(const QModelIndex& index) {
 	// load the image
-	m_image = std::move(LytroImage(m_fileModel->fileInfo(index).absoluteFilePath().toLocal8Bit()));
+	try {
+		m_image = std::move(LytroImage(m_fileModel->fileInfo(index).absoluteFilePath().toLocal8Bit()));
+	}
+	catch (const Lyli::Image::Exception &e) {
+		QMessageBox::warning(this, tr("Cannot open image"), QString::fromLocal8Bit(e.what()));
+		return;
+	}
 	ui->image->setPixmap(QPixmap::fromImage(*m_image.getQImage()));
 }
 